@@ -20,180 +20,374 @@
 #include <stf/data_buffer.h>
 #include <stf/provider_bt.h>
 #include <stf/util.h>
-#include <endian.h>
 
 namespace stf {
 
-const BTResolver::ServiceFunction BTResolver::_serviceFunctions[] = {
-    &serviceMiBacon,
-    &serviceTelinkLYWSD03MMC_atc1441_pvvx,
-    &serviceLaica_700234,
+#if STFBT_DECODER_MIBEACON == 1
+// Xiaomi MiBeacon, unencrypted objects only
+// frame control(2) product id(2) counter(1) mac(6) object type(2) object length(1) object value
+const uint8_t g_btMiBeaconMatchTemp[] = {0x04, 0x10, 2};
+const uint8_t g_btMiBeaconMatchHum[] = {0x06, 0x10, 2};
+const uint8_t g_btMiBeaconMatchBatt[] = {0x0a, 0x10, 1};
+const uint8_t g_btMiBeaconMatchTempHum[] = {0x0d, 0x10, 4};
+const BTValueRule g_btMiBeaconTemp[] = {{edf_tempc, edt_Float, 14, 2, ebvSigned, 1, .1f}, {edf__none}};
+const BTValueRule g_btMiBeaconHum[] = {{edf_hum, edt_Float, 14, 2, ebvSigned, 1, .1f}, {edf__none}};
+const BTValueRule g_btMiBeaconBatt[] = {{edf_batt, edt_32, 14, 1, ebvUnsigned}, {edf__none}};
+const BTValueRule g_btMiBeaconTempHum[] = {{edf_tempc, edt_Float, 14, 2, ebvSigned, 1, .1f}, {edf_hum, edt_Float, 16, 2, ebvSigned, 1, .1f}, {edf__none}};
+const BTDecodeFrame g_btMiBeaconFrames[] = {
+    {16, 11, 3, g_btMiBeaconMatchTemp, g_btMiBeaconTemp},
+    {16, 11, 3, g_btMiBeaconMatchHum, g_btMiBeaconHum},
+    {15, 11, 3, g_btMiBeaconMatchBatt, g_btMiBeaconBatt},
+    {18, 11, 3, g_btMiBeaconMatchTempHum, g_btMiBeaconTempHum},
+    {0},
+};
+const BTDecodeModel g_btMiBeaconModels[] = {
+    {0x01aa, true, "LYWSDCGQ", "MiJia ", "Xiaomi, Qingping", nullptr, Discovery::_listVoltBattHumTempC + 1},
+    {BTDecodeModel::Default, true, "Unknown"},
+};
+const BTDecodeTable g_btMiBeacon = {0x16, 0xfe95, 14, 2, g_btMiBeaconModels, g_btMiBeaconFrames, nullptr};
+#endif
+
+#if STFBT_DECODER_PVVX == 1
+// Special firmware for Xiaomi LYWSD03MMC from Telink
+// See more at https://github.com/pvvx/ATC_MiThermometer (forked from https://github.com/atc1441/ATC_MiThermometer)
+const BTValueRule g_btPvvxValues[] = {
+    {edf_tempc, edt_Float, 6, 2, ebvSigned, 2, .01f},
+    {edf_hum, edt_Float, 8, 2, ebvSigned, 2, .01f},
+    {edf_batt, edt_32, 12, 1, ebvUnsigned},
+    {edf_volt, edt_Float, 10, 2, ebvUnsigned, 3, .001f},
+    {edf__none},
+};
+const BTDecodeFrame g_btPvvxFrames[] = {{15, 0, 0, nullptr, g_btPvvxValues}, {0}};
+const BTDecodeModel g_btPvvxModels[] = {{BTDecodeModel::Default, true, "LYWSD03MMC", "MiJia ", "Xiaomi, Telink", "pvvx", Discovery::_listVoltBattHumTempC}};
+const BTDecodeTable g_btPvvx = {0x16, 0x181a, 15, 255, g_btPvvxModels, g_btPvvxFrames, nullptr};
+#endif
+
+#if STFBT_DECODER_LAICA == 1
+// Laica 7002-7004 scale, the weight is sent to a local (fixed) MAC
+const uint8_t g_btLaicaMatch[] = {0x02, 0xa1, 0x09, 0xff};
+const uint8_t g_btLaicaMAC[] = {STF_LOCAL_MAC, 0x4C, 0x41, 0x01};
+const BTValueRule g_btLaicaValues[] = {{edf_weight, edt_Float, 4, 2, ebvSigned + ebvBigEndian, 1, .1f}, {edf__none}};
+const BTDecodeFrame g_btLaicaFrames[] = {{14, 0, 4, g_btLaicaMatch, g_btLaicaValues}, {0}};
+const DiscoveryBlock* g_btLaicaDiscovery[] = {&Discovery::_Weight, nullptr};
+const BTDecodeModel g_btLaicaModels[] = {{BTDecodeModel::Default, false, "7002-7004", "Laica ", "Laica", "", g_btLaicaDiscovery}};
+const BTDecodeTable g_btLaica = {0xff, 0, 14, 255, g_btLaicaModels, g_btLaicaFrames, g_btLaicaMAC};
+#endif
+
+const BTResolver::Decoder BTResolver::_decoders[] = {
+#if STFBT_DECODER_MIBEACON == 1
+    {EnumBTMatch::ServiceUUID, 0xfe95, nullptr, &g_btMiBeacon, nullptr},
+#endif
+#if STFBT_DECODER_PVVX == 1
+    {EnumBTMatch::MACOUI, 0xa4c138, nullptr, &g_btPvvx, nullptr},
+#endif
+#if STFBT_DECODER_LAICA == 1
+    {EnumBTMatch::NamePrefix, 0, "YoHealth", &g_btLaica, nullptr},
+#endif
+    {EnumBTMatch::None, 0, nullptr, nullptr, nullptr},
 };
 
-EnumBTResult BTResolver::resolve(DataBuffer* buffer, const BTPacket& packet) {
-  for (const ServiceFunction& sf : _serviceFunctions) {
-    EnumBTResult res = sf(buffer, packet);
-    if (res != EnumBTResult::Unknown) return res;
+bool BTResolver::isMatching(const Decoder& decoder, const BTPacket& packet, uint32_t companyId, const uint8_t* name, uint nameLen) {
+  switch (decoder.match) {
+    case EnumBTMatch::ServiceUUID:
+      return packet.hasServiceUUID(decoder.key);
+    case EnumBTMatch::CompanyId:
+      return companyId == decoder.key;
+    case EnumBTMatch::NamePrefix: {
+      uint len = strlen(decoder.name);
+      return name != nullptr && nameLen >= len && memcmp(name, decoder.name, len) == 0;
+    }
+    case EnumBTMatch::MACOUI:
+      return packet.checkMAC(0, decoder.key >> 16, decoder.key >> 8, decoder.key);
+    default:
+      return false;
   }
-  return EnumBTResult::Unknown;
 }
 
-int32_t BTResolver::getBufferValueLE(const uint8_t* buffer, uint8_t size) {
-  int32_t value = size == 1 ? (int32_t) * (int8_t*)buffer : (size == 2 ? (int32_t)(int16_t)le16toh(*(uint16_t*)buffer) : (size == 4 ? (int32_t)le32toh(*(uint32_t*)buffer) : 0));
-  return value;
-}
+EnumBTResult BTResolver::resolve(DataBuffer* buffer, const BTPacket& packet, uint8_t* decoder) {
+  uint len, nameLen;
+  const uint8_t* field = packet.getField(0xff, len); // manufacturer specific data
+  uint32_t companyId = len >= 2 ? field[0] | field[1] << 8 : 0xffffffff;
+  const uint8_t* name = packet.getField(0x09, nameLen); // complete local name
+  if (name == nullptr) name = packet.getField(0x08, nameLen); // shortened local name
 
-int32_t BTResolver::getBufferValueBE(const uint8_t* buffer, uint8_t size) {
-  int32_t value = size == 1 ? (int32_t) * (int8_t*)buffer : (size == 2 ? (int32_t)(int16_t)be16toh(*(uint16_t*)buffer) : (size == 4 ? (int32_t)be32toh(*(uint32_t*)buffer) : 0));
-  return value;
+  uint8_t matched = 0;
+  for (uint idx = 0; _decoders[idx].match != EnumBTMatch::None; idx++) {
+    const Decoder& dec = _decoders[idx];
+    if (!isMatching(dec, packet, companyId, name, nameLen)) continue;
+    matched = idx + 1;
+    EnumBTResult res = dec.table != nullptr ? decodeTable(buffer, packet, *dec.table) : dec.function(buffer, packet);
+    if (res == EnumBTResult::Unknown) continue;
+    if (decoder != nullptr) *decoder = matched;
+    return res;
+  }
+  if (decoder != nullptr) *decoder = matched;
+  return EnumBTResult::Unknown;
 }
 
-uint BTResolver::addDiscoveryBlock(DataBuffer& buffer, const DiscoveryBlock& block, const uint8_t* mac, const char* deviceName, const char* deviceModel, const char* deviceManufacturer, const char* deviceSW) {
-  BTDevice* dev = BTProvider::_discoveryList.findOrCreateDevice(mac);
-  if (dev == nullptr || dev->_discovery) return 0;
-  uint res = Discovery::addBlock(&buffer, etitBT, block, eeiCacheDeviceMAC48, mac, deviceName, deviceModel, deviceManufacturer, deviceSW);
-  if (res == 0) dev->_discovery = true;
-  return res;
+int32_t BTResolver::getBufferValue(const uint8_t* buffer, uint8_t width, uint8_t flags) {
+  bool be = (flags & ebvBigEndian) != 0, sgn = (flags & ebvUnsigned) == 0;
+  switch (width) {
+    case 1:
+      return sgn ? (int32_t) * (int8_t*)buffer : (int32_t)buffer[0];
+    case 2: {
+      // assembled byte by byte, the payload fields are not aligned
+      uint16_t value = be ? buffer[0] << 8 | buffer[1] : buffer[1] << 8 | buffer[0];
+      return sgn ? (int32_t)(int16_t)value : (int32_t)value;
+    }
+    case 4:
+      return (int32_t)(be ? (uint32_t)buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3] : (uint32_t)buffer[3] << 24 | buffer[2] << 16 | buffer[1] << 8 | buffer[0]);
+    default:
+      return 0;
+  }
 }
 
 uint BTResolver::addDiscoveryBlocks(DataBuffer& buffer, const DiscoveryBlock** list, const uint8_t* mac, const char* deviceName, const char* deviceModel, const char* deviceManufacturer, const char* deviceSW) {
   BTDevice* dev = BTProvider::_discoveryList.findOrCreateDevice(mac);
-  if (dev == nullptr || dev->_discovery) return 0;
+  if (dev == nullptr || BTProvider::_discoveryList.isAnnounced(*dev, EnumBTDeviceEpoch::Discovery)) return 0;
   uint res = Discovery::addBlocks(&buffer, etitBT, list, eeiCacheDeviceMAC48, mac, deviceName, deviceModel, deviceManufacturer, deviceSW);
-  if (res == 0) dev->_discovery = true;
+  if (res == 0) BTProvider::_discoveryList.setAnnounced(*dev, EnumBTDeviceEpoch::Discovery);
   return res;
 }
 
-// Service functions
-EnumBTResult BTResolver::serviceMiBacon(DataBuffer* buffer, const BTPacket& packet) {
-  uint serviceDataLength = 14; // expected minimum length
-  const uint8_t* serviceData = packet.getServiceDataByUUID(0xfe95, serviceDataLength);
-  if (serviceData == nullptr || serviceDataLength < 14 + serviceData[13]) return EnumBTResult::Unknown;
+// The generic decoder: finds the data and the frame, adds the discovery, the topic, the values (two per block if possible) and the model
+EnumBTResult BTResolver::decodeTable(DataBuffer* buffer, const BTPacket& packet, const BTDecodeTable& table) {
+  uint len = table.minLength;
+  const uint8_t* data = table.adType == 0x16 ? packet.getServiceDataByUUID(table.uuid, len) : packet.getField(table.adType, len);
+  if (data == nullptr || len < table.minLength) return EnumBTResult::Unknown;
+
+  const BTDecodeFrame* frame = table.frames;
+  for (; frame->values != nullptr; frame++)
+    if (len >= frame->minLength && (frame->matchLength == 0 || memcmp(data + frame->matchOffset, frame->match, frame->matchLength) == 0)) break;
+  if (frame->values == nullptr) return EnumBTResult::Unknown;
   if (buffer == nullptr) return EnumBTResult::Resolved;
-  uint16_t type = serviceData[2] + (serviceData[3] << 8);
-
-  const char* model = "Unknown";
-  switch (type) {
-    case 0x01aa:
-      model = "LYWSDCGQ";
-      if (addDiscoveryBlocks(*buffer, Discovery::_listVoltBattHumTempC + 1, packet._mac, "MiJia ", model, "Xiaomi, Qingping", nullptr) != 0) return EnumBTResult::SmallBuffer;
-      break;
-    default:
-      break;
-  }
-  uint8_t vlen = serviceData[13];
-  switch (serviceData[11]) {
-    case 4:
-      if (buffer->getFreeBlocks() < 3) return EnumBTResult::SmallBuffer;
-      buffer->nextToWrite(edf_tempc, edt_Float, 1).setFloat(getBufferValueLE(serviceData + 14, vlen) / 10.f);
-      break;
-    case 6:
-      if (buffer->getFreeBlocks() < 3) return EnumBTResult::SmallBuffer;
-      buffer->nextToWrite(edf_hum, edt_Float, 1).setFloat(getBufferValueLE(serviceData + 14, vlen) / 10.f);
-      break;
-    case 10:
-      if (buffer->getFreeBlocks() < 3) return EnumBTResult::SmallBuffer;
-      buffer->nextToWrite(edf_batt, edt_32, 0).set32(getBufferValueLE(serviceData + 14, vlen));
-      break;
-    case 13:
-      if (vlen != 4) return EnumBTResult::Unknown;
-      if (buffer->getFreeBlocks() < 3) return EnumBTResult::SmallBuffer;
-      buffer->nextToWrite(edf_tempc, edt_Float, 1 + etiDoubleField, edf_hum).setFloat(getBufferValueLE(serviceData + 14, 2) / 10.f, getBufferValueLE(serviceData + 16, 2) / 10.f);
-      break;
 
-    default:
-      return EnumBTResult::Unknown;
-      break;
-  }
-  buffer->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(packet._mac);
-  buffer->nextToWrite(edf_model, edt_String, 0).setPtr((const char*)model);
+  const BTDecodeModel* model = table.models;
+  uint16_t productId = table.productOffset != 255 ? getBufferValue(data + table.productOffset, 2, ebvUnsigned) : BTDecodeModel::Default;
+  while (model->productId != productId && model->productId != BTDecodeModel::Default) model++;
+
+  const uint8_t* mac = table.topicMAC != nullptr ? table.topicMAC : packet._mac;
+  if (model->discovery != nullptr && addDiscoveryBlocks(*buffer, model->discovery, mac, model->name, model->model, model->manufacturer, model->sw) != 0) return EnumBTResult::SmallBuffer;
+
+  uint need = 1 + (model->publish ? 1 : 0);
+  for (const BTValueRule* rule = frame->values; rule->field != edf__none; rule++) need++;
+  if (buffer->getFreeBlocks() < need) return EnumBTResult::SmallBuffer;
 
+  buffer->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(mac);
+  for (const BTValueRule* rule = frame->values; rule->field != edf__none; rule++) {
+    const BTValueRule* next = rule + 1;
+    bool dbl = next->field != edf__none && next->type == rule->type && next->precision == rule->precision && (next->flags & ebvUnsigned) == (rule->flags & ebvUnsigned);
+    uint8_t typeInfo = (rule->type == edt_Float ? rule->precision : ((rule->flags & ebvUnsigned) != 0 ? 0 : 1)) + (dbl ? etiDoubleField : 0);
+    DataBlock& block = buffer->nextToWrite(rule->field, rule->type, typeInfo, dbl ? next->field : 0);
+    int32_t v0 = getBufferValue(data + rule->offset, rule->width, rule->flags);
+    int32_t v1 = dbl ? getBufferValue(data + next->offset, next->width, next->flags) : 0;
+    if (rule->type == edt_Float)
+      block.setFloat(v0 * rule->scale, v1 * (dbl ? next->scale : 0.f));
+    else
+      block.set32(v0, v1);
+    if (dbl) rule++;
+  }
+  if (model->publish) buffer->nextToWrite(edf_model, edt_String, 0).setPtr(model->model);
   return EnumBTResult::Resolved;
 }
 
-// Special firmware for Xiaomi LYWSD03MMC from Telink
-// See more at https://github.com/pvvx/ATC_MiThermometer (forked from https://github.com/atc1441/ATC_MiThermometer)
-EnumBTResult BTResolver::serviceTelinkLYWSD03MMC_atc1441_pvvx(DataBuffer* buffer, const BTPacket& packet) {
-  if (!packet.checkMAC(0, 0xA4, 0xC1, 0x38)) return EnumBTResult::Unknown;
-  uint serviceDataLength = 15; // expected minimum length
-  const uint8_t* serviceData = packet.getServiceDataByUUID(0x181a, serviceDataLength);
-  if (serviceData == nullptr) return EnumBTResult::Unknown;
-  if (buffer == nullptr) return EnumBTResult::Resolved;
+// BTDistance
 
-  const char* model = "LYWSD03MMC";
-  if (addDiscoveryBlocks(*buffer, Discovery::_listVoltBattHumTempC, packet._mac, "MiJia ", model, "Xiaomi, Telink", "pvvx") != 0) return EnumBTResult::SmallBuffer;
+float BTDistance::_table[TableSize];
+bool BTDistance::_ready = false;
 
-  if (buffer->getFreeBlocks() < 5) return EnumBTResult::SmallBuffer;
-  buffer->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(packet._mac);
-  buffer->nextToWrite(edf_tempc, edt_Float, 2 + etiDoubleField, edf_hum).setFloat(getBufferValueLE(serviceData + 6, 2) / 100.f, getBufferValueLE(serviceData + 8, 2) / 100.f);
-  buffer->nextToWrite(edf_batt, edt_32, 0).set32(getBufferValueLE(serviceData + 12, 1));
-  buffer->nextToWrite(edf_volt, edt_Float, 3).setFloat(getBufferValueLE(serviceData + 10, 2) / 1000.f);
-  buffer->nextToWrite(edf_model, edt_String, 0).setPtr((const char*)model);
-  return EnumBTResult::Resolved;
+float BTDistance::model(float key) {
+#if STFBT_DISTANCE_MODEL == 0
+  return key < 1.f ? powf(key, 10.f) : STFBT_DISTANCE_COEFF_A * powf(key, STFBT_DISTANCE_COEFF_B) + STFBT_DISTANCE_COEFF_C;
+#else
+  return powf(10.f, key / (10.f * STFBT_DISTANCE_PATH_LOSS));
+#endif
 }
 
-EnumBTResult BTResolver::serviceLaica_700234(DataBuffer* buffer, const BTPacket& packet) {
-  uint len;
-  const uint8_t* nameBuff = packet.getField(0x9, len = 8); // name
-  if (len != 8 || memcmp(nameBuff, "YoHealth", 8) != 0) return EnumBTResult::Unknown;
-  const uint8_t* dataBuff = packet.getField(0xff, len = 14); // manufacture data
+void BTDistance::setup() {
+  if (_ready) return;
+#if STFBT_DISTANCE_MODEL == 0
+  for (uint idx = 0; idx < LowerSize; idx++) _table[idx] = powf(idx / KeyScale, 10.f); // up to the limit at 1
+  for (uint idx = LowerSize; idx < TableSize; idx++) _table[idx] = model(1.f + (idx - LowerSize) / KeyScale);
+#else
+  for (uint idx = 0; idx < TableSize; idx++) _table[idx] = model(idx / KeyScale - KeyOffset);
+#endif
+  _ready = true;
+}
 
-  uint8_t companyId[4] = {0x02, 0xa1, 0x09, 0xff};
-  if (len != 14 || memcmp(dataBuff, companyId, 4) != 0) return EnumBTResult::Unknown;
-  if (buffer == nullptr) return EnumBTResult::Resolved;
+float BTDistance::distance(float rssi, int txPower) {
+  if (txPower >= 0) txPower = STFBT_DISTANCE_TXPOWER;
+#if STFBT_DISTANCE_MODEL == 0
+  float key = rssi / txPower;
+  bool lower = key < 1.f;
+  uint first = lower ? 0 : LowerSize, last = lower ? LowerSize - 1 : TableSize - 1;
+  float pos = lower ? key * KeyScale : LowerSize + (key - 1.f) * KeyScale;
+#else
+  float key = txPower - rssi;
+  uint first = 0, last = TableSize - 1;
+  float pos = (key + KeyOffset) * KeyScale;
+#endif
+  if (!_ready || pos < first || pos > last) return model(key); // out of the table, rare
 
-  uint8_t localMac[] = {STF_LOCAL_MAC, 0x4C, 0x41, 0x01};
-  if (addDiscoveryBlock(*buffer, Discovery::_Weight, localMac, "Laica ", "7002-7004", "Laica", "") != 0) return EnumBTResult::SmallBuffer;
+  // Cubic through the 4 nearest entries of the part, t: position from the first of them
+  uint idx = (uint)pos;
+  idx = idx <= first ? first : (idx + 2 > last ? last - 3 : idx - 1);
+  float t = pos - idx;
+  const float* y = _table + idx;
+  return ((t - 1.f) * (t - 2.f) * (t - 3.f) * -y[0] + 3.f * t * (t - 2.f) * (t - 3.f) * y[1] - 3.f * t * (t - 1.f) * (t - 3.f) * y[2] +
+          t * (t - 1.f) * (t - 2.f) * y[3]) *
+         (1.f / 6.f);
+}
 
-  if (buffer->getFreeBlocks() < 2) return EnumBTResult::SmallBuffer;
-  buffer->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(localMac);
-  buffer->nextToWrite(edf_weight, edt_Float, 1).setFloat(getBufferValueBE(dataBuff + 4, 2) * .1f);
-  return EnumBTResult::Resolved;
+// BTDevice
+
+void BTDevice::updateRSSI(int8_t rssi) {
+  if (rssi == 127) return;
+  int16_t rssi16 = rssi * 16;
+  if (_hasRSSI)
+    _rssi16 += (rssi16 - _rssi16) / (1 << STFBT_RSSI_SMOOTHING);
+  else
+    _rssi16 = rssi16;
+  _hasRSSI = true;
 }
 
-// BTDeviceGroup
+// Keeps the last value for every field, the last slot is overwritten when all of them is used by other fields
+void BTDevice::setValue(EnumDataField field, EnumDataType type, uint8_t typeInfo, uint32_t value) {
+  uint idx = 0;
+  while (idx < MaxValues - 1 && _valueFields[idx] != field && _valueFields[idx] != edf__none) idx++;
+  _valueFields[idx] = field;
+  _values[idx] = value;
+  uint shift = idx * 4;
+  _valueTypes = (_valueTypes & ~(15 << shift)) | ((type == edt_Float ? 8 : 0) | (typeInfo & 7)) << shift;
+}
+
+bool BTDevice::getValue(uint idx, EnumDataField& field, EnumDataType& type, uint8_t& typeInfo, uint32_t& value) const {
+  if (idx >= MaxValues || _valueFields[idx] == edf__none) return false;
+  uint bits = _valueTypes >> idx * 4 & 15;
+  field = (EnumDataField)_valueFields[idx];
+  type = (bits & 8) != 0 ? edt_Float : edt_32;
+  typeInfo = bits & 7;
+  value = _values[idx];
+  return true;
+}
 
-#define STF_BTDEVICE_SIZE 16
+// BTDeviceGroup
 
-BTDeviceGroup::BTDeviceGroup() {}
+BTDeviceGroup::BTDeviceGroup() {
+  for (uint8_t& epoch : _epoch) epoch = 1;
+}
 
 BTDevice* BTDeviceGroup::findDevice(const uint8_t* mac) {
   uint32_t v4 = *(const uint32_t*)mac;
   uint16_t v2 = *(const uint16_t*)(mac + 4);
 
-  for (BTDevice* arr : _devices) {
-    for (int idx = 0; idx < STF_BTDEVICE_SIZE; idx++) {
-      BTDevice& dev = arr[idx];
-      if (v4 == dev._mac32[0] && v2 == dev._mac16[2]) return &dev;
-    }
+  for (uint idx = hashMAC(v4, v2);; idx = (idx + 1) & (STFBT_DEVICE_SLOTS - 1)) {
+    BTDevice& dev = _devices[idx];
+    if (!dev._used) return nullptr;
+    if (dev.isMAC(v4, v2)) return &dev;
   }
-  return nullptr;
 }
 
 BTDevice* BTDeviceGroup::findOrCreateDevice(const uint8_t* mac) {
+  uint32_t now = Host::uptimeMS32();
   BTDevice* dev = findDevice(mac);
-  if (dev != nullptr) return dev;
-  for (BTDevice* arr : _devices) {
-    for (int idx = 0; idx < STF_BTDEVICE_SIZE; idx++) {
-      BTDevice& dev = arr[idx];
-      if (dev._mac[0] == 0xff) {
-        memcpy(dev._mac, mac, 6);
-        return &dev;
-      }
+  if (dev == nullptr) {
+    if (_count >= MaxDevices) {
+      BTDevice* oldest = findOldestDevice(now);
+      if (oldest == nullptr) return nullptr;
+      removeDevice(oldest);
+      _evicted++;
     }
+    uint32_t v4 = *(const uint32_t*)mac;
+    uint16_t v2 = *(const uint16_t*)(mac + 4);
+    uint idx = hashMAC(v4, v2);
+    while (_devices[idx]._used) idx = (idx + 1) & (STFBT_DEVICE_SLOTS - 1);
+    dev = _devices + idx;
+    dev->reset();
+    memcpy(dev->_mac, mac, 6);
+    dev->_used = true;
+    _count++;
   }
-  BTDevice* arr = new BTDevice[STF_BTDEVICE_SIZE];
-  _devices.push_back(arr);
-  memcpy(arr[0]._mac, mac, 6);
-  return arr;
+  dev->_lastSeen = now;
+  return dev;
+}
+
+// Backward shift deletion, so no tombstones are needed
+void BTDeviceGroup::removeDevice(BTDevice* dev) {
+  if (dev == nullptr || !dev->_used) return;
+  uint hole = dev - _devices;
+  for (uint idx = (hole + 1) & (STFBT_DEVICE_SLOTS - 1); _devices[idx]._used; idx = (idx + 1) & (STFBT_DEVICE_SLOTS - 1)) {
+    uint home = hashMAC(_devices[idx]._mac32[0], _devices[idx]._mac16[2]);
+    if (((idx - home) & (STFBT_DEVICE_SLOTS - 1)) >= ((idx - hole) & (STFBT_DEVICE_SLOTS - 1))) {
+      _devices[hole] = _devices[idx];
+      hole = idx;
+    }
+  }
+  _devices[hole].reset();
+  _count--;
+}
+
+// Gives back the first idle device or the least recently seen one, the listed devices are skipped
+BTDevice* BTDeviceGroup::findOldestDevice(uint32_t now) {
+  BTDevice* oldest = nullptr;
+  uint32_t oldestAge = 0;
+  for (BTDevice& dev : _devices) {
+    if (!dev._used || dev._whiteList || dev._blackList) continue;
+    uint32_t age = now - dev._lastSeen;
+    if (age >= STFBT_DEVICE_IDLE_TIMEOUT) return &dev;
+    if (oldest == nullptr || age > oldestAge) {
+      oldest = &dev;
+      oldestAge = age;
+    }
+  }
+  return oldest;
 }
 
 void BTDeviceGroup::updateDevices() {
   if (_lastReadyTime != _discoveryTime) {
     _discoveryTime = _lastReadyTime;
-    for (BTDevice* arr : _devices)
-      for (int idx = 0; idx < STF_BTDEVICE_SIZE; idx++) arr[idx]._discovery = false;
+    resetEpoch(EnumBTDeviceEpoch::Discovery);
   }
 }
 
+bool BTDeviceGroup::setList(const uint8_t* mac, EnumBTList list) {
+  BTDevice* dev = list != EnumBTList::None ? findOrCreateDevice(mac) : findDevice(mac);
+  if (dev == nullptr) return list == EnumBTList::None;
+  EnumBTList old = dev->getList();
+  if (old == list) return true;
+  if (list != EnumBTList::None && _listCount[(uint)list] >= STFBT_LIST_MAX) return false;
+  if (old != EnumBTList::None) _listCount[(uint)old]--;
+  if (list != EnumBTList::None) _listCount[(uint)list]++;
+  dev->_whiteList = list == EnumBTList::Allow;
+  dev->_blackList = list == EnumBTList::Deny;
+  return true;
+}
+
+void BTDeviceGroup::clearList(EnumBTList list) {
+  for (BTDevice& dev : _devices)
+    if (dev._used && dev.getList() == list) dev._whiteList = dev._blackList = false;
+  _listCount[(uint)list] = 0;
+}
+
+uint BTDeviceGroup::exportLists(uint8_t* buffer, uint maxEntries) const {
+  uint count = 0;
+  for (const BTDevice& dev : _devices) {
+    if (count >= maxEntries) break;
+    if (!dev._used || dev.getList() == EnumBTList::None) continue;
+    buffer[0] = (uint8_t)dev.getList();
+    memcpy(buffer + 1, dev._mac, 6);
+    buffer += 7;
+    count++;
+  }
+  return count;
+}
+
+// O(1) except at every 255th call when the epoch overflows (0 is reserved for "never announced")
+void BTDeviceGroup::resetEpoch(EnumBTDeviceEpoch type) {
+  uint8_t& epoch = _epoch[(uint)type];
+  if (++epoch != 0) return;
+  epoch = 1;
+  for (BTDevice& dev : _devices) dev._epoch[(uint)type] = 0;
+}
+
 } // namespace stf
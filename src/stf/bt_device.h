@@ -20,6 +20,76 @@
 
 #include <stf/data_block.h>
 #include <stf/data_discovery.h>
+#include <stf/util.h>
+
+// Number of slots in the device hash table (must be power of 2), at most 3/4 of it is used
+#ifndef STFBT_DEVICE_SLOTS
+#  define STFBT_DEVICE_SLOTS 128
+#endif
+
+// Devices not seen for this long (in ms) are evicted first when the table is full
+#ifndef STFBT_DEVICE_IDLE_TIMEOUT
+#  define STFBT_DEVICE_IDLE_TIMEOUT 600000
+#endif
+
+// Decoders compiled into the firmware (the disabled ones are not part of the binary)
+#ifndef STFBT_DECODER_MIBEACON
+#  define STFBT_DECODER_MIBEACON 1
+#endif
+#ifndef STFBT_DECODER_PVVX
+#  define STFBT_DECODER_PVVX 1
+#endif
+#ifndef STFBT_DECODER_LAICA
+#  define STFBT_DECODER_LAICA 1
+#endif
+
+// RSSI smoothing (EWMA) factor: new = old + (rssi - old) / 2^STFBT_RSSI_SMOOTHING
+#ifndef STFBT_RSSI_SMOOTHING
+#  define STFBT_RSSI_SMOOTHING 2
+#endif
+
+// Negative cache: advertisers no decoder understands are skipped for this long (in ms), then probed again
+#ifndef STFBT_UNKNOWN_CACHE_SIZE
+#  define STFBT_UNKNOWN_CACHE_SIZE 64
+#endif
+#ifndef STFBT_UNKNOWN_CACHE_TIMEOUT
+#  define STFBT_UNKNOWN_CACHE_TIMEOUT 60000
+#endif
+
+// Duplicate filter: identical advertisements (MAC and payload) within the window (in ms) are not decoded again
+#ifndef STFBT_DEDUP_SIZE
+#  define STFBT_DEDUP_SIZE 64
+#endif
+#ifndef STFBT_DEDUP_WINDOW
+#  define STFBT_DEDUP_WINDOW 5000
+#endif
+
+// Maximum number of MACs on the allow and on the deny list (each), the listed devices are never evicted
+#ifndef STFBT_LIST_MAX
+#  define STFBT_LIST_MAX 32
+#endif
+
+// Beacon distance model: 0 - curve fitted, distance = A * (rssi / txPower) ^ B + C (android-beacon-library coefficients by default)
+//                       1 - log-distance path loss, distance = 10 ^ ((txPower - rssi) / (10 * N))
+#ifndef STFBT_DISTANCE_MODEL
+#  define STFBT_DISTANCE_MODEL 0
+#endif
+#ifndef STFBT_DISTANCE_COEFF_A
+#  define STFBT_DISTANCE_COEFF_A 0.42093f
+#endif
+#ifndef STFBT_DISTANCE_COEFF_B
+#  define STFBT_DISTANCE_COEFF_B 6.9476f
+#endif
+#ifndef STFBT_DISTANCE_COEFF_C
+#  define STFBT_DISTANCE_COEFF_C 0.54992f
+#endif
+#ifndef STFBT_DISTANCE_PATH_LOSS
+#  define STFBT_DISTANCE_PATH_LOSS 2.0f
+#endif
+// Used when the device doesn't advertise its tx power (at 1m)
+#ifndef STFBT_DISTANCE_TXPOWER
+#  define STFBT_DISTANCE_TXPOWER -59
+#endif
 
 namespace stf {
 
@@ -34,53 +104,263 @@ enum class EnumBTResult {
 
 class BTPacket;
 
+// The key the decoder is registered with, a packet is passed to the decoder only when it matches
+enum class EnumBTMatch : uint8_t {
+  None = 0, // end of the list
+  ServiceUUID = 1, // service data uuid (16 or 32 bit)
+  CompanyId = 2, // manufacturer specific data company id
+  NamePrefix = 3, // complete or shortened local name prefix
+  MACOUI = 4, // first 3 octets of a public address
+};
+
+// Declarative decoders, interpreted by BTResolver::decodeTable
+
+enum EnumBTValueFlags {
+  ebvSigned = 0,
+  ebvUnsigned = 1,
+  ebvLittleEndian = 0,
+  ebvBigEndian = 2,
+};
+
+// One value in the data, the list is terminated by edf__none
+struct BTValueRule {
+  EnumDataField field : 8;
+  EnumDataType type : 8; // edt_32 or edt_Float
+  uint8_t offset;
+  uint8_t width : 4; // 1, 2 or 4 bytes
+  uint8_t flags : 4; // EnumBTValueFlags
+  uint8_t precision; // edt_Float: number of decimals
+  float scale; // edt_Float: multiplier
+};
+
+// A data layout, selected by the bytes at matchOffset; the list is terminated by values == nullptr
+struct BTDecodeFrame {
+  uint8_t minLength;
+  uint8_t matchOffset;
+  uint8_t matchLength;
+  const uint8_t* match;
+  const BTValueRule* values;
+};
+
+// Device model, selected by the 16 bit (little endian) product id; the list is terminated by (and defaults to) productId == Default
+struct BTDecodeModel {
+  static constexpr uint16_t Default = 0xffff;
+
+  uint16_t productId;
+  bool publish; // the model is also published as "model"
+  const char* model;
+  const char* name;
+  const char* manufacturer;
+  const char* sw;
+  const DiscoveryBlock** discovery; // nullptr - no discovery
+};
+
+struct BTDecodeTable {
+  uint8_t adType; // 0x16 (service data, uuid) or 0xff (manufacturer specific data)
+  uint32_t uuid;
+  uint8_t minLength;
+  uint8_t productOffset; // 255 - none
+  const BTDecodeModel* models;
+  const BTDecodeFrame* frames;
+  const uint8_t* topicMAC; // nullptr - the packet's MAC
+};
+
 class BTResolver {
 public:
-  static EnumBTResult resolve(DataBuffer* buffer, const BTPacket& packet);
+  // decoder: 1 + index in _decoders of the matching decoder (set even if the decoder couldn't process the packet), 0 - no matching decoder
+  static EnumBTResult resolve(DataBuffer* buffer, const BTPacket& packet, uint8_t* decoder = nullptr);
 
 protected:
-  static int32_t getBufferValueLE(const uint8_t* buffer, uint8_t size); // little endian
-  static int32_t getBufferValueBE(const uint8_t* buffer, uint8_t size); // big endian
-  static uint addDiscoveryBlock(DataBuffer& buffer, const DiscoveryBlock& block, const uint8_t* mac, const char* deviceName, const char* deviceModel, const char* deviceManufacturer, const char* deviceSW);
+  static int32_t getBufferValue(const uint8_t* buffer, uint8_t width, uint8_t flags);
   static uint addDiscoveryBlocks(DataBuffer& buffer, const DiscoveryBlock** list, const uint8_t* mac, const char* deviceName, const char* deviceModel, const char* deviceManufacturer, const char* deviceSW);
 
   typedef EnumBTResult (*ServiceFunction)(DataBuffer* buffer, const BTPacket& packet);
-  static const ServiceFunction _serviceFunctions[];
 
-  static EnumBTResult serviceMiBacon(DataBuffer* buffer, const BTPacket& packet);
-  static EnumBTResult serviceTelinkLYWSD03MMC_atc1441_pvvx(DataBuffer* buffer, const BTPacket& packet);
-  static EnumBTResult serviceLaica_700234(DataBuffer* buffer, const BTPacket& packet);
+  // Either the table or the function is used
+  struct Decoder {
+    EnumBTMatch match;
+    uint32_t key; // uuid, company id or OUI (0xAABBCC)
+    const char* name; // name prefix
+    const BTDecodeTable* table;
+    ServiceFunction function;
+  };
+  static const Decoder _decoders[];
+
+  static bool isMatching(const Decoder& decoder, const BTPacket& packet, uint32_t companyId, const uint8_t* name, uint nameLen);
+  static EnumBTResult decodeTable(DataBuffer* buffer, const BTPacket& packet, const BTDecodeTable& table);
+};
+
+// MAC list membership of a device (stored in its flags), see BTDeviceGroup::setList
+enum class EnumBTList : uint8_t {
+  None = 0,
+  Allow = 1,
+  Deny = 2,
+};
+
+// Per device "already announced" states, reset all at once by increasing the group's epoch
+enum class EnumBTDeviceEpoch : uint8_t {
+  Discovery = 0,
+  Count = 1
 };
 
 class STFATTR_PACKED BTDevice {
 public:
-  BTDevice() {
-    _whiteList = _blackList = _discovery = false;
-    _mac[0] = 0xff;
+  static constexpr uint MaxValues = 4;
+
+  BTDevice() { reset(); }
+
+  inline void reset() {
+    _used = _whiteList = _blackList = _hasRSSI = false;
+    _lastSeen = 0;
+    for (uint8_t& epoch : _epoch) epoch = 0;
+    _packetCount = 0;
+    _rssi16 = 0;
+    for (uint8_t& field : _valueFields) field = edf__none;
+    _valueTypes = 0;
+    _txPower = 127;
+    _decoder = 0;
   }
+  inline bool isMAC(uint32_t v4, uint16_t v2) const { return _used && v4 == _mac32[0] && v2 == _mac16[2]; }
+  inline EnumBTList getList() const { return _whiteList ? EnumBTList::Allow : (_blackList ? EnumBTList::Deny : EnumBTList::None); }
+
+  void updateRSSI(int8_t rssi);
+  // type: edt_32 or edt_Float as the decoder wrote it, value: the bits of the value (DataBlock::_value.t32)
+  void setValue(EnumDataField field, EnumDataType type, uint8_t typeInfo, uint32_t value);
+  bool getValue(uint idx, EnumDataField& field, EnumDataType& type, uint8_t& typeInfo, uint32_t& value) const; // idx: 0..MaxValues-1, false - empty
+
+  inline bool hasRSSI() const { return _hasRSSI; }
+  inline float getRSSI() const { return _rssi16 / 16.f; }
+  inline int8_t getRSSI8() const { return _hasRSSI ? (int8_t)((_rssi16 + 8) >> 4) : 127; }
+
   union STFATTR_PACKED {
     uint8_t _mac[6];
     uint16_t _mac16[3];
     uint32_t _mac32[1];
   };
-  uint8_t _reserved;
+  uint8_t _epoch[(uint)EnumBTDeviceEpoch::Count]; // the group's epoch when the state was announced, 0 - never
+  uint32_t _lastSeen; // Host::uptimeMS32()
+
+  // Live state of the forwarded packets
+  uint16_t _packetCount; // saturated
+  int16_t _rssi16; // smoothed RSSI * 16
+  uint32_t _values[MaxValues]; // last decoded values
+  uint8_t _valueFields[MaxValues]; // EnumDataField of _values, edf__none - empty
+  int8_t _txPower; // 127 - unknown
+  uint8_t _decoder; // see BTResolver::resolve, 0 - unknown
+
+  bool _used : 1;
   bool _whiteList : 1;
   bool _blackList : 1;
-  bool _discovery : 1;
+  bool _hasRSSI : 1;
+  uint16_t _valueTypes; // 4 bits per value: 8 - edt_Float (else edt_32) + the type info (decimals / signed)
 };
 
+static_assert(sizeof(BTDevice) == 40, "BTDevice size should be 40");
+static_assert((STFBT_DEVICE_SLOTS & (STFBT_DEVICE_SLOTS - 1)) == 0, "STFBT_DEVICE_SLOTS should be power of 2");
+static_assert(2 * STFBT_LIST_MAX < STFBT_DEVICE_SLOTS - STFBT_DEVICE_SLOTS / 4, "STFBT_LIST_MAX is too big for STFBT_DEVICE_SLOTS");
+
+// Open addressing (linear probing) hash table with fixed size, the least recently seen (not listed) device is evicted when it's full
+// The returned pointers are valid only till the next findOrCreateDevice/removeDevice call (entries might be moved)
 class BTDeviceGroup {
 public:
+  static constexpr uint MaxDevices = STFBT_DEVICE_SLOTS - STFBT_DEVICE_SLOTS / 4;
+
   BTDeviceGroup();
 
   void updateDevices();
   BTDevice* findDevice(const uint8_t* mac);
   BTDevice* findOrCreateDevice(const uint8_t* mac);
+  void removeDevice(BTDevice* dev);
+
+  void resetEpoch(EnumBTDeviceEpoch type);
+  inline bool isAnnounced(const BTDevice& dev, EnumBTDeviceEpoch type) const { return dev._epoch[(uint)type] == _epoch[(uint)type]; }
+  inline void setAnnounced(BTDevice& dev, EnumBTDeviceEpoch type) const { dev._epoch[(uint)type] = _epoch[(uint)type]; }
+
+  // The lists are stored in the device flags, EnumBTList::None removes the MAC from the lists
+  bool setList(const uint8_t* mac, EnumBTList list);
+  void clearList(EnumBTList list);
+  inline uint getListCount(EnumBTList list) const { return _listCount[(uint)list]; }
+  uint exportLists(uint8_t* buffer, uint maxEntries) const; // 7 bytes per entry: EnumBTList + MAC
+
+  inline uint getDeviceCount() const { return _count; }
+  inline uint32_t getEvictedCount() const { return _evicted; }
 
   ElapsedTime _lastReadyTime;
   ElapsedTime _discoveryTime;
 
-  std::vector<BTDevice*> _devices;
+protected:
+  static inline uint hashMAC(uint32_t v4, uint16_t v2) { return ((v4 ^ (v2 * 0x10001u)) * 0x9e3779b1u) >> 16 & (STFBT_DEVICE_SLOTS - 1); }
+  BTDevice* findOldestDevice(uint32_t now);
+
+  uint8_t _epoch[(uint)EnumBTDeviceEpoch::Count];
+  uint _count = 0;
+  uint _listCount[3] = {}; // by EnumBTList
+  uint32_t _evicted = 0;
+  BTDevice _devices[STFBT_DEVICE_SLOTS];
+};
+
+// Distance from the RSSI by a precomputed table of the model, cubic interpolation in single precision
+// The table key is rssi / txPower (1/32 steps in [0, 4]) for the fitted curve, txPower - rssi (1dB steps in [-32, 96]) for the log-distance model
+class BTDistance {
+public:
+  static void setup();
+  static float distance(float rssi, int txPower);
+
+protected:
+#if STFBT_DISTANCE_MODEL == 0
+  // [0, 1] and [1, 4] are separate parts, the fitted curve jumps at 1
+  static constexpr float KeyScale = 32.f;
+  static constexpr uint LowerSize = 33;
+  static constexpr uint TableSize = LowerSize + 97;
+#else
+  static constexpr float KeyScale = 1.f;
+  static constexpr float KeyOffset = 32.f;
+  static constexpr uint TableSize = 129;
+#endif
+
+  static float model(float key);
+
+  static float _table[TableSize];
+  static bool _ready;
+};
+
+// Time bounded set of 32 bit keys; direct mapped, so a colliding key simply replaces the older one (SIZE must be power of 2)
+template <uint SIZE>
+class BTKeyCache {
+public:
+  static_assert((SIZE & (SIZE - 1)) == 0, "BTKeyCache size should be power of 2");
+
+  BTKeyCache(uint32_t timeout) : _timeout(timeout) {}
+
+  // Gives back true if the key was inserted less than timeout ago
+  inline bool contains(uint32_t key, uint32_t now) {
+    const Entry& entry = _entries[slot(key)];
+    bool res = entry.key == key && now - entry.time < _timeout;
+    if (res)
+      _hits.increment();
+    else
+      _misses.increment();
+    return res;
+  }
+  inline void insert(uint32_t key, uint32_t now) {
+    Entry& entry = _entries[slot(key)];
+    entry.key = key;
+    entry.time = now;
+  }
+  inline void clear() { memset(_entries, 0, sizeof(_entries)); }
+
+  uint32_t _timeout;
+  AtomicCounter _hits; // read by the system task
+  AtomicCounter _misses;
+
+protected:
+  static inline uint slot(uint32_t key) { return (key ^ key >> 16) & (SIZE - 1); }
+
+  struct Entry {
+    uint32_t key; // 0 - empty
+    uint32_t time;
+  };
+  Entry _entries[SIZE] = {};
 };
 
 } // namespace stf
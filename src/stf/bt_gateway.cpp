@@ -0,0 +1,151 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stf/bt_gateway.h>
+
+#if STFBT_GATEWAY == 1
+
+#  include <stf/provider_bt.h>
+
+namespace stf {
+
+bool BTGateway::add(const BTRawPacket& raw) {
+  uint len = RecordHeaderSize + raw.payloadLength;
+  if (_recordsLength + len > sizeof(_records) && !flush()) return false;
+  if (_recordCount == 0) _batchTime = raw.time;
+
+  uint8_t* rec = _records + _recordsLength;
+  uint32_t delta = raw.time - _batchTime;
+  rec[0] = len - 1;
+  rec[1] = delta > 0xffff ? 0xff : delta;
+  rec[2] = delta > 0xffff ? 0xff : delta >> 8;
+  for (int idx = 0; idx < 6; idx++) rec[3 + idx] = raw.mac[5 - idx];
+  rec[9] = (raw.macType << 4) | (raw.advType & 15);
+  rec[10] = (uint8_t)raw.rssi;
+  memcpy(rec + RecordHeaderSize, raw.payload, raw.payloadLength);
+  _recordsLength += len;
+  _recordCount++;
+  return true;
+}
+
+void BTGateway::update(uint32_t now) {
+  if (_recordCount != 0 && now - _batchTime >= STFBT_GATEWAY_FLUSH_TIME) flush();
+}
+
+// Moves the records into the batch, fails if the previous batch is not sent yet
+bool BTGateway::flush() {
+  if (_recordCount == 0) return true;
+  if (__atomic_load_n(&_batchReady, __ATOMIC_ACQUIRE)) return false;
+
+  uint8_t flags = 0;
+  uint len = 0;
+#  if STFBT_GATEWAY_COMPRESS == 1
+  len = compress(_records, _recordsLength, _batch + HeaderSize, _recordsLength - 1);
+  if (len != 0) flags |= 1;
+#  endif
+  if (len == 0) memcpy(_batch + HeaderSize, _records, len = _recordsLength);
+
+  uint8_t* hdr = _batch;
+  hdr[0] = 'S';
+  hdr[1] = 'B';
+  hdr[2] = Version;
+  hdr[3] = flags;
+  for (int idx = 0; idx < 4; idx++) hdr[4 + idx] = _batchTime >> (8 * idx);
+  hdr[8] = _recordCount;
+  hdr[9] = _recordCount >> 8;
+  hdr[10] = _recordsLength;
+  hdr[11] = _recordsLength >> 8;
+  _batchLength = HeaderSize + len;
+  _recordsLength = _recordCount = 0;
+  __atomic_store_n(&_batchReady, true, __ATOMIC_RELEASE);
+  return true;
+}
+
+const uint8_t* BTGateway::getBatch(uint& len) {
+  if (!__atomic_load_n(&_batchReady, __ATOMIC_ACQUIRE)) return nullptr;
+  len = _batchLength;
+  return _batch;
+}
+
+void BTGateway::releaseBatch() {
+  _batchesSent++;
+  __atomic_store_n(&_batchReady, false, __ATOMIC_RELEASE);
+}
+
+#  if STFBT_GATEWAY_COMPRESS == 1
+
+// LZ4 block format (greedy, single probe), gives back 0 if the result doesn't fit into dstCap
+uint BTGateway::compress(const uint8_t* src, uint srcLen, uint8_t* dst, uint dstCap) {
+  const uint8_t *ip = src, *anchor = src, *end = src + srcLen;
+  const uint8_t* matchLimit = end - 5; // the last 5 bytes are always literals
+  uint8_t *op = dst, *opEnd = dst + dstCap;
+  memset(_hashTable, 0, sizeof(_hashTable));
+
+  for (;;) {
+    const uint8_t *ref = nullptr, *mp = nullptr;
+    if (srcLen >= 13) {
+      for (; ip + 12 <= end; ip++) { // a match can't start in the last 12 bytes
+        uint32_t seq;
+        memcpy(&seq, ip, 4);
+        uint hash = (seq * 2654435761u) >> 24;
+        ref = src + _hashTable[hash];
+        _hashTable[hash] = ip - src;
+        if (ref < ip && ip - ref <= 0xffff && memcmp(ref, ip, 4) == 0) break;
+      }
+      if (ip + 12 > end) ref = nullptr;
+    }
+
+    // Sequence: token, literal length, literals, (offset, match length)
+    uint litLen = (ref != nullptr ? ip : end) - anchor;
+    uint matchLen = 0;
+    if (ref != nullptr) {
+      for (mp = ip + 4; mp < matchLimit && *mp == ref[mp - ip]; mp++)
+        ;
+      matchLen = mp - ip - 4;
+    }
+    if (op + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 > opEnd) return 0;
+    uint8_t* token = op++;
+    *token = (litLen >= 15 ? 15 : litLen) << 4;
+    if (litLen >= 15) {
+      uint rest = litLen - 15;
+      for (; rest >= 255; rest -= 255) *op++ = 255;
+      *op++ = rest;
+    }
+    memcpy(op, anchor, litLen);
+    op += litLen;
+    if (ref == nullptr) break;
+
+    uint offset = ip - ref;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    *token |= matchLen >= 15 ? 15 : matchLen;
+    if (matchLen >= 15) {
+      uint rest = matchLen - 15;
+      for (; rest >= 255; rest -= 255) *op++ = 255;
+      *op++ = rest;
+    }
+    ip = anchor = mp;
+  }
+  return op - dst;
+}
+
+#  endif
+
+} // namespace stf
+
+#endif
@@ -0,0 +1,90 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <stf/os.h>
+
+// Raw gateway mode: the advertisements are forwarded in binary batches instead of being decoded (costs ~2.5k RAM when enabled)
+#ifndef STFBT_GATEWAY
+#  define STFBT_GATEWAY 0
+#endif
+
+// Size of the record area of a batch, a batch is sent when it's full
+#ifndef STFBT_GATEWAY_BATCH_SIZE
+#  define STFBT_GATEWAY_BATCH_SIZE 1024
+#endif
+
+// A non empty batch is sent at latest after this time (in ms)
+#ifndef STFBT_GATEWAY_FLUSH_TIME
+#  define STFBT_GATEWAY_FLUSH_TIME 1000
+#endif
+
+// LZ4 block compression of the records (used only if it makes the batch smaller)
+#ifndef STFBT_GATEWAY_COMPRESS
+#  define STFBT_GATEWAY_COMPRESS 1
+#endif
+
+#if STFBT_GATEWAY == 1
+
+static_assert(STFBT_GATEWAY_BATCH_SIZE <= 65535, "STFBT_GATEWAY_BATCH_SIZE should fit into 16 bit");
+
+namespace stf {
+
+struct BTRawPacket;
+
+// Batch format (little endian):
+//   header:  'S' 'B' version(1) flags(1: bit0 - LZ4 block compressed records) time(4: uptime ms of the first record)
+//            count(2: number of records) recordsLength(2: uncompressed length of the records)
+//   records: length(1: bytes after this one) timeDelta(2: ms from the header time, saturated) mac(6: most significant first)
+//            types(1: address type << 4 | advertisement type) rssi(1: signed, 127 - unknown) payload(length - 10)
+class BTGateway {
+public:
+  static constexpr uint8_t Version = 1;
+  static constexpr uint HeaderSize = 12;
+  static constexpr uint RecordHeaderSize = 11;
+
+  bool add(const BTRawPacket& raw); // false: the packet is dropped (both batches are full)
+  void update(uint32_t now); // flushes by time
+
+  // Consumer side (different task)
+  const uint8_t* getBatch(uint& len);
+  void releaseBatch();
+
+  uint32_t _batchesSent = 0;
+
+protected:
+  bool flush();
+#  if STFBT_GATEWAY_COMPRESS == 1
+  uint compress(const uint8_t* src, uint srcLen, uint8_t* dst, uint dstCap);
+  uint16_t _hashTable[256];
+#  endif
+
+  uint8_t _records[STFBT_GATEWAY_BATCH_SIZE];
+  uint _recordsLength = 0;
+  uint16_t _recordCount = 0;
+  uint32_t _batchTime = 0;
+
+  uint8_t _batch[HeaderSize + STFBT_GATEWAY_BATCH_SIZE];
+  uint _batchLength = 0;
+  bool _batchReady = false; // atomic access, set by the BT task, cleared by the consumer
+};
+
+} // namespace stf
+
+#endif
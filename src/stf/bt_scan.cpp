@@ -0,0 +1,42 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stf/bt_scan.h>
+
+namespace stf {
+
+bool BTScanController::update(uint32_t elapsedMS, const BTScanLoad& load) {
+  if (elapsedMS == 0 || load.bufferSize == 0) return false;
+  uint32_t fill = (load.bufferSize - load.freeBlocks) * 100u / load.bufferSize;
+  uint32_t forwardRate = load.forwarded * 1000u / elapsedMS;
+  uint32_t scanRate = load.scanned * 1000u / elapsedMS;
+
+  uint16_t window = _window;
+  if (!_adaptive)
+    window = STFBT_SCAN_WINDOW;
+  else if (load.dropped != 0 || fill >= STFBT_SCAN_FILL_HIGH || forwardRate >= STFBT_SCAN_FORWARD_HIGH || scanRate >= STFBT_SCAN_SCANNED_HIGH)
+    window = window / 2 > STFBT_SCAN_WINDOW_MIN ? window / 2 : STFBT_SCAN_WINDOW_MIN;
+  else if (fill <= STFBT_SCAN_FILL_LOW && forwardRate < STFBT_SCAN_FORWARD_HIGH / 2 && scanRate < STFBT_SCAN_SCANNED_HIGH / 2)
+    window = window + STFBT_SCAN_WINDOW_STEP < STFBT_SCAN_WINDOW_MAX ? window + STFBT_SCAN_WINDOW_STEP : STFBT_SCAN_WINDOW_MAX;
+
+  bool res = window != _window;
+  _window = window;
+  return res;
+}
+
+} // namespace stf
@@ -0,0 +1,89 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// Scan interval and the initial (non adaptive) window in ms
+#ifndef STFBT_SCAN_INTERVAL
+#  define STFBT_SCAN_INTERVAL 97
+#endif
+#ifndef STFBT_SCAN_WINDOW
+#  define STFBT_SCAN_WINDOW 30
+#endif
+
+// Adaptive scan window: range, additive increase step and the period of the control (in ms)
+#ifndef STFBT_SCAN_WINDOW_MIN
+#  define STFBT_SCAN_WINDOW_MIN 10
+#endif
+#ifndef STFBT_SCAN_WINDOW_MAX
+#  define STFBT_SCAN_WINDOW_MAX 90
+#endif
+#ifndef STFBT_SCAN_WINDOW_STEP
+#  define STFBT_SCAN_WINDOW_STEP 10
+#endif
+#ifndef STFBT_SCAN_CONTROL_PERIOD
+#  define STFBT_SCAN_CONTROL_PERIOD 5000
+#endif
+
+// Load limits: buffer fill (%) to back off / to widen, forwarded packets/s (~MQTT messages on wifi) and scanned packets/s to back off
+#ifndef STFBT_SCAN_FILL_HIGH
+#  define STFBT_SCAN_FILL_HIGH 75
+#endif
+#ifndef STFBT_SCAN_FILL_LOW
+#  define STFBT_SCAN_FILL_LOW 25
+#endif
+#ifndef STFBT_SCAN_FORWARD_HIGH
+#  define STFBT_SCAN_FORWARD_HIGH 40
+#endif
+#ifndef STFBT_SCAN_SCANNED_HIGH
+#  define STFBT_SCAN_SCANNED_HIGH 300
+#endif
+
+static_assert(STFBT_SCAN_WINDOW_MIN <= STFBT_SCAN_WINDOW && STFBT_SCAN_WINDOW <= STFBT_SCAN_WINDOW_MAX && STFBT_SCAN_WINDOW_MAX <= STFBT_SCAN_INTERVAL, "Invalid BT scan window settings");
+
+namespace stf {
+
+// Counters of one control period
+struct BTScanLoad {
+  uint32_t scanned;
+  uint32_t forwarded;
+  uint32_t dropped; // raw queue overflow
+  uint16_t freeBlocks;
+  uint16_t bufferSize;
+};
+
+// AIMD control of the scan window: halved on overload, widened step by step when idle
+// It has no platform dependency, so it can be driven by a simulated packet source
+class BTScanController {
+public:
+  // Gives back true if the window has changed
+  bool update(uint32_t elapsedMS, const BTScanLoad& load);
+
+  inline uint16_t getWindow() const { return _window; }
+  inline uint16_t getInterval() const { return STFBT_SCAN_INTERVAL; }
+  inline float getDutyCycle() const { return _window * 100.f / STFBT_SCAN_INTERVAL; }
+
+  bool _adaptive = true; // false: the window goes back to STFBT_SCAN_WINDOW
+
+protected:
+  uint16_t _window = STFBT_SCAN_WINDOW;
+};
+
+} // namespace stf
@@ -81,7 +81,7 @@ struct STFATTR_PACKED DataBlock {
   }
 
   inline DataBlock& setRaw(const uint8_t* raw, uint len) {
-    memcpy(_type == edt_Raw ? &_extra : _value.t8, raw, len);
+    memcpy(_type == edt_Raw || _type == edt_Base64 ? &_extra : _value.t8, raw, len);
     return *this;
   }
 
@@ -103,6 +103,6 @@ struct STFATTR_PACKED DataBlock {
   } _value;
 };
 
-static_assert(sizeof(DataBlock) == 12, "DataBlock size should be 12");
+static_assert(sizeof(DataBlock) == 12 || sizeof(void*) != 4, "DataBlock size should be 12"); // 32 bit target, the host harnesses have 64 bit pointers
 
 } // namespace stf
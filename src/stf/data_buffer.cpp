@@ -82,6 +82,19 @@ bool DataBuffer::hasClosedMessage() {
   return false;
 }
 
+bool DataBuffer::hasGeneratorMessage() {
+  int ridx = getReadIdx();
+  int widx = getWriteIdx();
+
+  if (widx < ridx) widx += 2 * _size;
+  for (; ridx < widx; ridx++) {
+    DataBlock& block = _buffer[ridx % _size];
+    if (block._type == edt_Generator) return true;
+    if (block.isClosedMessage()) break;
+  }
+  return false;
+}
+
 uint DataBuffer::getUsedBlocks() {
   int ridx = getReadIdx();
   int widx = getWriteIdx();
@@ -106,6 +119,19 @@ DataBlock& DataBuffer::getWriteBlock() {
   return _buffer[widx % _size];
 }
 
+DataBlock& DataBuffer::getWrittenBlock(uint idx) {
+  int widx = getWriteIdx();
+  return _buffer[(widx + 2 * _size - 1 - idx) % _size];
+}
+
+uint DataBuffer::getWritePosition() {
+  return getWriteIdx();
+}
+
+uint DataBuffer::getWrittenSince(uint position) {
+  return (getWriteIdx() + 2 * _size - position) % (2 * _size);
+}
+
 DataBlock& DataBuffer::nextToWrite(EnumDataField field, EnumDataType type, uint8_t typeInfo, uint8_t extra) {
   int widx = getWriteIdx();
   DataBlock& block = _buffer[widx % _size];
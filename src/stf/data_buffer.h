@@ -48,9 +48,14 @@ public:
   uint getUsedBlocks();
   uint getFreeBlocks();
   bool hasClosedMessage();
+  bool hasGeneratorMessage(); // the next closed message contains a generator block
 
   DataBlock& getReadBlock();
   DataBlock& getWriteBlock();
+  DataBlock& getWrittenBlock(uint idx); // idx: 0 - the last written block
+  // Producer side only: independent of the consumer's read index
+  uint getWritePosition();
+  uint getWrittenSince(uint position); // blocks written since getWritePosition() gave back position
   void IncrementReadIndex();
   void IncrementWriteIndex();
 
@@ -61,6 +66,16 @@ public:
     return _parentConsumer;
   }
 
+  inline TaskRoot* getTask() {
+    return _parentTask;
+  }
+
+  // Consumer lane: higher priority buffers are drained first, the ones with the same priority share the budget by weight
+  inline void setLane(uint8_t priority, uint8_t weight) {
+    _priority = priority;
+    _weight = weight > 0 ? weight : 1;
+  }
+
 protected:
   // #include <memory> and #include <stdatomic.h> have conflicts...
   struct {
@@ -80,6 +95,9 @@ protected:
   // List of buffers for the consumer
   DataBuffer* _consumerBufferNext;
   Consumer* _parentConsumer;
+  uint8_t _priority = 0;
+  uint8_t _weight = 1;
+  uint8_t _credit = 0; // messages left in the current weighted round
   friend class Consumer;
 };
 
@@ -100,6 +118,8 @@ protected:
   STF_BUFFER_DECLARE(name, size, task)                      \
   STF_BUFFER_PROVIDER(name, provider1)                      \
   STF_BUFFER_PROVIDER(name, provider2)
+// Optional, after the buffer: STF_BUFFER1(systemBuffer, 32, Main, SystemProvider) STF_BUFFER_LANE(systemBuffer, 1, 1)
+#define STF_BUFFER_LANE(name, priority, weight)
 #define STF_BUFFER_DECLARE(name, size, task) extern StaticDataBuffer<size> g_##name;
 #define STF_BUFFER_PROVIDER(name, provider)  constexpr DataBuffer* g_buffer##provider = &g_##name;
 STFBUFFERS;
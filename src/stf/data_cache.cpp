@@ -32,7 +32,7 @@ void DataCache::addBlock(const DataBlock& block, uint8_t cmd) {
     case eeiCacheDeviceMAC48:
     case eeiCacheDeviceMAC64:
       setBlockDevice(block);
-      _device.create(block._value.t8, chcmd == eeiCacheDeviceMAC48 ? 6 : 8);
+      _device.createCached(block._value.t8, chcmd == eeiCacheDeviceMAC48 ? 6 : 8);
       break;
     case eeiCacheDeviceHost:
       setBlockDevice(block);
@@ -28,4 +28,33 @@ const char* DataField::_list[] = {
 
 const uint DataField::_listNum = sizeof(DataField::_list) / sizeof(DataField::_list[0]);
 
+static constexpr const char* _names[] = {
+#define E(e) #e,
+#include <stf/data_field.def>
+#undef E
+};
+
+static constexpr uint _firstPublic = DataField::firstPublic(_names);
+
+static_assert(DataField::isSorted(_names, _firstPublic), "data_field.def should be sorted (after the \"_\" prefixed names) for DataField::find");
+
+EnumDataField DataField::find(const char* str, uint len) {
+  if (str == nullptr) return edf__none;
+  uint lo = _firstPublic, hi = _listNum;
+  while (lo < hi) {
+    uint mid = (lo + hi) / 2;
+    const char* name = _list[mid];
+    int cmp = strncmp(str, name, len);
+    if (cmp == 0) {
+      if (name[len] == 0) return (EnumDataField)mid;
+      cmp = -1; // str is a prefix of name
+    }
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return edf__none;
+}
+
 } // namespace stf
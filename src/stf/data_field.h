@@ -26,11 +26,32 @@ enum EnumDataField {
 #define E(e) edf_##e,
 #include <stf/data_field.def>
 #undef E
+  edf__count
 };
 
 struct DataField {
   static const char* _list[];
   static const uint _listNum;
+
+  // binary search over the names, the "_" prefixed internal ones are skipped; edf__none if not found
+  static EnumDataField find(const char* str, uint len);
+
+  static constexpr bool lessName(const char* a, const char* b) {
+    return *a != *b ? (uint8_t)*a < (uint8_t)*b : *a != 0 && lessName(a + 1, b + 1);
+  }
+
+  template <uint N>
+  static constexpr uint firstPublic(const char* const (&list)[N], uint idx = 0) {
+    return idx < N && list[idx][0] == '_' ? firstPublic(list, idx + 1) : idx;
+  }
+
+  // halving recursion keeps the depth low for the compile time check
+  template <uint N>
+  static constexpr bool isSorted(const char* const (&list)[N], uint from, uint to = N) {
+    return to - from < 2    ? true
+           : to - from == 2 ? lessName(list[from], list[from + 1])
+                            : isSorted(list, from, (from + to) / 2 + 1) && isSorted(list, (from + to) / 2, to);
+  }
 };
 
 } // namespace stf
@@ -32,6 +32,7 @@ const char* DataType::_topicNames[] = {
     "SYS", // etitSYS
     "SYSR", // etitSYSR
     "BT", // etitBT
+    "BTRAW", // etitBTRAW
 };
 
 EnumTypeInfoTopic DataType::findTopicName(const char* str, uint strLen) {
@@ -208,6 +209,23 @@ int DataType::fnDTRaw(char* buffer, uint len, const DataBlock& block, DataCache&
   return resLen;
 }
 
+int DataType::fnDTBase64(char* buffer, uint len, const DataBlock& block, DataCache& cache) {
+  static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint size = block._typeInfo & etirSizeMask;
+  const uint8_t* buff = &block._extra;
+  uint resLen = 0;
+  for (uint idx = 0; idx < size; idx += 3) {
+    uint32_t value = buff[idx] << 16 | (idx + 1 < size ? buff[idx + 1] << 8 : 0) | (idx + 2 < size ? buff[idx + 2] : 0);
+    char chunk[4] = {chars[value >> 18 & 63], chars[value >> 12 & 63], idx + 1 < size ? chars[value >> 6 & 63] : '=', idx + 2 < size ? chars[value & 63] : '='};
+    for (char chr : chunk) {
+      if (resLen < len) buffer[resLen] = chr;
+      resLen++;
+    }
+  }
+  if (resLen < len) buffer[resLen] = '\0';
+  return resLen;
+}
+
 int DataType::fnDT32(char* buffer, uint len, const DataBlock& block, DataCache& cache) {
   uint32_t value = block._value.t32[0];
   const char* fmt = (block._typeInfo & 1) == 0 ? "%lu" : "%ld";
@@ -63,6 +63,7 @@ enum EnumTypeInfoTopic {
   etitSYS = 2,
   etitSYSR = 3,
   etitBT = 4,
+  etitBTRAW = 5, // binary, see BTGateway
 
   etitTopicSubjectMask = 7,
 
@@ -116,6 +117,7 @@ enum EnumTypeInfoString {
   etisCaseMask = 3 << 5,
 };
 
+// edt_Base64 uses the size only; its continuation blocks should hold multiples of 3 bytes, so only the last block is padded
 enum EnumTypeInfoRaw {
   etirSizeMask = 15,
   etirFormatNumber = 0 << 4,
@@ -18,6 +18,7 @@
 
 #include <stf/os.h>
 #include <stf/mac2strid.h>
+#include <stf/util.h>
 
 namespace stf {
 
@@ -40,6 +41,10 @@ void DeviceBlock::create(const uint8_t* mac, uint macLen) {
   info.strId = strIdBuffer;
 }
 
+void DeviceBlock::createCached(const uint8_t* mac, uint macLen) {
+  info = DeviceInfoCache::get(mac, macLen);
+}
+
 void DeviceBlock::createMissing() {
   if (info.strMAC == nullptr) {
     info.strMAC = strMACBuffer;
@@ -53,4 +58,38 @@ void DeviceBlock::createMissing() {
   }
 }
 
+// DeviceInfoCache
+
+DeviceInfoCache::Entry DeviceInfoCache::_entries[STF_DEVICE_CACHE_SETS][2];
+uint32_t DeviceInfoCache::_useCounter = 0;
+uint32_t DeviceInfoCache::_hits = 0;
+uint32_t DeviceInfoCache::_misses = 0;
+
+const DeviceInfo& DeviceInfoCache::get(const uint8_t* mac, uint macLen) {
+  uint32_t hash = Util::hash(mac, macLen);
+  Entry* set = _entries[(hash ^ hash >> 16) % STF_DEVICE_CACHE_SETS];
+  _useCounter++;
+
+  for (uint way = 0; way < 2; way++) {
+    Entry& entry = set[way];
+    if (entry.info.macLen == macLen && macLen != 0 && memcmp(entry.mac, mac, macLen) == 0) {
+      entry.lastUse = _useCounter;
+      _hits++;
+      return entry.info;
+    }
+  }
+
+  Entry& entry = set[set[0].lastUse <= set[1].lastUse ? 0 : 1];
+  memcpy(entry.mac, mac, macLen);
+  Mac::toMacId(entry.strMAC, entry.mac, macLen);
+  Mac::toStrId(entry.strId, entry.mac, macLen);
+  entry.info.mac = entry.mac;
+  entry.info.macLen = macLen;
+  entry.info.strMAC = entry.strMAC;
+  entry.info.strId = entry.strId;
+  entry.lastUse = _useCounter;
+  _misses++;
+  return entry.info;
+}
+
 } // namespace stf
@@ -18,6 +18,11 @@
 
 #pragma once
 
+// Number of sets in the identity string cache (2 devices per set)
+#ifndef STF_DEVICE_CACHE_SETS
+#  define STF_DEVICE_CACHE_SETS 16
+#endif
+
 namespace stf {
 
 struct DeviceInfo {
@@ -40,7 +45,30 @@ struct DeviceBlock {
 
   void reset();
   void create(const uint8_t* mac, uint macLen);
+  void createCached(const uint8_t* mac, uint macLen); // info points into DeviceInfoCache, valid till the next few createCached calls
   void createMissing();
 };
 
+// Identity strings computed once per device: 2-way set associative, the least recently used entry of the set is replaced
+// So the entry used last is never replaced by the next call; not thread safe, used by the consumers
+class DeviceInfoCache {
+public:
+  static const DeviceInfo& get(const uint8_t* mac, uint macLen);
+
+  static uint32_t _hits;
+  static uint32_t _misses;
+
+protected:
+  struct Entry {
+    DeviceInfo info;
+    uint32_t lastUse;
+    uint8_t mac[8];
+    char strId[STF_STRID_SIZE];
+    char strMAC[STF_STRID_SIZE];
+  };
+
+  static Entry _entries[STF_DEVICE_CACHE_SETS][2];
+  static uint32_t _useCounter;
+};
+
 } // namespace stf
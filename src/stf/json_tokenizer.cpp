@@ -0,0 +1,169 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stf/json_tokenizer.h>
+
+namespace stf {
+
+void JsonTokenizer::start(const char* json, uint len) {
+  _end = json + len;
+  _pos = skipSpace(json);
+  _first = true;
+  _failed = false;
+  _key = _value = nullptr;
+  _keyLen = _valueLen = 0;
+  _type = EJsonType::None;
+  if (_pos == _end || *_pos != '{')
+    fail();
+  else
+    _pos++;
+}
+
+bool JsonTokenizer::fail() {
+  _failed = _pos != nullptr;
+  _pos = nullptr;
+  _type = EJsonType::None;
+  return false;
+}
+
+bool JsonTokenizer::next() {
+  if (_pos == nullptr) return false;
+  _type = EJsonType::None;
+
+  const char* str = skipSpace(_pos);
+  if (str == _end) return fail();
+  if (*str == '}') { // end of the object, trailing characters are ignored
+    _pos = nullptr;
+    return false;
+  }
+  if (!_first) {
+    if (*str != ',') return fail();
+    str = skipSpace(str + 1);
+  }
+  _first = false;
+
+  if (str == _end || *str != '"') return fail();
+  _key = str + 1;
+  if ((str = skipString(str)) == nullptr) return fail();
+  _keyLen = str - 1 - _key;
+
+  str = skipSpace(str);
+  if (str == _end || *str != ':') return fail();
+  str = skipSpace(str + 1);
+
+  EJsonType type;
+  const char* valueEnd = skipValue(str, type);
+  if (valueEnd == nullptr) return fail();
+  _type = type;
+  _value = type == EJsonType::String ? str + 1 : str;
+  _valueLen = (type == EJsonType::String ? valueEnd - 1 : valueEnd) - _value;
+  _pos = valueEnd;
+  return true;
+}
+
+const char* JsonTokenizer::skipSpace(const char* str) const {
+  while (str < _end && (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r')) str++;
+  return str;
+}
+
+// str points to the opening quote, returns the position after the closing one
+const char* JsonTokenizer::skipString(const char* str) const {
+  for (str++; str < _end; str++) {
+    if ((uint8_t)*str < 0x20) return nullptr;
+    if (*str == '"') return str + 1;
+    if (*str == '\\' && ++str == _end) return nullptr;
+  }
+  return nullptr;
+}
+
+const char* JsonTokenizer::skipNumber(const char* str) const {
+  if (str < _end && *str == '-') str++;
+  if (str == _end || !isdigit(*str)) return nullptr;
+  if (*str == '0')
+    str++;
+  else
+    while (str < _end && isdigit(*str)) str++;
+  if (str < _end && *str == '.') {
+    if (++str == _end || !isdigit(*str)) return nullptr;
+    while (str < _end && isdigit(*str)) str++;
+  }
+  if (str < _end && (*str == 'e' || *str == 'E')) {
+    if (++str < _end && (*str == '+' || *str == '-')) str++;
+    if (str == _end || !isdigit(*str)) return nullptr;
+    while (str < _end && isdigit(*str)) str++;
+  }
+  return str;
+}
+
+const char* JsonTokenizer::skipLiteral(const char* str) const {
+  static const char* literals[] = {"true", "false", "null"};
+  for (const char* literal : literals) {
+    uint len = strlen(literal);
+    if ((uint)(_end - str) >= len && memcmp(str, literal, len) == 0) return str + len;
+  }
+  return nullptr;
+}
+
+// Only the bracket pairing and the strings are checked inside, a bit per level tracks the open brackets
+const char* JsonTokenizer::skipNested(const char* str) const {
+  uint32_t objects = 0;
+  uint depth = 0;
+  while (str < _end) {
+    char chr = *str;
+    if (chr == '"') {
+      if ((str = skipString(str)) == nullptr) return nullptr;
+      continue;
+    }
+    if (chr == '{' || chr == '[') {
+      if (depth == MaxDepth) return nullptr;
+      objects = (objects << 1) | (chr == '{' ? 1 : 0);
+      depth++;
+    } else if (chr == '}' || chr == ']') {
+      if ((objects & 1) != (chr == '}' ? 1u : 0u)) return nullptr;
+      objects >>= 1;
+      if (--depth == 0) return str + 1;
+    }
+    str++;
+  }
+  return nullptr;
+}
+
+const char* JsonTokenizer::skipValue(const char* str, EJsonType& type) const {
+  if (str == _end) return nullptr;
+  switch (*str) {
+    case '"':
+      type = EJsonType::String;
+      return skipString(str);
+    case '{':
+      type = EJsonType::Object;
+      return skipNested(str);
+    case '[':
+      type = EJsonType::Array;
+      return skipNested(str);
+    case 't':
+    case 'f':
+    case 'n':
+      type = EJsonType::Literal;
+      return skipLiteral(str);
+    default:
+      type = EJsonType::Number;
+      return skipNumber(str);
+  }
+}
+
+} // namespace stf
@@ -0,0 +1,67 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <stf/os.h>
+
+namespace stf {
+
+enum class EJsonType : uint8_t {
+  None,
+  String, // value span is the raw content between the quotes, escapes are not decoded
+  Number,
+  Literal, // true, false or null
+  Object, // value span is the whole nested object / array, including the brackets
+  Array
+};
+
+// Zero-copy tokenizer for the members of a flat JSON object (like the retained SYSR state).
+// The key / value spans point into the input buffer, nested objects and arrays are returned as one value.
+class JsonTokenizer {
+public:
+  // Top level nesting supported inside the values
+  static constexpr uint MaxDepth = 32;
+
+  void start(const char* json, uint len);
+  bool next();
+
+  inline bool isFailed() const { return _failed; }
+
+  const char* _key;
+  uint _keyLen;
+  const char* _value;
+  uint _valueLen;
+  EJsonType _type;
+
+protected:
+  bool fail();
+  const char* skipSpace(const char* str) const;
+  const char* skipString(const char* str) const;
+  const char* skipNumber(const char* str) const;
+  const char* skipLiteral(const char* str) const;
+  const char* skipNested(const char* str) const;
+  const char* skipValue(const char* str, EJsonType& type) const;
+
+  const char* _pos = nullptr;
+  const char* _end = nullptr;
+  bool _first = false;
+  bool _failed = false;
+};
+
+} // namespace stf
@@ -29,7 +29,7 @@ namespace stf {
 
 MQTTConsumer MQTTConsumer::_obj;
 
-MQTTConsumer::MQTTConsumer() : _client(_wifiClient) {
+MQTTConsumer::MQTTConsumer() {
 }
 
 void MQTTConsumer::callback(char* topic, byte* payload, unsigned int length) {
@@ -47,7 +47,7 @@ void MQTTConsumer::callback(char* topic, byte* payload, unsigned int length) {
                 info.fieldStrLen, info.fieldStrLen, info.fieldStr,
                 info.topicEnum, info.fieldEnum,
                 length, length, payload);
-    if (send) _obj.broadcastFeedback(info);
+    if (send) Provider::routeFeedback(info);
     if (!(send = info.next())) break;
     length = info.payloadLength;
     payload = (byte*)info.payload;
@@ -57,30 +57,60 @@ void MQTTConsumer::callback(char* topic, byte* payload, unsigned int length) {
 void MQTTConsumer::setup() {
   int port = strtol(NetTask::_mqttPort, nullptr, 10);
   STFLOG_INFO("MQTT Server - %s:%d\n", NetTask::_mqttServer, port);
-  _client.setServer(NetTask::_mqttServer, (uint16_t)port);
-  _client.setBufferSize(STFMQTT_JSONBUFFER_SIZE);
-  _client.setCallback(callback);
+  _client->setServer(NetTask::_mqttServer, (uint16_t)port);
+  _client->setCallback(callback);
+#  if STFMQTT_OFFLINE == 1
+  _offline.setup();
+  _client->setRequeue(requeue);
+#  endif
 
 #  undef STF_BUFFER_DECLARE
 #  define STF_BUFFER_DECLARE(name, size, task) _obj.addBuffer(&g_##name);
 #  undef STF_BUFFER_PROVIDER
 #  define STF_BUFFER_PROVIDER(name, provider)
+#  undef STF_BUFFER_LANE
+#  define STF_BUFFER_LANE(name, priority, weight) g_##name.setLane(priority, weight);
   STFBUFFERS;
 }
 
 uint32_t MQTTConsumer::loop() {
-  if (_client.connected()) {
+  MQTTTransport::EState state = _client->loop();
+  if (state == MQTTTransport::EState::Connected) {
+    if (_clientState != state) { // just connected
+      const char* topicFormat = "home/%s/%stoMQTT/%s";
+      char topic[strlen(topicFormat) + strlen(Host::_name) + strlen(DataType::_topicNames[etitCONN]) + strlen(Host::_info.strId)];
+      sprintf(topic, topicFormat, Host::_name, DataType::_topicNames[etitCONN], Host::_info.strId);
+      _client->publish(topic, R"({"connectivity":"ON"})", true);
+      Log::connected("MQTT server");
+      _connectionTry = 0;
+      _readyTime.reset();
+      _messageArrived = 0;
+      localSubscribe("home/%s/+/%s/command/#");
+      localSubscribe("home/%s/SYSRtoMQTT/%s");
+    }
+    _clientState = state;
     STFLED_COMMAND(STFLEDEVENT_MQTT_CONNECTED);
     if (_messageArrived < 2 && (_messageArrived == 1 || _readyTime.elapsedTime() > 5000)) {
       _messageArrived = 2;
       localSubscribe("home/%s/SYSRtoMQTT/%s", false);
     }
     // We might have setting retained, wait for that so they won't be overwritten
-    if (_messageArrived == 2) consumeBuffers(_jsonBuffer);
-    _client.loop();
+    if (_messageArrived == 2) {
+#  if STFMQTT_OFFLINE == 1
+      _wasReady = true;
+      replayOffline();
+#  endif
+      if (consumeBuffers(_jsonBuffer)) return 1; // continue the backlog soon, after the client loop
+    }
     return 10;
   }
+  if (_clientState == MQTTTransport::EState::Connected) STFLOG_INFO("MQTT connection lost (%u publishes requeued, %u dropped so far).\n", _client->_requeued, _client->_dropped);
+  _clientState = state;
   STFLED_COMMAND(STFLEDEVENT_MQTT_NOT_CONNECTED);
+#  if STFMQTT_OFFLINE == 1
+  if (_wasReady) consumeBuffers(_jsonBuffer); // goes into the offline queue
+#  endif
+  if (state != MQTTTransport::EState::Disconnected) return 10; // connection in progress
   if (WiFi.isConnected()) {
     if (_connectionTry == 0 || _readyTime.elapsedTime() > 5000) {
       _connectionTry++;
@@ -89,29 +119,80 @@ uint32_t MQTTConsumer::loop() {
       const char* willTopicFormat = "home/%s/%stoMQTT/%s";
       char willTopic[strlen(willTopicFormat) + strlen(Host::_name) + strlen(DataType::_topicNames[etitCONN]) + strlen(Host::_info.strId)];
       sprintf(willTopic, willTopicFormat, Host::_name, DataType::_topicNames[etitCONN], Host::_info.strId);
-      if (_client.connect(Host::_name, NetTask::_mqttUser, NetTask::_mqttPassword, willTopic, 0, true, R"({"connectivity":"OFF"})")) {
-        _client.publish(willTopic, R"({"connectivity":"ON"})", true);
-        Log::connected("MQTT server");
-        _connectionTry = 0;
-        _readyTime.reset();
-        _messageArrived = 0;
-        localSubscribe("home/%s/+/%s/command/#");
-        localSubscribe("home/%s/SYSRtoMQTT/%s");
-        return 10;
-      } else {
-        STFLOG_INFO("Unable to connect to the MQTT Server.\n");
-      }
+      if (_client->connect(Host::_name, NetTask::_mqttUser, NetTask::_mqttPassword, willTopic, 0, true, R"({"connectivity":"OFF"})")) return 10;
+      STFLOG_INFO("Unable to connect to the MQTT Server.\n");
     }
   }
   return 0;
 }
 
 // Don't allow to the Providers (SystemProvider!!!) to generate any message till the status message is not arrived (or already waited 5sec)
-bool MQTTConsumer::isReady() { return _client.connected() && _messageArrived == 2; }
+bool MQTTConsumer::isReady() { return _client->connected() && _messageArrived == 2; }
+
+#  if STFMQTT_OFFLINE == 1
+bool MQTTConsumer::isAccepting() { return isReady() || _wasReady; }
+#  else
+bool MQTTConsumer::isAccepting() { return isReady(); }
+#  endif
 
 bool MQTTConsumer::send(JsonBuffer& jsonBuffer, bool retain) {
-  //return false;
-  return _client.publish(jsonBuffer._buffer + jsonBuffer._jsonSize, (const uint8_t*)jsonBuffer._buffer, jsonBuffer._pos, retain);
+  const char* topic = jsonBuffer._buffer + jsonBuffer._jsonSize;
+  // The drain stops before the output buffer gets full (isCongested), the publish fails only if the connection is lost
+  if (_client->publish(topic, (const uint8_t*)jsonBuffer._buffer, jsonBuffer._pos, retain, STFMQTT_QOS)) return true;
+#  if STFMQTT_OFFLINE == 1
+  // The retained ones (discovery, settings) are regenerated after reconnect
+  if (!retain && _offline.push(topic, (const uint8_t*)jsonBuffer._buffer, jsonBuffer._pos, Host::uptimeMS32()))
+    STFLOG_INFO("MQTT message queued for replay (%u pending, %u dropped).\n", _offline._count, _offline._dropped);
+#  endif
+  return false;
+}
+
+#  if STFMQTT_OFFLINE == 1
+// The publishes still in the output buffer of the client at a connection loss
+void MQTTConsumer::requeue(const char* topic, uint topicLen, const uint8_t* payload, uint length) {
+  char topicStr[topicLen + 1];
+  memcpy(topicStr, topic, topicLen);
+  topicStr[topicLen] = 0;
+  _obj._offline.push(topicStr, payload, length, Host::uptimeMS32());
+}
+
+// One message per 1/STFMQTT_OFFLINE_RATE sec, the JSON buffer is free between the consume calls
+void MQTTConsumer::replayOffline() {
+  if (_offline.isEmpty() || _replayTime.elapsedTime() < 1000 / STFMQTT_OFFLINE_RATE) return;
+  _replayTime.reset();
+
+  OfflineRecord record;
+  if (!_offline.front(_jsonBuffer._buffer, _jsonBuffer._totalSize, record)) return;
+  uint len = record.payloadLength;
+  char* end = (char*)record.payload + len;
+  if (!record.previousBoot && len != 0 && end[-1] == '}') { // the original time as age in seconds
+    char age[32];
+    int ageLen = sprintf(age, ",\"%s\":%u}", DataField::_list[edf_age], (Host::uptimeMS32() - record.time) / 1000);
+    if (end - 1 + ageLen <= _jsonBuffer._buffer + _jsonBuffer._totalSize) {
+      memcpy(end - 1, age, ageLen);
+      len += ageLen - 1;
+    }
+  }
+  if (!_client->canPublish(strlen(record.topic) + len, STFMQTT_QOS)) return; // congested, next time
+  bool res = _client->publish(record.topic, record.payload, len, false, STFMQTT_QOS);
+  STFLOG_INFO("Replaying offline MQTT message (%s) %s, %u left.\n", record.topic, res ? "succeeded" : "failed", _offline._count - res);
+  if (res) _offline.pop();
+}
+#  endif
+
+// Not limited by the JSON buffer, only by STFMQTT_OUTPUT_SIZE
+bool MQTTConsumer::sendRaw(uint8_t topic, const uint8_t* data, uint len) {
+  const char* topicFormat = "home/%s/%stoMQTT/%s";
+  char topicStr[strlen(topicFormat) + strlen(Host::_name) + strlen(DataType::_topicNames[topic]) + strlen(Host::_info.strId)];
+  sprintf(topicStr, topicFormat, Host::_name, DataType::_topicNames[topic], Host::_info.strId);
+  return _client->publish(topicStr, data, len, false); // kept by the provider and retried in the next loop if there is no room
+}
+
+// The published messages are written by the client loop, the drain continues in the next consumer loop
+// A generator block renders several messages at once (discovery), it waits till the client is idle
+bool MQTTConsumer::isCongested(bool generator) {
+  if (!_client->connected()) return false; // offline queue
+  return generator ? !_client->isIdle() : !_client->canPublish(STFMQTT_MESSAGE_ROOM, STFMQTT_QOS);
 }
 
 void MQTTConsumer::localSubscribe(const char* topicFormat, bool subscribe) {
@@ -119,9 +200,9 @@ void MQTTConsumer::localSubscribe(const char* topicFormat, bool subscribe) {
   sprintf(subscribeStr, topicFormat, Host::_name, Host::_info.strId);
   STFLOG_INFO("%10llu MQTT %s %s\n", Host::uptimeMS64(), subscribe ? "subscribe to" : "unsubscribe from", subscribeStr);
   if (subscribe)
-    _client.subscribe(subscribeStr);
+    _client->subscribe(subscribeStr);
   else
-    _client.unsubscribe(subscribeStr);
+    _client->unsubscribe(subscribeStr);
 }
 
 } // namespace stf
@@ -23,10 +23,12 @@
 #if STFMQTT == 1
 
 #  include <stf/json_buffer.h>
+#  include <stf/link_offline.h>
 #  include <stf/provider.h>
 
+#  include <stf/link_mqtt_client.h>
+
 #  include <WiFi.h>
-#  include <PubSubClient.h>
 
 namespace stf {
 
@@ -38,20 +40,38 @@ public:
   uint32_t loop();
 
   bool isReady() override;
+  bool isAccepting() override;
+
+  inline void setTransport(MQTTTransport* transport) { _client = transport; } // before setup()
 
 protected:
   MQTTConsumer();
   bool send(JsonBuffer& jsonBuffer, bool retain) override;
+  bool sendRaw(uint8_t topic, const uint8_t* data, uint len) override;
+  bool isCongested(bool generator) override;
   void localSubscribe(const char* topicFormat, bool subscribe = true);
+#  if STFMQTT_OFFLINE == 1
+  void replayOffline();
+#  endif
 
   static void callback(char* topic, byte* payload, unsigned int length);
+#  if STFMQTT_OFFLINE == 1
+  static void requeue(const char* topic, uint topicLen, const uint8_t* payload, uint length);
+#  endif
 
   StaticJsonBuffer<STFMQTT_JSONBUFFER_SIZE> _jsonBuffer;
   uint8_t _connectionTry = 0;
   uint8_t _messageArrived = 0;
 
-  WiFiClient _wifiClient;
-  PubSubClient _client;
+  MQTTClient _socketClient;
+  MQTTTransport* _client = &_socketClient;
+  MQTTTransport::EState _clientState = MQTTTransport::EState::Disconnected;
+
+#  if STFMQTT_OFFLINE == 1
+  OfflineQueue _offline;
+  ElapsedTime _replayTime;
+  bool _wasReady = false; // the retained settings arrived once, the providers can run while offline
+#  endif
 };
 
 } // namespace stf
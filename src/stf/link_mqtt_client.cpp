@@ -0,0 +1,531 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stf/link_mqtt_client.h>
+
+#if STFMQTT == 1
+
+#  include <stf/util.h>
+
+#  include <errno.h>
+#  include <unistd.h>
+#  include <lwip/sockets.h>
+#  include <lwip/netdb.h>
+#  undef connect // lwip compatibility macro
+
+namespace stf {
+
+enum EnumMQTTPacket : uint8_t {
+  empConnect = 1,
+  empConnAck = 2,
+  empPublish = 3,
+  empPubAck = 4,
+  empSubscribe = 8,
+  empSubAck = 9,
+  empUnsubscribe = 10,
+  empUnsubAck = 11,
+  empPingReq = 12,
+  empPingResp = 13,
+  empDisconnect = 14
+};
+
+void MQTTClient::setServer(const char* host, uint16_t port) {
+  _host = host;
+  _port = port;
+}
+
+bool MQTTClient::connect(const char* id, const char* user, const char* password, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage) {
+  closeSocket();
+  _outputLength = _outputSent = _inflightCount = 0;
+  _inputStage = 0;
+  _pingPending = false;
+  _keepAlive = STFMQTT_KEEPALIVE;
+  _window = STFMQTT_WINDOW;
+  _maxQos = 1;
+  _retainAvailable = true;
+#  if STFMQTT_VERSION == 5
+  _aliasMax = 0;
+  _outputWritten = 0;
+  for (TopicAlias& alias : _aliases) alias.lastUse = alias.outputEnd = 0;
+#  endif
+
+  const uint properties = STFMQTT_VERSION == 5 ? 1 : 0; // empty property lists
+  uint idLen = strlen(id);
+  uint remaining = 10 + properties + 2 + idLen;
+  uint8_t flags = 0x02; // clean session
+  if (willTopic != nullptr) {
+    flags |= 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0);
+    remaining += properties + 2 + strlen(willTopic) + 2 + strlen(willMessage);
+  }
+  if (user != nullptr && *user != 0) {
+    flags |= 0x80;
+    remaining += 2 + strlen(user);
+    if (password != nullptr) {
+      flags |= 0x40;
+      remaining += 2 + strlen(password);
+    }
+  }
+
+  uint8_t* pos = reserve(empConnect << 4, remaining);
+  if (pos == nullptr) return false;
+  pos = putString(pos, "MQTT", 4);
+  *pos++ = STFMQTT_VERSION;
+  *pos++ = flags;
+  pos = put16(pos, STFMQTT_KEEPALIVE);
+  if (properties != 0) *pos++ = 0;
+  pos = putString(pos, id, idLen);
+  if (flags & 0x04) {
+    if (properties != 0) *pos++ = 0;
+    pos = putString(pos, willTopic, strlen(willTopic));
+    pos = putString(pos, willMessage, strlen(willMessage));
+  }
+  if (flags & 0x80) pos = putString(pos, user, strlen(user));
+  if (flags & 0x40) pos = putString(pos, password, strlen(password));
+
+  if (!openSocket()) {
+    _outputLength = _outputSent = 0;
+    return false;
+  }
+  _state = EState::Connecting;
+  _stateTime = Host::uptimeMS32();
+  return true;
+}
+
+void MQTTClient::disconnect() {
+  if (_state == EState::Connected) {
+    uint8_t packet[2] = {empDisconnect << 4, 0};
+    send(_socket, packet, 2, 0);
+  }
+  closeSocket();
+}
+
+MQTTClient::EState MQTTClient::loop() {
+  if (_state == EState::Disconnected) return _state;
+
+  uint32_t now = Host::uptimeMS32();
+  const uint32_t timeout = _keepAlive * 1000;
+
+  if (_state == EState::Connecting) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(_socket, &fds);
+    timeval tv = {0, 0};
+    int res = select(_socket + 1, nullptr, &fds, nullptr, &tv);
+    if (res > 0) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(_socket, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        closeSocket();
+        return _state;
+      }
+      _state = EState::WaitConnAck;
+      _stateTime = now;
+    } else {
+      if (res < 0 || now - _stateTime > timeout) closeSocket();
+      return _state;
+    }
+  }
+
+  if (!flush() || !receive()) {
+    closeSocket();
+    return _state;
+  }
+
+  if (_state == EState::WaitConnAck) {
+    if (now - _stateTime > timeout) closeSocket();
+  } else if (_state == EState::Connected) {
+    if (_pingPending) {
+      if (now - _pingTime > timeout) closeSocket();
+    } else if (now - _lastOut >= timeout && _outputLength == 0) {
+      uint8_t* pos = reserve(empPingReq << 4, 0);
+      if (pos != nullptr) {
+        _pingPending = true;
+        _pingTime = now;
+        flush();
+      }
+    }
+    // No PUBACK for the oldest in-flight publish, the connection is considered broken
+    if (_inflightCount != 0 && now - _inflight[0].time > timeout) closeSocket();
+  }
+  return _state;
+}
+
+bool MQTTClient::publish(const char* topic, const uint8_t* payload, uint len, bool retain, uint8_t qos) {
+  uint topicLen = strlen(topic);
+  if (qos > _maxQos) qos = _maxQos;
+  if (_state != EState::Connected || !canPublish(topicLen + len, qos)) return false;
+  retain = retain && _retainAvailable;
+#  if STFMQTT_VERSION == 5
+  // known alias: the topic is sent only at the first use
+  bool known;
+  uint16_t alias = getTopicAlias(topic, topicLen, known);
+  uint properties = alias != 0 ? 3 : 0;
+  uint8_t* pos = reserve((empPublish << 4) | (qos << 1) | (retain ? 1 : 0), 2 + (known ? 0 : topicLen) + (qos != 0 ? 2 : 0) + 1 + properties + len);
+  pos = putString(pos, topic, known ? 0 : topicLen);
+  if (alias != 0) _aliases[alias - 1].outputEnd = _outputWritten + _outputLength;
+#  else
+  uint8_t* pos = reserve((empPublish << 4) | (qos << 1) | (retain ? 1 : 0), 2 + topicLen + (qos != 0 ? 2 : 0) + len);
+  pos = putString(pos, topic, topicLen);
+#  endif
+  if (qos != 0) {
+    uint16_t packetId = nextPacketId();
+    pos = put16(pos, packetId);
+    _inflight[_inflightCount++] = {packetId, Host::uptimeMS32()};
+  }
+#  if STFMQTT_VERSION == 5
+  *pos++ = properties;
+  if (alias != 0) {
+    *pos++ = 0x23; // Topic Alias
+    pos = put16(pos, alias);
+  }
+#  endif
+  memcpy(pos, payload, len);
+  _published++;
+  if (!flush()) closeSocket();
+  return true;
+}
+
+bool MQTTClient::subscribe(const char* topic) {
+  if (_state != EState::Connected) return false;
+  uint topicLen = strlen(topic);
+  const uint properties = STFMQTT_VERSION == 5 ? 1 : 0;
+  uint8_t* pos = reserve((empSubscribe << 4) | 0x02, 2 + properties + 2 + topicLen + 1);
+  if (pos == nullptr) return false;
+  pos = put16(pos, nextPacketId());
+  if (properties != 0) *pos++ = 0;
+  pos = putString(pos, topic, topicLen);
+  *pos = 0; // QoS0
+  return true;
+}
+
+bool MQTTClient::unsubscribe(const char* topic) {
+  if (_state != EState::Connected) return false;
+  uint topicLen = strlen(topic);
+  const uint properties = STFMQTT_VERSION == 5 ? 1 : 0;
+  uint8_t* pos = reserve((empUnsubscribe << 4) | 0x02, 2 + properties + 2 + topicLen);
+  if (pos == nullptr) return false;
+  pos = put16(pos, nextPacketId());
+  if (properties != 0) *pos++ = 0;
+  putString(pos, topic, topicLen);
+  return true;
+}
+
+bool MQTTClient::openSocket() {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char port[8];
+  sprintf(port, "%u", _port);
+  addrinfo* addr = nullptr;
+  if (_host == nullptr || getaddrinfo(_host, port, &hints, &addr) != 0 || addr == nullptr) return false;
+
+  _socket = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (_socket >= 0) {
+    fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (lwip_connect(_socket, addr->ai_addr, addr->ai_addrlen) != 0 && errno != EINPROGRESS) closeSocket();
+  }
+  freeaddrinfo(addr);
+  return _socket >= 0;
+}
+
+void MQTTClient::closeSocket() {
+  if (_socket >= 0) close(_socket);
+  _socket = -1;
+  _state = EState::Disconnected;
+  _dropped += _inflightCount - requeueOutput(); // the payload of the written ones is gone already
+  _outputLength = _outputSent = _inflightCount = 0;
+}
+
+// The broker drops a partially received packet, so the one being written is given back as well
+// The retained ones are regenerated after reconnect
+uint MQTTClient::requeueOutput() {
+  uint qos1 = 0;
+  for (uint pos = 0, size; pos < _outputLength; pos += size) {
+    const uint8_t* packet = _output + pos;
+    size = packetSize(packet);
+    if ((packet[0] >> 4) != empPublish) continue;
+    if (packet[0] & 0x06) qos1++;
+    if (packet[0] & 0x01) continue;
+    const uint8_t* end = packet + size;
+    const uint8_t* body = packet + 1;
+    while (*body++ & 0x80) {
+    }
+    const char* topic = (const char*)body + 2;
+    uint topicLen = (body[0] << 8) | body[1];
+    body += 2 + topicLen + (packet[0] & 0x06 ? 2 : 0);
+#  if STFMQTT_VERSION == 5
+    uint properties;
+    const uint8_t* props = readVarInt(body, end, properties);
+    body = props + properties;
+    if (topicLen == 0) // known alias, the only property
+      for (; props + 3 <= body; props += 3)
+        if (props[0] == 0x23) {
+          uint alias = (props[1] << 8) | props[2];
+          if (alias != 0 && alias <= STFMQTT_TOPIC_ALIASES) topicLen = strlen(topic = _aliases[alias - 1].topic);
+        }
+#  endif
+    if (_requeue != nullptr && topicLen != 0) {
+      (*_requeue)(topic, topicLen, body, end - body);
+      _requeued++;
+    } else {
+      _dropped++;
+    }
+  }
+  return qos1;
+}
+
+// Writes as much as the socket accepts
+bool MQTTClient::flush() {
+  if (_state == EState::Disconnected || _state == EState::Connecting) return true;
+  bool res = true;
+  while (_outputSent < _outputLength) {
+    int len = send(_socket, _output + _outputSent, _outputLength - _outputSent, 0);
+    if (len < 0) res = errno == EAGAIN || errno == EWOULDBLOCK;
+    if (len <= 0) break;
+    _outputSent += len;
+    _lastOut = Host::uptimeMS32();
+  }
+  uint done = 0;
+  for (uint size; done < _outputSent && (size = packetSize(_output + done)) <= _outputSent - done; done += size) {
+  }
+  if (done != 0) {
+    _outputLength -= done;
+    _outputSent -= done;
+    memmove(_output, _output + done, _outputLength);
+#  if STFMQTT_VERSION == 5
+    _outputWritten += done;
+#  endif
+  }
+  return res;
+}
+
+bool MQTTClient::receive() {
+  uint8_t buffer[128];
+  for (;;) {
+    int res = recv(_socket, buffer, sizeof(buffer), 0);
+    if (res == 0) return false; // closed by the broker
+    if (res < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    for (uint len = res, idx = 0; idx < len;) {
+      if (_inputStage == 0) {
+        _inputHeader = buffer[idx++];
+        _inputRemaining = _inputLength = _inputShift = 0;
+        _inputStage = 1;
+      } else if (_inputStage == 1) {
+        uint8_t chr = buffer[idx++];
+        _inputRemaining |= (chr & 0x7f) << _inputShift;
+        _inputShift += 7;
+        if (chr & 0x80) {
+          if (_inputShift > 21) return false; // malformed
+          continue;
+        }
+        _inputStage = 2;
+      } else {
+        uint chunk = len - idx < _inputRemaining - _inputLength ? len - idx : _inputRemaining - _inputLength;
+        if (_inputLength < sizeof(_input)) memcpy(_input + _inputLength, buffer + idx, _inputLength + chunk <= sizeof(_input) ? chunk : sizeof(_input) - _inputLength);
+        _inputLength += chunk;
+        idx += chunk;
+      }
+      if (_inputStage == 2 && _inputLength == _inputRemaining) {
+        _inputStage = 0;
+        if (_inputLength <= sizeof(_input) && !handlePacket()) return false;
+        if (_state == EState::Disconnected) return true;
+      }
+    }
+  }
+}
+
+bool MQTTClient::handlePacket() {
+  switch (_inputHeader >> 4) {
+    case empConnAck:
+      if (_state != EState::WaitConnAck || _inputLength < 2 || _input[1] != 0) return false; // refused
+#  if STFMQTT_VERSION == 5
+      if (!parseConnAckProperties(_input + 2, _input + _inputLength)) return false;
+#  endif
+      _state = EState::Connected;
+      _stateTime = _lastOut = Host::uptimeMS32();
+      break;
+    case empPublish: {
+      uint8_t qos = (_inputHeader >> 1) & 3;
+      if (_inputLength < 2) return false;
+      uint topicLen = (_input[0] << 8) | _input[1];
+      uint pos = 2 + topicLen + (qos != 0 ? 2 : 0);
+      if (pos > _inputLength) return false;
+#  if STFMQTT_VERSION == 5
+      uint properties;
+      const uint8_t* payload = readVarInt(_input + pos, _input + _inputLength, properties);
+      if (payload == nullptr || payload + properties > _input + _inputLength) return false;
+      pos = payload + properties - _input;
+#  endif
+      if (qos == 1) {
+        uint8_t* ack = reserve(empPubAck << 4, 2);
+        if (ack != nullptr) memcpy(ack, _input + 2 + topicLen, 2);
+      }
+      // zero terminated topic in place of the length
+      memmove(_input, _input + 2, topicLen);
+      _input[topicLen] = 0;
+      if (_callback != nullptr) (*_callback)((char*)_input, _input + pos, _inputLength - pos);
+      break;
+    }
+    case empPubAck: {
+      if (_inputLength < 2) return false;
+      uint16_t packetId = (_input[0] << 8) | _input[1];
+      for (uint idx = 0; idx < _inflightCount; idx++) {
+        if (_inflight[idx].packetId != packetId) continue;
+        memmove(_inflight + idx, _inflight + idx + 1, (--_inflightCount - idx) * sizeof(Inflight));
+        _acked++;
+        break;
+      }
+      break;
+    }
+    case empPingResp:
+      _pingPending = false;
+      break;
+    default: // SUBACK, UNSUBACK
+      break;
+  }
+  return true;
+}
+
+uint8_t* MQTTClient::reserve(uint8_t header, uint remaining) {
+  uint lenBytes = remaining < 128 ? 1 : remaining < 16384 ? 2 : 3;
+  if (_outputLength + 1 + lenBytes + remaining > sizeof(_output)) return nullptr;
+  uint8_t* pos = _output + _outputLength;
+  *pos++ = header;
+  for (uint len = remaining;; len >>= 7) {
+    *pos++ = (len & 0x7f) | (len >= 128 ? 0x80 : 0);
+    if (len < 128) break;
+  }
+  _outputLength += 1 + lenBytes + remaining;
+  return pos;
+}
+
+uint16_t MQTTClient::nextPacketId() {
+  if (++_packetId == 0) _packetId = 1;
+  return _packetId;
+}
+
+// Header, remaining length and body of a complete packet in the output buffer
+uint MQTTClient::packetSize(const uint8_t* pos) {
+  uint remaining = 0, lenBytes = 0;
+  do
+    remaining |= (pos[1 + lenBytes] & 0x7f) << (7 * lenBytes);
+  while (pos[1 + lenBytes++] & 0x80);
+  return 1 + lenBytes + remaining;
+}
+
+uint8_t* MQTTClient::putString(uint8_t* pos, const char* str, uint len) {
+  pos = put16(pos, len);
+  memcpy(pos, str, len);
+  return pos + len;
+}
+
+#  if STFMQTT_VERSION == 5
+// LRU of the published topics, known: the broker has the alias already
+// An alias with packets still in _output isn't remapped, requeueOutput() looks up their topic by the alias
+uint16_t MQTTClient::getTopicAlias(const char* topic, uint len, bool& known) {
+  known = false;
+  uint count = _aliasMax < STFMQTT_TOPIC_ALIASES ? _aliasMax : STFMQTT_TOPIC_ALIASES;
+  if (count == 0 || len >= STFMQTT_TOPIC_ALIAS_SIZE) return 0;
+  uint32_t hash = Util::hash(topic, len);
+  uint lru = count;
+  for (uint idx = 0; idx < count; idx++) {
+    TopicAlias& alias = _aliases[idx];
+    if (alias.lastUse != 0 && alias.hash == hash && strcmp(alias.topic, topic) == 0) {
+      alias.lastUse = ++_aliasClock;
+      _aliasHits++;
+      known = true;
+      return idx + 1;
+    }
+    if ((int32_t)(alias.outputEnd - _outputWritten) <= 0 && (lru == count || alias.lastUse < _aliases[lru].lastUse)) lru = idx;
+  }
+  if (lru == count) return 0; // all of them are pending: full topic without alias
+  TopicAlias& alias = _aliases[lru]; // remapped by sending the topic with the alias
+  alias.hash = hash;
+  alias.lastUse = ++_aliasClock;
+  memcpy(alias.topic, topic, len + 1);
+  return lru + 1;
+}
+
+bool MQTTClient::parseConnAckProperties(const uint8_t* pos, const uint8_t* end) {
+  uint len;
+  if (pos == end) return true; // no properties at all
+  if ((pos = readVarInt(pos, end, len)) == nullptr || pos + len > end) return false;
+  for (end = pos + len; pos < end;) {
+    uint8_t id = *pos++;
+    uint size, value = 0;
+    if (id == 0x01 || id == 0x17 || id == 0x19 || id == 0x24 || id == 0x25 || (id >= 0x28 && id <= 0x2A))
+      size = 1;
+    else if (id == 0x13 || (id >= 0x21 && id <= 0x23))
+      size = 2;
+    else if (id == 0x02 || id == 0x11 || id == 0x18 || id == 0x27)
+      size = 4;
+    else if (id == 0x0B) {
+      if ((pos = readVarInt(pos, end, value)) == nullptr) return false;
+      size = 0;
+    } else if (id == 0x03 || id == 0x08 || id == 0x09 || id == 0x12 || id == 0x15 || id == 0x16 || id == 0x1A || id == 0x1C || id == 0x1F || id == 0x26) {
+      if (pos + 2 > end) return false;
+      size = 2 + ((pos[0] << 8) | pos[1]);
+      if (id == 0x26) { // user property: string pair
+        if (pos + size + 2 > end) return false;
+        size += 2 + ((pos[size] << 8) | pos[size + 1]);
+      }
+    } else {
+      return false; // unknown property
+    }
+    if (pos + size > end) return false;
+    for (uint idx = 0; idx < size && size <= 4; idx++) value = (value << 8) | pos[idx];
+    pos += size;
+
+    switch (id) {
+      case 0x13: // Server Keep Alive
+        if (value != 0) _keepAlive = value;
+        break;
+      case 0x21: // Receive Maximum
+        if (value < _window) _window = value;
+        break;
+      case 0x22: // Topic Alias Maximum
+        _aliasMax = value;
+        break;
+      case 0x24: // Maximum QoS
+        _maxQos = value;
+        break;
+      case 0x25: // Retain Available
+        _retainAvailable = value != 0;
+        break;
+    }
+  }
+  return true;
+}
+
+const uint8_t* MQTTClient::readVarInt(const uint8_t* pos, const uint8_t* end, uint& value) {
+  value = 0;
+  for (uint shift = 0; pos < end && shift <= 21; shift += 7) {
+    uint8_t chr = *pos++;
+    value |= (chr & 0x7f) << shift;
+    if ((chr & 0x80) == 0) return pos;
+  }
+  return nullptr;
+}
+#  endif
+
+} // namespace stf
+
+#endif
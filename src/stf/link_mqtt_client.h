@@ -0,0 +1,214 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <stf/os.h>
+
+// Encoded packets waiting for the socket, a publish fails when it's full
+#ifndef STFMQTT_OUTPUT_SIZE
+#  define STFMQTT_OUTPUT_SIZE 4096
+#endif
+
+// Max number of QoS1 publishes waiting for PUBACK
+#ifndef STFMQTT_WINDOW
+#  define STFMQTT_WINDOW 8
+#endif
+
+// QoS of the published messages (0 or 1)
+#ifndef STFMQTT_QOS
+#  define STFMQTT_QOS 0
+#endif
+
+// Keep alive in seconds, also the timeout of the connection, PINGRESP and PUBACK
+#ifndef STFMQTT_KEEPALIVE
+#  define STFMQTT_KEEPALIVE 15
+#endif
+
+// Protocol level: 4 - MQTT 3.1.1, 5 - MQTT 5 (topic aliases)
+#ifndef STFMQTT_VERSION
+#  define STFMQTT_VERSION 4
+#endif
+
+// MQTT 5: number of topic aliases kept (LRU), limited by the Topic Alias Maximum of the broker
+#ifndef STFMQTT_TOPIC_ALIASES
+#  define STFMQTT_TOPIC_ALIASES 16
+#endif
+
+// MQTT 5: longer topics are always sent in full
+#ifndef STFMQTT_TOPIC_ALIAS_SIZE
+#  define STFMQTT_TOPIC_ALIAS_SIZE 64
+#endif
+
+// Free room in the output buffer needed to render the next message of the consumer drain (a JSON message and its topic)
+#ifndef STFMQTT_MESSAGE_ROOM
+#  define STFMQTT_MESSAGE_ROOM (STFMQTT_JSONBUFFER_SIZE + 128)
+#endif
+
+#if STFMQTT == 1
+
+namespace stf {
+
+// The connection MQTTConsumer publishes through, MQTTClient over a socket on the device, a fake in the host harnesses
+class MQTTTransport {
+public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+  typedef void (*Requeue)(const char* topic, uint topicLen, const uint8_t* payload, uint length); // unsent publish at a connection loss
+
+  enum class EState : uint8_t {
+    Disconnected = 0,
+    Connecting = 1, // TCP
+    WaitConnAck = 2,
+    Connected = 3
+  };
+
+  virtual ~MQTTTransport() {}
+
+  virtual void setServer(const char* host, uint16_t port) = 0;
+  inline void setCallback(Callback callback) { _callback = callback; }
+  inline void setRequeue(Requeue requeue) { _requeue = requeue; }
+
+  // Starts the connection, the result is reported by loop()
+  virtual bool connect(const char* id, const char* user, const char* password, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage) = 0;
+  virtual void disconnect() = 0;
+  virtual EState loop() = 0;
+
+  inline EState getState() const { return _state; }
+  inline bool connected() const { return _state == EState::Connected; }
+  // size: topic + payload length
+  virtual bool canPublish(uint size, uint8_t qos) const = 0;
+  virtual bool isIdle() const = 0; // nothing to write, no publish waiting for PUBACK
+
+  virtual bool publish(const char* topic, const uint8_t* payload, uint len, bool retain, uint8_t qos = 0) = 0; // false: not connected or no room
+  inline bool publish(const char* topic, const char* payload, bool retain) { return publish(topic, (const uint8_t*)payload, strlen(payload), retain); }
+  virtual bool subscribe(const char* topic) = 0;
+  virtual bool unsubscribe(const char* topic) = 0;
+
+  uint32_t _requeued = 0; // non retained publishes not (completely) written at a connection loss, given back by _requeue
+  uint32_t _dropped = 0; // unacked QoS1 publishes and the unsent ones without _requeue
+
+protected:
+  Callback _callback = nullptr;
+  Requeue _requeue = nullptr;
+  EState _state = EState::Disconnected;
+};
+
+// Non-blocking MQTT 3.1.1 / 5 client over a BSD socket
+// The packets are encoded into the output buffer and written by loop() as far as the socket accepts them (partial writes),
+// so several publishes are pipelined; the incoming packets are parsed incrementally.
+// The host name resolution is still blocking (lwip caches it).
+class MQTTClient : public MQTTTransport {
+public:
+#  if STFMQTT_VERSION == 5
+  static constexpr uint PublishOverhead = 12; // header, remaining length, topic length, packet id, properties (topic alias)
+#  else
+  static constexpr uint PublishOverhead = 8; // header, remaining length, topic length, packet id
+#  endif
+
+  void setServer(const char* host, uint16_t port) override;
+
+  bool connect(const char* id, const char* user, const char* password, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage) override;
+  void disconnect() override;
+  EState loop() override;
+
+  inline bool canPublish(uint size, uint8_t qos) const override { return _outputLength + PublishOverhead + size <= sizeof(_output) && (qos == 0 || _inflightCount < _window); }
+  inline bool isIdle() const override { return _outputLength == 0 && _inflightCount == 0; }
+
+  using MQTTTransport::publish;
+  bool publish(const char* topic, const uint8_t* payload, uint len, bool retain, uint8_t qos = 0) override;
+  bool subscribe(const char* topic) override;
+  bool unsubscribe(const char* topic) override;
+
+  uint32_t _published = 0;
+  uint32_t _acked = 0;
+  uint32_t _aliasHits = 0;
+
+protected:
+  struct Inflight {
+    uint16_t packetId;
+    uint32_t time;
+  };
+
+  bool openSocket();
+  void closeSocket();
+  bool flush();
+  uint requeueOutput(); // returns the number of QoS1 publishes found
+  bool receive();
+  bool handlePacket();
+  uint8_t* reserve(uint8_t header, uint remaining); // nullptr: no room
+  uint16_t nextPacketId();
+
+  static uint8_t* putString(uint8_t* pos, const char* str, uint len);
+  static uint packetSize(const uint8_t* pos);
+#  if STFMQTT_VERSION == 5
+  bool parseConnAckProperties(const uint8_t* pos, const uint8_t* end);
+  uint16_t getTopicAlias(const char* topic, uint len, bool& known);
+  static const uint8_t* readVarInt(const uint8_t* pos, const uint8_t* end, uint& value);
+#  endif
+  static inline uint8_t* put16(uint8_t* pos, uint16_t value) {
+    pos[0] = value >> 8;
+    pos[1] = value;
+    return pos + 2;
+  }
+
+  const char* _host = nullptr;
+  uint16_t _port = 1883;
+  int _socket = -1;
+  uint32_t _stateTime = 0;
+  uint32_t _lastOut = 0;
+  uint32_t _pingTime = 0;
+  bool _pingPending = false;
+  uint16_t _packetId = 0;
+  uint16_t _keepAlive = STFMQTT_KEEPALIVE;
+  uint16_t _window = STFMQTT_WINDOW;
+  uint8_t _maxQos = 1;
+  bool _retainAvailable = true;
+
+  uint8_t _output[STFMQTT_OUTPUT_SIZE];
+  uint _outputLength = 0;
+  uint _outputSent = 0; // written bytes of the first packet(s), a packet is removed only when it's written completely
+
+  // Incoming packet: header, remaining length (7 bit groups), body (dropped if it doesn't fit)
+  uint8_t _input[STFMQTT_JSONBUFFER_SIZE];
+  uint _inputLength = 0;
+  uint _inputRemaining = 0;
+  uint8_t _inputHeader = 0;
+  uint8_t _inputStage = 0;
+  uint8_t _inputShift = 0;
+
+  Inflight _inflight[STFMQTT_WINDOW];
+  uint _inflightCount = 0;
+
+#  if STFMQTT_VERSION == 5
+  // Topic alias = index + 1, valid for the current connection only
+  struct TopicAlias {
+    uint32_t hash;
+    uint32_t lastUse; // 0 - unused
+    uint32_t outputEnd; // end of its last packet in _output, counted in _outputWritten: not remapped until it's written
+    char topic[STFMQTT_TOPIC_ALIAS_SIZE];
+  };
+  TopicAlias _aliases[STFMQTT_TOPIC_ALIASES];
+  uint16_t _aliasMax = 0; // Topic Alias Maximum of the broker
+  uint32_t _aliasClock = 0;
+  uint32_t _outputWritten = 0; // bytes of the packets removed from _output since connect
+#  endif
+};
+
+} // namespace stf
+
+#endif
@@ -0,0 +1,239 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stf/link_offline.h>
+
+#if STFMQTT_OFFLINE == 1
+
+#  if STFMQTT_OFFLINE_FLASH == 1
+#    include <SPIFFS.h>
+#  endif
+
+namespace stf {
+
+void OfflineQueue::setup() {
+#  if STFMQTT_OFFLINE_FLASH == 1
+  if (!SPIFFS.begin(true)) {
+    STFLOG_WARNING("Unable to mount SPIFFS, the offline messages are kept only in RAM.\n");
+    return;
+  }
+  File log = SPIFFS.open(_logName, "r");
+  if (!log) return;
+  uint8_t hdr[RecordHeaderSize];
+  _logSize = log.size();
+  if (log.read(hdr, 4) == 4) _logRead = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | (hdr[3] << 24);
+  // count the records left from the previous boot, a truncated one ends the log
+  uint32_t pos = _logRead;
+  uint count = 0;
+  while (pos >= 4 && pos < _logSize && log.seek(pos) && log.read(hdr, RecordHeaderSize) == RecordHeaderSize) {
+    uint32_t next = pos + RecordHeaderSize + (hdr[0] | (hdr[1] << 8));
+    if (next > _logSize) break;
+    pos = next;
+    count++;
+  }
+  log.close();
+  if (count != 0 && pos < _logSize && !cutLog(pos)) count = 0; // a record cut by the reboot at the end
+  if (count == 0) {
+    SPIFFS.remove(_logName);
+    _logRead = _logSize = 0;
+    return;
+  }
+  _logSize = _logBootEnd = pos;
+  _count += count;
+  STFLOG_INFO("%u offline message(s) found from the previous boot.\n", count);
+#  endif
+}
+
+bool OfflineQueue::push(const char* topic, const uint8_t* payload, uint payloadLength, uint32_t time) {
+  uint topicLength = strlen(topic) + 1;
+  uint len = topicLength + payloadLength;
+  uint total = RecordHeaderSize + len;
+  if (total > sizeof(_ring) || len > 0xffff) {
+    _dropped++;
+    return false;
+  }
+
+  uint free = sizeof(_ring) - _used;
+#  if STFMQTT_OFFLINE_FLASH == 1
+  if (free < total && spill(total - free)) free = sizeof(_ring) - _used;
+#  endif
+  while (free < total) { // drop the oldest ones
+    uint size = frontSize();
+    _head = (_head + size) % sizeof(_ring);
+    _used -= size;
+    free += size;
+    _ringCount--;
+    _count--;
+    _dropped++;
+  }
+
+  uint8_t hdr[RecordHeaderSize] = {(uint8_t)len, (uint8_t)(len >> 8), (uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), (uint8_t)(time >> 24)};
+  uint pos = (_head + _used) % sizeof(_ring);
+  writeRing(pos, hdr, RecordHeaderSize);
+  writeRing((pos + RecordHeaderSize) % sizeof(_ring), (const uint8_t*)topic, topicLength);
+  writeRing((pos + RecordHeaderSize + topicLength) % sizeof(_ring), payload, payloadLength);
+  _used += total;
+  _ringCount++;
+  _count++;
+  return true;
+}
+
+bool OfflineQueue::front(char* buffer, uint size, OfflineRecord& record) {
+  while (_count != 0) {
+    uint8_t hdr[RecordHeaderSize];
+    uint len;
+    record.previousBoot = false;
+#  if STFMQTT_OFFLINE_FLASH == 1
+    if (_logRead != 0) {
+      File log = SPIFFS.open(_logName, "r");
+      bool ok = log && log.seek(_logRead) && log.read(hdr, RecordHeaderSize) == RecordHeaderSize;
+      len = hdr[0] | (hdr[1] << 8);
+      ok = ok && (len > size || log.read((uint8_t*)buffer, len) == len);
+      log.close();
+      if (!ok) { // the rest of the log is lost
+        _dropped += _count - _ringCount;
+        _count = _ringCount;
+        SPIFFS.remove(_logName);
+        _logRead = _logSize = _logBootEnd = 0;
+        continue;
+      }
+      _logFrontSize = RecordHeaderSize + len;
+      record.previousBoot = _logRead < _logBootEnd;
+    } else
+#  endif
+    {
+      readRing(_head, hdr, RecordHeaderSize);
+      len = hdr[0] | (hdr[1] << 8);
+      if (len <= size) readRing((_head + RecordHeaderSize) % sizeof(_ring), (uint8_t*)buffer, len);
+    }
+    uint topicLength = len <= size ? strnlen(buffer, len) : len;
+    if (topicLength == len) { // doesn't fit or corrupted
+      pop();
+      _dropped++;
+      continue;
+    }
+    record.topic = buffer;
+    record.payload = (const uint8_t*)buffer + topicLength + 1;
+    record.payloadLength = len - topicLength - 1;
+    record.time = hdr[2] | (hdr[3] << 8) | (hdr[4] << 16) | (hdr[5] << 24);
+    return true;
+  }
+  return false;
+}
+
+void OfflineQueue::pop() {
+  if (_count == 0) return;
+  _count--;
+#  if STFMQTT_OFFLINE_FLASH == 1
+  if (_logRead != 0) {
+    _logRead += _logFrontSize;
+    if (_logRead >= _logSize) {
+      SPIFFS.remove(_logName);
+      _logRead = _logSize = _logBootEnd = 0;
+    } else if (++_logPops % 16 == 0) {
+      storeReadOffset(); // a reboot replays at most 16 messages again
+    }
+    return;
+  }
+#  endif
+  uint size = frontSize();
+  _head = (_head + size) % sizeof(_ring);
+  _used -= size;
+  _ringCount--;
+}
+
+uint OfflineQueue::frontSize() const {
+  uint8_t len[2];
+  readRing(_head, len, 2);
+  return RecordHeaderSize + (len[0] | (len[1] << 8));
+}
+
+void OfflineQueue::readRing(uint pos, uint8_t* data, uint len) const {
+  uint first = len < sizeof(_ring) - pos ? len : sizeof(_ring) - pos;
+  memcpy(data, _ring + pos, first);
+  memcpy(data + first, _ring, len - first);
+}
+
+void OfflineQueue::writeRing(uint pos, const uint8_t* data, uint len) {
+  uint first = len < sizeof(_ring) - pos ? len : sizeof(_ring) - pos;
+  memcpy(_ring + pos, data, first);
+  memcpy(_ring, data + first, len - first);
+}
+
+#  if STFMQTT_OFFLINE_FLASH == 1
+const char* OfflineQueue::_logName = "/offline.log";
+
+// Moves the oldest records of the ring to the end of the log, false: the log is full
+bool OfflineQueue::spill(uint needed) {
+  bool created = _logRead == 0;
+  File log = SPIFFS.open(_logName, created ? "w" : "a");
+  if (!log) return false;
+  if (created) {
+    const uint8_t hdr[4] = {4, 0, 0, 0};
+    if (log.write(hdr, 4) != 4) {
+      log.close();
+      return false;
+    }
+    _logRead = _logSize = 4;
+  }
+  uint freed = 0;
+  while (freed < needed && _ringCount != 0) {
+    uint size = frontSize();
+    if (_logSize + size > STFMQTT_OFFLINE_FLASH_SIZE) break;
+    uint first = size < sizeof(_ring) - _head ? size : sizeof(_ring) - _head;
+    if (log.write(_ring + _head, first) != first || log.write(_ring, size - first) != size - first) break;
+    _logSize += size;
+    _head = (_head + size) % sizeof(_ring);
+    _used -= size;
+    _ringCount--;
+    freed += size;
+  }
+  log.close();
+  return freed >= needed;
+}
+
+// Drops the end of the log after the complete records (the new ones are appended), false: failed, the log is lost
+bool OfflineQueue::cutLog(uint32_t end) {
+  static const char* tmpName = "/offline.tmp";
+  File src = SPIFFS.open(_logName, "r");
+  File dst = SPIFFS.open(tmpName, "w");
+  uint8_t chunk[128];
+  bool ok = src && dst;
+  for (uint32_t pos = 0; ok && pos < end; pos += sizeof(chunk)) {
+    uint len = end - pos < sizeof(chunk) ? end - pos : sizeof(chunk);
+    ok = src.read(chunk, len) == len && dst.write(chunk, len) == len;
+  }
+  src.close();
+  dst.close();
+  ok = ok && SPIFFS.remove(_logName) && SPIFFS.rename(tmpName, _logName);
+  if (!ok) SPIFFS.remove(tmpName);
+  return ok;
+}
+
+void OfflineQueue::storeReadOffset() {
+  File log = SPIFFS.open(_logName, "r+");
+  if (!log) return;
+  const uint8_t hdr[4] = {(uint8_t)_logRead, (uint8_t)(_logRead >> 8), (uint8_t)(_logRead >> 16), (uint8_t)(_logRead >> 24)};
+  log.write(hdr, 4);
+  log.close();
+}
+#  endif
+
+} // namespace stf
+
+#endif
@@ -0,0 +1,104 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <stf/os.h>
+
+// Store and forward: the non retained messages rendered while the broker is not reachable are kept and replayed after reconnect
+#ifndef STFMQTT_OFFLINE
+#  define STFMQTT_OFFLINE 0
+#endif
+
+// Size of the RAM ring of the queued messages, the oldest ones are dropped (or spilled to flash) when it's full
+#ifndef STFMQTT_OFFLINE_SIZE
+#  define STFMQTT_OFFLINE_SIZE 8192
+#endif
+
+// Spill the oldest messages into a SPIFFS log when the RAM ring is full, the log survives a reboot
+#ifndef STFMQTT_OFFLINE_FLASH
+#  define STFMQTT_OFFLINE_FLASH 0
+#endif
+
+// Size cap of the SPIFFS log in bytes
+#ifndef STFMQTT_OFFLINE_FLASH_SIZE
+#  define STFMQTT_OFFLINE_FLASH_SIZE 65536
+#endif
+
+// Replayed messages per second after reconnect
+#ifndef STFMQTT_OFFLINE_RATE
+#  define STFMQTT_OFFLINE_RATE 20
+#endif
+
+#if STFMQTT_OFFLINE == 1
+
+namespace stf {
+
+struct OfflineRecord {
+  const char* topic;
+  const uint8_t* payload;
+  uint payloadLength;
+  uint32_t time; // uptime ms when it was queued
+  bool previousBoot; // read back from the flash log written before the last reboot, the time is meaningless
+};
+
+// Record format (little endian): length(2: topic with the terminating zero + payload) time(4) topic payload
+// Single task access, the MQTT consumer both pushes and replays
+class OfflineQueue {
+public:
+  static constexpr uint RecordHeaderSize = 6;
+
+  void setup();
+
+  bool push(const char* topic, const uint8_t* payload, uint len, uint32_t time); // false: the message can't be stored
+  bool front(char* buffer, uint size, OfflineRecord& record); // copies the oldest message into the buffer
+  void pop(); // removes the message returned by front
+
+  inline bool isEmpty() const { return _count == 0; }
+
+  uint _count = 0;
+  uint _dropped = 0;
+
+protected:
+  void readRing(uint pos, uint8_t* data, uint len) const;
+  void writeRing(uint pos, const uint8_t* data, uint len);
+  uint frontSize() const;
+
+  uint8_t _ring[STFMQTT_OFFLINE_SIZE];
+  uint _head = 0;
+  uint _used = 0;
+  uint _ringCount = 0;
+
+#  if STFMQTT_OFFLINE_FLASH == 1
+  // Log file: readOffset(4) records
+  bool spill(uint needed);
+  bool cutLog(uint32_t end);
+  void storeReadOffset();
+
+  static const char* _logName;
+  uint32_t _logRead = 0; // 0 - there is no log
+  uint32_t _logSize = 0;
+  uint32_t _logBootEnd = 0; // records before this offset were written before the reboot
+  uint _logPops = 0;
+  uint _logFrontSize = 0;
+#  endif
+};
+
+} // namespace stf
+
+#endif
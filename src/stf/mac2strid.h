@@ -26,17 +26,34 @@ class Mac {
 public:
   static void toStrId(char* id, const uint8_t mac[8], uint macLen = 6);
   static void toMacId(char* id, const uint8_t mac[8], uint macLen = 6);
-  static void integrityCheck();
 
 protected:
-  struct MacMap {
+  enum EnumVendor : uint8_t {
+#define V(name, len) ev##name,
+#define M(vendor, b0, b1, b2, b3)
+#include <stf/mac_vendor.def>
+#undef V
+#undef M
+    evLocal
+  };
+
+  struct MacVendor {
     const char* name;
-    const uint8_t* mac4;
     uint8_t subIdLen;
   };
 
-  static uint32_t hash4(const uint8_t* mac4);
+  struct MacOUI {
+    uint8_t mac4[4];
+    EnumVendor vendor;
+  };
+
+  // djb2 over the 4 bytes: hash * 33 + c, the hash * 65599 + c variant had 3 collosions at Esp
+  static constexpr uint32_t hash4(const uint8_t* mac4) {
+    return ((mac4[0] * 33u + mac4[1]) * 33u + mac4[2]) * 33u + mac4[3];
+  }
+
   static void hash4Str(char* buffer, uint len, const uint8_t* mac4);
+  static const MacOUI* findOUI(const uint8_t* mac6);
 
   static inline bool cmp4(const uint8_t* mac4, const uint8_t* mac6) {
     if (mac4[0] != mac6[0] || mac4[1] != mac6[1] || mac4[2] != mac6[2]) return false;
@@ -44,12 +61,51 @@ protected:
     return true;
   }
 
-  static const MacMap _vendorList[];
+  static constexpr uint32_t oui(const uint8_t* mac) {
+    return ((uint32_t)mac[0] << 16) | ((uint32_t)mac[1] << 8) | mac[2];
+  }
+
+  static constexpr bool lessOUI(const uint8_t* mac4a, const uint8_t* mac4b) {
+    return oui(mac4a) < oui(mac4b) || (oui(mac4a) == oui(mac4b) && mac4a[3] < mac4b[3]);
+  }
+
+  // halving recursion keeps the depth low for the compile time check
+  template <uint N>
+  static constexpr bool isSorted(const MacOUI (&list)[N], uint from = 0, uint to = N) {
+    return to - from < 2    ? true
+           : to - from == 2 ? lessOUI(list[from].mac4, list[from + 1].mac4)
+                            : isSorted(list, from, (from + to) / 2 + 1) && isSorted(list, (from + to) / 2, to);
+  }
+
+  // hash4Str of len letters is the hash modulo 26^len
+  static constexpr uint32_t pow26(uint len) {
+    return len == 0 ? 1 : 26 * pow26(len - 1);
+  }
+
+  template <uint V>
+  static constexpr bool sameId(const MacVendor (&vendors)[V], const MacOUI& a, const MacOUI& b) {
+    return a.vendor == b.vendor && hash4(a.mac4) % pow26(vendors[a.vendor].subIdLen) == hash4(b.mac4) % pow26(vendors[a.vendor].subIdLen);
+  }
+
+  template <uint N, uint V>
+  static constexpr bool collides(const MacOUI (&list)[N], const MacVendor (&vendors)[V], uint idx, uint from, uint to) {
+    return to - from == 0   ? false
+           : to - from == 1 ? sameId(vendors, list[idx], list[from])
+                            : collides(list, vendors, idx, from, (from + to) / 2) || collides(list, vendors, idx, (from + to) / 2, to);
+  }
+
+  // every entry is compared with the later ones, the vendor id prefixes must be unique
+  template <uint N, uint V>
+  static constexpr bool hasCollision(const MacOUI (&list)[N], const MacVendor (&vendors)[V], uint from = 0, uint to = N) {
+    return to - from == 0   ? false
+           : to - from == 1 ? collides(list, vendors, from, from + 1, N)
+                            : hasCollision(list, vendors, from, (from + to) / 2) || hasCollision(list, vendors, (from + to) / 2, to);
+  }
 
+  static const MacVendor _vendorList[];
   static const uint8_t _macLocal[];
-  static const uint8_t _macEsp[];
-  static const uint8_t _macQing[];
-  static const uint8_t _macTelink[];
+  static const MacOUI _ouiList[];
+  static const uint _ouiListLen;
 };
 
 } // namespace stf
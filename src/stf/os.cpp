@@ -18,7 +18,6 @@
 
 #include <stf/os.h>
 #include <stf/data_field.h>
-#include <stf/mac2strid.h>
 
 #include <WiFi.h>
 
@@ -36,8 +35,6 @@ void Host::setup() {
   Serial.begin(115200);
   STFLOG_INFO("Starting ESP32... free memory %u (%u)\n", _startingFreeHeap, ESP.getHeapSize());
 
-  Mac::integrityCheck();
-
   esp_efuse_mac_get_default(_block.macBuffer);
   _block.create(nullptr, 6);
 
@@ -28,6 +28,9 @@
 namespace stf {
 
 Provider* Provider::_providerHead = nullptr;
+FeedbackRoute Provider::_routes[STF_FEEDBACK_ROUTES];
+uint8_t Provider::_routeCount = 0;
+uint8_t Provider::_routeHeads[edf__count];
 
 Provider::Provider(DataBuffer* buffer) : _parentBuffer(buffer){};
 
@@ -58,11 +61,98 @@ bool Provider::isConsumerReady() const {
   return cons != nullptr && cons->isReady();
 }
 
+bool Provider::isConsumerAccepting() const {
+  if (_parentBuffer == nullptr) return false;
+  Consumer* cons = _parentBuffer->getConsumer();
+  return cons != nullptr && cons->isAccepting();
+}
+
 uint Provider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type) {
   return 0;
 }
 
-void Provider::feedback(const FeedbackInfo& info) {
+void Provider::feedback(const FeedbackInfo& info, uint8_t route) {
+}
+
+bool Provider::addRoute(const DiscoveryBlock& block, bool* value, uint8_t id, const uint8_t* mac, uint macLen) {
+  if (!addRoute(block._field, id, mac, macLen)) return false;
+  _routes[_routeCount - 1].block = &block;
+  _routes[_routeCount - 1].value = value;
+  return true;
+}
+
+bool Provider::addRoute(EnumDataField field, uint8_t id, const uint8_t* mac, uint macLen) {
+  if (_routeCount >= STF_FEEDBACK_ROUTES) {
+    STFLOG_WARNING("Feedback route table is full (STF_FEEDBACK_ROUTES), %s is not routed.\n", DataField::_list[field]);
+    return false;
+  }
+  FeedbackRoute& route = _routes[_routeCount++];
+  route.provider = this;
+  route.block = nullptr;
+  route.value = nullptr;
+  route.mac = mac != nullptr ? mac : Host::_info.mac;
+  route.macLen = mac != nullptr ? macLen : Host::_info.macLen;
+  route.field = field;
+  route.id = id;
+  route.next = 0;
+  // appended, so the routes of a field are called in the registration order
+  uint8_t* link = &_routeHeads[field];
+  while (*link != 0) link = &_routes[*link - 1].next;
+  *link = _routeCount;
+
+  TaskRoot* task = _parentBuffer != nullptr ? _parentBuffer->getTask() : nullptr;
+  if (task != nullptr && task->_mailbox == nullptr) task->_mailbox = new CommandMailbox;
+  return true;
+}
+
+// Called from the MQTT callback: the matching commands are copied into the mailbox of the task owning the provider
+void Provider::routeFeedback(const FeedbackInfo& info) {
+  if (info.fieldEnum >= edf__count) return;
+  for (uint8_t idx = _routeHeads[info.fieldEnum]; idx != 0; idx = _routes[idx - 1].next) {
+    const FeedbackRoute& route = _routes[idx - 1];
+    if (route.macLen != info.macLen || memcmp(route.mac, info.mac, route.macLen) != 0) continue;
+
+    TaskRoot* task = route.provider->_parentBuffer != nullptr ? route.provider->_parentBuffer->getTask() : nullptr;
+    if (task == nullptr || task->_mailbox == nullptr) { // no owning task, handled right here
+      dispatchFeedback(info, route);
+      continue;
+    }
+    if (info.payloadLength > STF_COMMAND_PAYLOAD_SIZE) {
+      STFLOG_WARNING("Command payload is too long (STF_COMMAND_PAYLOAD_SIZE) for %s\n", DataField::_list[route.field]);
+      continue;
+    }
+    FeedbackCommand* command = task->_mailbox->reserve();
+    if (command == nullptr) {
+      STFLOG_WARNING("Command mailbox of %s is full (STF_COMMAND_QUEUE_SIZE), %s is dropped\n", task->_descriptorPtr->taskName, DataField::_list[route.field]);
+      continue;
+    }
+    command->route = idx - 1;
+    command->retained = info.retained;
+    command->payloadLength = info.payloadLength;
+    memcpy(command->payload, info.payload, info.payloadLength);
+    task->_mailbox->push();
+  }
+}
+
+// Called by the owning task before its providers' loop
+void Provider::applyFeedback(CommandMailbox& mailbox) {
+  for (FeedbackCommand* command; (command = mailbox.front()) != nullptr; mailbox.pop()) {
+    const FeedbackRoute& route = _routes[command->route];
+    FeedbackInfo info;
+    info.set(*command, route);
+    dispatchFeedback(info, route);
+  }
+}
+
+void Provider::dispatchFeedback(const FeedbackInfo& info, const FeedbackRoute& route) {
+  if (route.block == nullptr || route.provider->handleSimpleFeedback(info, *route.block, nullptr, 0, route.value)) route.provider->feedback(info, route.id);
+}
+
+const uint8_t* Provider::getRawMessage(uint& len, uint8_t& topic) {
+  return nullptr;
+}
+
+void Provider::releaseRawMessage() {
 }
 
 bool Provider::handleSimpleFeedback(const FeedbackInfo& info, const DiscoveryBlock& block, uint8_t* mac, uint macLen, bool* value) {
@@ -75,7 +165,7 @@ bool Provider::handleSimpleFeedback(const FeedbackInfo& info, const DiscoveryBlo
     }
     if (block._component == edcSwitch) {
       bool set = info.checkPayload("ON");
-      bool rrq = set != *value && strstr(info.topic, "/command/") != nullptr;
+      bool rrq = set != *value && !info.retained;
       STFLOG_INFO("%s command detected %u from %u - %*.*s%s\n", block.getName(), set, *value, info.payloadLength, info.payloadLength, info.payload, rrq ? " - report request" : "");
       if (set != *value) {
         *value = set;
@@ -89,6 +179,12 @@ bool Provider::handleSimpleFeedback(const FeedbackInfo& info, const DiscoveryBlo
 
 Consumer::Consumer() : _bufferHead(nullptr) {
   _messageCreated = _messageSent = 0;
+  _sliceStart = _sliceMessages = _drainMaxUS = 0;
+  _sliceCongested = false;
+}
+
+bool Consumer::isAccepting() {
+  return isReady();
 }
 
 uint32_t Consumer::ellapsedTimeSinceReady() {
@@ -109,9 +205,31 @@ bool Consumer::send(JsonBuffer& jsonBuffer, bool retain) {
   return false;
 }
 
+bool Consumer::sendRaw(uint8_t topic, const uint8_t* data, uint len) {
+  return false;
+}
+
+bool Consumer::isCongested(bool generator) {
+  return false;
+}
+
+// The message is kept by the provider till it's sent
+void Consumer::consumeRawMessages(DataBuffer* buffer) {
+  for (Provider* provider = Provider::getNext(nullptr, buffer); provider != nullptr; provider = Provider::getNext(provider, buffer)) {
+    uint len;
+    uint8_t topic;
+    const uint8_t* data = provider->getRawMessage(len, topic);
+    if (data == nullptr) continue;
+    bool res = sendRaw(topic, data, len);
+    STFLOG_INFO("Sending binary MQTT message (%s, %u bytes) %s.\n", DataType::_topicNames[topic], len, res ? "succeeded" : "failed");
+    if (res) provider->releaseRawMessage();
+  }
+}
+
 bool Consumer::onCloseMessageEvent(JsonBuffer& jsonBuffer, DataCache& cache) {
   jsonBuffer.finish();
   _messageCreated++;
+  _sliceMessages++;
   bool res = false;
   if (jsonBuffer.isValid()) {
     // res = false;
@@ -128,13 +246,78 @@ bool Consumer::onCloseMessageEvent(JsonBuffer& jsonBuffer, DataCache& cache) {
   return res;
 }
 
-void Consumer::consumeBuffers(JsonBuffer& jsonBuffer) {
-  for (DataBuffer* buffer = _bufferHead; buffer != nullptr; buffer = getNextBuffer(buffer)) {
-    consumeBuffer(jsonBuffer, buffer);
+// Runs on the consumer's task together with the connection handling, so one call is limited by the budget
+bool Consumer::consumeBuffers(JsonBuffer& jsonBuffer) {
+  if (_bufferHead == nullptr) return false;
+  _sliceStart = micros();
+  _sliceMessages = 0;
+  _sliceCongested = false;
+
+  // Strict priority between the lanes (system messages first), weighted round-robin inside a lane
+  for (int priority = nextPriority(256); priority >= 0 && hasBudget(); priority = nextPriority(priority))
+    consumeLane(jsonBuffer, (uint8_t)priority);
+  for (DataBuffer* buffer = _bufferHead; buffer != nullptr; buffer = getNextBuffer(buffer))
+    consumeRawMessages(buffer);
+
+  bool pending = false;
+  for (DataBuffer* db = _bufferHead; db != nullptr && !pending; db = getNextBuffer(db)) pending = db->hasClosedMessage();
+
+  if (_sliceMessages > 0) {
+    uint32_t took = micros() - _sliceStart;
+    STFLOG_DEBUG("Consumer drain - %u messages in %u us%s\n", _sliceMessages, took, _sliceCongested ? ", congested" : pending ? ", budget reached" : "");
+    if (took > _drainMaxUS) {
+      _drainMaxUS = took;
+      STFLOG_INFO("Consumer drain - new maximum %u us (%u messages)\n", took, _sliceMessages);
+    }
   }
+  return pending;
 }
 
-int Consumer::consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer) {
+// Deficit round-robin: every buffer sends up to its weight in a round, the credits are kept between the calls
+void Consumer::consumeLane(JsonBuffer& jsonBuffer, uint8_t priority) {
+  for (bool pending = true; pending && hasBudget();) {
+    bool refill = true;
+    for (DataBuffer* buffer = _bufferHead; buffer != nullptr && refill; buffer = getNextBuffer(buffer))
+      refill = buffer->_priority != priority || buffer->_credit == 0 || !buffer->hasClosedMessage();
+    if (refill) // new round
+      for (DataBuffer* buffer = _bufferHead; buffer != nullptr; buffer = getNextBuffer(buffer))
+        if (buffer->_priority == priority) buffer->_credit = buffer->_weight;
+    pending = false;
+    for (DataBuffer* buffer = _bufferHead; buffer != nullptr && hasBudget(); buffer = getNextBuffer(buffer)) {
+      if (buffer->_priority != priority) continue;
+      if (!buffer->hasClosedMessage()) {
+        buffer->_credit = 0; // an idle buffer doesn't collect credits
+        continue;
+      }
+      if (buffer->_credit == 0) {
+        pending = true;
+        continue;
+      }
+      uint sent = _sliceMessages;
+      consumeBuffer(jsonBuffer, buffer, buffer->_credit);
+      sent = _sliceMessages - sent;
+      buffer->_credit = sent < buffer->_credit ? buffer->_credit - sent : 0;
+      pending = pending || buffer->hasClosedMessage();
+    }
+  }
+}
+
+// The highest lane priority below the given one, -1 if none
+int Consumer::nextPriority(int below) const {
+  int res = -1;
+  for (DataBuffer* buffer = _bufferHead; buffer != nullptr; buffer = buffer->_consumerBufferNext)
+    if (buffer->_priority < below && buffer->_priority > res) res = buffer->_priority;
+  return res;
+}
+
+bool Consumer::hasBudget() const {
+  if (_sliceCongested) return false;
+  if (STF_CONSUME_MAX_MESSAGES != 0 && _sliceMessages >= STF_CONSUME_MAX_MESSAGES) return false;
+  return STF_CONSUME_MAX_US == 0 || micros() - _sliceStart < STF_CONSUME_MAX_US;
+}
+
+// maxMessages: 0 - till the budget allows
+int Consumer::consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer, uint maxMessages) {
   _messageSent = _messageCreated = 0;
   if (!buffer->hasClosedMessage()) return 0;
 
@@ -142,6 +325,8 @@ int Consumer::consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer) {
   jsonBuffer.start();
   cache.forceReset();
   do {
+    // Checked before the message is read, so it stays in the buffer
+    if ((_sliceCongested = isCongested(buffer->hasGeneratorMessage()))) break;
     bool end = false;
     while (!end) {
       DataBlock& block = buffer->getReadBlock();
@@ -155,17 +340,10 @@ int Consumer::consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer) {
       end = block.isClosedMessage();
       buffer->IncrementReadIndex();
     }
-  } while (buffer->hasClosedMessage());
+  } while (buffer->hasClosedMessage() && hasBudget() && (maxMessages == 0 || _messageCreated < maxMessages));
   return _messageSent;
 }
 
-void Consumer::broadcastFeedback(const FeedbackInfo& info) {
-  for (DataBuffer* buffer = _bufferHead; buffer != nullptr; buffer = buffer->_consumerBufferNext) {
-    for (Provider* provider = Provider::getNext(nullptr, buffer); provider != nullptr; provider = Provider::getNext(provider, buffer))
-      provider->feedback(info);
-  }
-}
-
 void FeedbackInfo::set(const char* topicInput, const uint8_t* payloadInput, unsigned int payloadLengthInput) {
   topic = topicInput;
   fullPayload = payload = payloadInput;
@@ -187,6 +365,7 @@ void FeedbackInfo::set(const char* topicInput, const uint8_t* payloadInput, unsi
     fieldStrLen = 0;
     fieldEnum = EnumDataField::edf__none;
     payloadLength = 0;
+    json.start((const char*)payload, fullPayloadLength);
   } else if ((fndB = strstr(topic, "/MQTTto")) != nullptr && (fndE = strchr(fndB + 1, '/')) != nullptr) {
     // Received MQTT message (home/SimpleThing_Test/MQTTtoSYSR/EspDJ_AABBCC/command/AC67B2AABBCC_ota) [SYSR|AC67B2AABBCC|ota][1|19] - ON
     topicStr = fndB + 7;
@@ -197,8 +376,7 @@ void FeedbackInfo::set(const char* topicInput, const uint8_t* payloadInput, unsi
     fieldStrLen = strlen(fieldStr);
     idStrLen = fieldStr != nullptr ? fndB - idStr : 0;
     generateMAC();
-    int idx = Util::getArrayIndex(fieldStr, fieldStrLen, DataField::_list, DataField::_listNum);
-    fieldEnum = (EnumDataField)(idx >= 0 ? idx : 0);
+    fieldEnum = DataField::find(fieldStr, fieldStrLen);
   } else {
     topicStr = idStr = fieldStr = "";
     topicStrLen = idStrLen = fieldStrLen = 0;
@@ -208,47 +386,38 @@ void FeedbackInfo::set(const char* topicInput, const uint8_t* payloadInput, unsi
   }
 }
 
+void FeedbackInfo::set(const FeedbackCommand& command, const FeedbackRoute& route) {
+  topic = topicStr = idStr = "";
+  topicStrLen = idStrLen = 0;
+  topicEnum = EnumTypeInfoTopic::etitNONE;
+  fullPayload = payload = (const uint8_t*)command.payload;
+  fullPayloadLength = payloadLength = command.payloadLength;
+  retained = command.retained;
+  fieldEnum = (EnumDataField)route.field;
+  fieldStr = DataField::_list[fieldEnum];
+  fieldStrLen = strlen(fieldStr);
+  memcpy(mac, route.mac, macLen = route.macLen);
+}
+
 bool FeedbackInfo::next() {
   if (!retained) return false;
 
-  const char *fndB, *fndE;
-  const char* str = (const char*)payload + payloadLength;
-  if (*str == '"') str++;
-
   fieldStr = "";
+  fieldStrLen = 0;
+  fieldEnum = EnumDataField::edf__none;
   payload = fullPayload + fullPayloadLength;
-  fieldStrLen = payloadLength = 0;
-
-  const char* pe = (const char*)payload;
-
-  fndB = Util::strchr(str, pe, '"');
-  if (fndB == nullptr) return false;
-  fndE = Util::strchr(fndB + 1, pe, '"');
-  if (fndE == nullptr) return false;
-
-  fieldStr = fndB + 1;
-  fieldStrLen = fndE - fieldStr;
-  int idx = Util::getArrayIndex(fieldStr, fieldStrLen, DataField::_list, DataField::_listNum);
-  fieldEnum = (EnumDataField)(idx >= 0 ? idx : 0);
-
-  fndB = Util::strchr(fndE, pe, ':');
-  if (fndB == nullptr) return false;
-  while (++fndB < pe && isspace(*fndB))
-    ;
-  if (fndB == pe || *fndB == '{' || *fndB == '[') return false; // not supported
-  if (*fndB != '"') { // Easy case
-    if ((fndE = Util::stranychr(fndB, pe, ",}")) == nullptr) return false;
-    while (fndB < fndE && isspace(fndE[-1])) fndE--;
-    payload = (const uint8_t*)fndB;
-    payloadLength = fndE - fndB;
-    return true;
-  }
-  for (fndE = ++fndB;;) {
-    if ((fndE = Util::strchr(fndE, pe, '"')) == nullptr) return false;
-    if (fndE[-1] != '\'') break;
+  payloadLength = 0;
+
+  if (!json.next()) {
+    if (json.isFailed()) STFLOG_WARNING("Invalid retained state JSON %s\n", topic);
+    return false;
   }
-  payload = (const uint8_t*)fndB;
-  payloadLength = fndE - fndB;
+
+  fieldStr = json._key;
+  fieldStrLen = json._keyLen;
+  fieldEnum = DataField::find(fieldStr, fieldStrLen);
+  payload = (const uint8_t*)json._value;
+  payloadLength = json._valueLen;
   return true;
 }
 
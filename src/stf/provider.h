@@ -19,14 +19,41 @@
 #pragma once
 
 #include <stf/data_buffer.h>
+#include <stf/json_tokenizer.h>
 #include <stf/task.h>
+#include <stf/util.h>
+
+// Max number of the incoming command routes (see Provider::addRoute)
+#ifndef STF_FEEDBACK_ROUTES
+#  define STF_FEEDBACK_ROUTES 24
+#endif
+
+// Commands waiting per task for the owning provider (power of 2), longer payloads are dropped
+#ifndef STF_COMMAND_QUEUE_SIZE
+#  define STF_COMMAND_QUEUE_SIZE 16
+#endif
+#ifndef STF_COMMAND_PAYLOAD_SIZE
+#  define STF_COMMAND_PAYLOAD_SIZE 24
+#endif
+
+// Budget of one Consumer::consumeBuffers call, the rest is continued in the next loop (0 - no limit)
+#ifndef STF_CONSUME_MAX_MESSAGES
+#  define STF_CONSUME_MAX_MESSAGES 8
+#endif
+#ifndef STF_CONSUME_MAX_US
+#  define STF_CONSUME_MAX_US 20000
+#endif
 
 namespace stf {
 
 class JsonBuffer;
 
+struct FeedbackRoute;
+struct FeedbackCommand;
+
 struct FeedbackInfo {
   void set(const char* topic, const uint8_t* payload, unsigned int length);
+  void set(const FeedbackCommand& command, const FeedbackRoute& route);
   bool next();
 
   bool checkPayload(const char* str) const;
@@ -50,6 +77,7 @@ struct FeedbackInfo {
   uint fieldStrLen;
 
   bool retained;
+  JsonTokenizer json; // members of the retained state
 
   EnumTypeInfoTopic topicEnum;
   EnumDataField fieldEnum;
@@ -66,6 +94,33 @@ enum class ESystemMessageType : uint8_t {
 };
 
 class DiscoveryBlock;
+class Provider;
+
+// Incoming commands are routed by (field, MAC) to the registered provider
+struct FeedbackRoute {
+  Provider* provider;
+  const DiscoveryBlock* block; // switch or button handled by handleSimpleFeedback, nullptr - the field is enough
+  bool* value;
+  const uint8_t* mac;
+  uint8_t macLen;
+  uint8_t field; // EnumDataField
+  uint8_t id; // passed back to Provider::feedback
+  uint8_t next; // next route of the same field (index + 1)
+};
+
+// Copy of a routed command, the MQTT buffer is reused as soon as the callback returns
+struct FeedbackCommand {
+  uint8_t route; // index in Provider::_routes
+  bool retained;
+  uint8_t payloadLength;
+  char payload[STF_COMMAND_PAYLOAD_SIZE];
+};
+
+static_assert(STF_COMMAND_PAYLOAD_SIZE < 256, "STF_COMMAND_PAYLOAD_SIZE should fit in FeedbackCommand::payloadLength");
+
+// Filled by the MQTT callback (single producer), emptied by the task owning the providers
+class CommandMailbox : public LockFreeQueue<FeedbackCommand, STF_COMMAND_QUEUE_SIZE> {
+};
 
 // The provider feeds data into the buffer
 // Since the buffer is a lockless queue all provider for the same buffer must run on the same task
@@ -80,18 +135,34 @@ public:
   virtual void setup();
   virtual uint loop() = 0;
   virtual uint systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type);
-  virtual void feedback(const FeedbackInfo& info);
+  virtual void feedback(const FeedbackInfo& info, uint8_t route); // always for field routes, on change for switch / button routes
+
+  // Binary messages bypassing the data buffer, called from the consumer's task; nullptr - nothing to send
+  virtual const uint8_t* getRawMessage(uint& len, uint8_t& topic);
+  virtual void releaseRawMessage();
 
   bool isConsumerReady() const;
+  bool isConsumerAccepting() const;
 
   static Provider* getNext(Provider* provider, DataBuffer* parentBuffer);
+  static void routeFeedback(const FeedbackInfo& info);
+  static void applyFeedback(CommandMailbox& mailbox);
 
 protected:
   bool handleSimpleFeedback(const FeedbackInfo& info, const DiscoveryBlock& block, uint8_t* mac, uint macLen, bool* value);
 
+  // Called at setup, mac: nullptr - the host
+  bool addRoute(const DiscoveryBlock& block, bool* value, uint8_t id = 0, const uint8_t* mac = nullptr, uint macLen = 0);
+  bool addRoute(EnumDataField field, uint8_t id, const uint8_t* mac = nullptr, uint macLen = 0);
+
+  static void dispatchFeedback(const FeedbackInfo& info, const FeedbackRoute& route);
+
   DataBuffer* _parentBuffer;
 
   static Provider* _providerHead;
+  static FeedbackRoute _routes[STF_FEEDBACK_ROUTES];
+  static uint8_t _routeCount;
+  static uint8_t _routeHeads[edf__count];
 
   friend class DataBuffer;
   friend class Consumer;
@@ -106,6 +177,7 @@ public:
   Consumer();
 
   virtual bool isReady() = 0;
+  virtual bool isAccepting(); // messages are accepted (queued) even if it's not ready
   virtual uint32_t ellapsedTimeSinceReady();
 
   void addBuffer(DataBuffer* buffer);
@@ -114,16 +186,25 @@ public:
   virtual bool onCloseMessageEvent(JsonBuffer& jsonBuffer, DataCache& cache);
 
 protected:
-  virtual void consumeBuffers(JsonBuffer& jsonBuffer);
-  int consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer);
+  virtual bool consumeBuffers(JsonBuffer& jsonBuffer); // true - the budget ran out, messages are still waiting
+  int consumeBuffer(JsonBuffer& jsonBuffer, DataBuffer* buffer, uint maxMessages = 0);
+  void consumeLane(JsonBuffer& jsonBuffer, uint8_t priority);
+  int nextPriority(int below) const;
+  bool hasBudget() const;
   virtual bool send(JsonBuffer& jsonBuffer, bool retain);
-
-  void broadcastFeedback(const FeedbackInfo& info);
+  virtual bool sendRaw(uint8_t topic, const uint8_t* data, uint len);
+  virtual bool isCongested(bool generator); // no room to send the next message (all the messages of a generator block), the drain stops
+  void consumeRawMessages(DataBuffer* buffer);
 
   DataBuffer* _bufferHead;
   ElapsedTime _readyTime;
   uint _messageCreated;
   uint _messageSent;
+
+  uint32_t _sliceStart; // micros() at the start of consumeBuffers
+  uint _sliceMessages;
+  bool _sliceCongested;
+  uint32_t _drainMaxUS;
 };
 
 } // namespace stf
@@ -22,9 +22,12 @@
 #include <stf/data_feeder.h>
 #include <stf/data_cache.h>
 #include <stf/bt_device.h>
+#include <stf/provider_system.h>
 #include <stf/util.h>
 
 #include <NimBLEDevice.h>
+#include <Preferences.h>
+#include <endian.h>
 #include <unordered_set>
 
 namespace stf {
@@ -33,100 +36,179 @@ DEFINE_PROVIDERTASK(BTProvider, 4, 0, 0);
 
 BTDeviceGroup BTProvider::_discoveryList;
 
-BTProvider::BTProvider() : Provider(g_bufferBTProvider) {
-}
-
-// Coefficients from android-beacon-library
-double BTProvider::beaconDistance(int rssi, int txPower) {
-  if (txPower >= 0)
-    txPower = -59;
-  double ratio = rssi * 1.0 / txPower;
-  double distance;
-  if (ratio < 1.0) {
-    distance = pow(ratio, 10);
-  } else {
-    distance = (0.42093) * pow(ratio, 6.9476) + 0.54992;
-  }
-  return distance;
+BTProvider::BTProvider() : Provider(g_bufferBTProvider), _unknownCache(STFBT_UNKNOWN_CACHE_TIMEOUT), _dedupCache(STFBT_DEDUP_WINDOW) {
 }
 
 void BTProvider::generateBTBlocks(DataFeeder& feeder, const DataBlock& generatorBlock, DataCache& cache) {
   feeder.nextToWrite(edf_id, edt_Raw, etirFormatHexUpper + etirSeparatorColon + 6).setRaw(cache._device.info.mac, cache._device.info.macLen);
 
   int8_t txpw = (int8_t)generatorBlock._extra;
-  int8_t rssi = (int8_t)generatorBlock._typeInfo;
+  int8_t rssi = (int8_t)generatorBlock._typeInfo; // smoothed and rounded
   if (txpw != 127) feeder.nextToWrite(edf_txpower, edt_32, 1).set32(txpw);
   if (rssi != 127) {
     feeder.nextToWrite(edf_rssi, edt_32, 1).set32(rssi);
-    feeder.nextToWrite(edf_distance, edt_Float, 2).setFloat(beaconDistance(rssi, txpw));
+    feeder.nextToWrite(edf_distance, edt_Float, 2).setFloat(BTDistance::distance((int16_t)generatorBlock._value.t16[3] / 16.f, txpw));
   }
 
   feeder.nextToWrite(edf_bt_adv_type, edt_32, 1).set32(generatorBlock._value.t8[4]);
   feeder.nextToWrite(edf_bt_addr_type, edt_32, 1).set32(generatorBlock._value.t8[5]);
 }
 
+// Updates the live state of the device from the forwarded packet, blocks: the number of blocks written by the resolver
+BTDevice* BTProvider::updateDevice(const BTPacket& packet, DataBuffer* buffer, uint blocks, int8_t txPower, uint8_t decoder) {
+  BTDevice* dev = _discoveryList.findOrCreateDevice(packet._mac);
+  if (dev == nullptr) return nullptr;
+  if (dev->_packetCount != 0xffff) dev->_packetCount++;
+  dev->updateRSSI(packet._rssi);
+  if (txPower != 127) dev->_txPower = txPower;
+  if (decoder != 0) dev->_decoder = decoder;
+  for (uint idx = 0; idx < blocks; idx++) {
+    const DataBlock& block = buffer->getWrittenBlock(idx);
+    if (block._field < edf_batt || block.isClosedMessage()) continue; // internal fields and discovery messages
+    if (block._type != edt_Float && block._type != edt_32) continue;
+    uint8_t typeInfo = block._typeInfo & ~etiDoubleField;
+    dev->setValue(block._field, block._type, typeInfo, block._value.t32[0]);
+    if ((block._typeInfo & etiDoubleField) != 0) dev->setValue((EnumDataField)block._extra, block._type, typeInfo, block._value.t32[1]);
+  }
+  return dev;
+}
+
+// Runs on the NimBLE host task: only copies the advertisement into the queue, everything else is done in BTProvider::loop
 class BTProviderDeviceCallbacks : public NimBLEAdvertisedDeviceCallbacks {
   void onResult(NimBLEAdvertisedDevice* bleDevice) {
-    STFLED_COMMAND(STFLEDEVENT_BLE_RECEIVE);
-
-    BTProvider::_discoveryList.updateDevices();
-    g_BTProviderObj._packetsScanned++;
+    g_BTProviderObj._packetsScanned.increment();
 
+    BTRawPacket* raw = g_BTProviderObj._queue.reserve();
+    size_t payloadLength = bleDevice->getPayloadLength();
+    if (raw == nullptr || payloadLength > sizeof(raw->payload)) {
+      g_BTProviderObj._packetsDropped.increment();
+      return;
+    }
     NimBLEAddress addr = bleDevice->getAddress();
-    BTPacket packet(bleDevice->getAdvType(), addr.getType(), addr.getNative(), bleDevice->getPayload(), bleDevice->getPayloadLength(), bleDevice->haveRSSI() ? bleDevice->getRSSI() : 127);
+    raw->time = Host::uptimeMS32();
+    memcpy(raw->mac, addr.getNative(), 6);
+    raw->macType = addr.getType();
+    raw->advType = bleDevice->getAdvType();
+    int rssi = bleDevice->haveRSSI() ? bleDevice->getRSSI() : 127;
+    raw->rssi = rssi < -128 ? -128 : (rssi > 127 ? 127 : (int8_t)rssi);
+    raw->payloadLength = payloadLength;
+    memcpy(raw->payload, bleDevice->getPayload(), payloadLength);
+    g_BTProviderObj._queue.push();
+  }
+} g_bleCallback;
 
-    // For test - filter
-    DataBuffer* resolveBuffer = g_bufferBTProvider;
+void BTProvider::processPacket(BTPacket& packet) {
+  STFLED_COMMAND(STFLEDEVENT_BLE_RECEIVE);
+
+  // For test - filter
+  DataBuffer* resolveBuffer = g_bufferBTProvider;
 #ifdef STFBLE_TEST_MAC
-    if (packet._mac[5] != (STFBLE_TEST_MAC)) resolveBuffer = nullptr;
+  if (packet._mac[5] != (STFBLE_TEST_MAC)) resolveBuffer = nullptr;
 #endif
 #ifdef STFBLE_TEST_XOR
-    // Not perfect as service data may contain the mac and we don't change that
-    packet._mac[5] ^= STFBLE_TEST_XOR;
+  // Not perfect as service data may contain the mac and we don't change that
+  packet._mac[5] ^= STFBLE_TEST_XOR;
 #endif
 
-    int statFreeBlocksBegin = g_bufferBTProvider->getFreeBlocks();
-    EnumBTResult res = BTResolver::resolve(resolveBuffer, packet);
-    if (res == EnumBTResult::Resolved && resolveBuffer == nullptr) res = EnumBTResult::Disabled;
+  // Repeated advertisements only refresh the RSSI
+  uint32_t now = Host::uptimeMS32(), hash = packet.getHash();
+  if (_dedupCache.contains(hash, now)) {
+    BTDevice* dev = _discoveryList.findDevice(packet._mac);
+    if (dev != nullptr) dev->updateRSSI(packet._rssi);
+    return;
+  }
+
+  // Known unknowns are dropped without logging or resolving, till the cache entry expires
+  uint32_t signature = 0;
+  if (_packetsFilterUnknown && resolveBuffer != nullptr) {
+    signature = packet.getSignature();
+    if (_unknownCache.contains(signature, now)) return;
+  }
 
-    static const char* resMsg[] = {"(Resolved)", "(Unknown) ", "(NoBuffer)", "(Disabled)", "(InvalidR)"};
-    packet.log(resMsg[res >= EnumBTResult::Resolved && res <= EnumBTResult::Disabled ? (int)res : 1]);
-    if (res == EnumBTResult::Disabled) return;
+  uint writeBegin = g_bufferBTProvider->getWritePosition(); // the consumer may read meanwhile, so the free blocks can't be used for counting
+  uint8_t decoder;
+  EnumBTResult res = BTResolver::resolve(resolveBuffer, packet, &decoder);
+  if (res == EnumBTResult::Resolved && resolveBuffer == nullptr) res = EnumBTResult::Disabled;
+  if (res == EnumBTResult::Unknown && decoder == 0 && signature != 0) _unknownCache.insert(signature, now);
+  if (res != EnumBTResult::SmallBuffer) _dedupCache.insert(hash, now); // otherwise the next copy might fit
+
+  static const char* resMsg[] = {"(Resolved)", "(Unknown) ", "(NoBuffer)", "(Disabled)", "(InvalidR)"};
+  packet.log(resMsg[res >= EnumBTResult::Resolved && res <= EnumBTResult::Disabled ? (int)res : 1]);
+  if (res == EnumBTResult::Disabled) return;
+
+  uint freeBlocks = g_bufferBTProvider->getFreeBlocks();
+  if (!_packetsFilterUnknown && res == EnumBTResult::Unknown && freeBlocks >= 1) {
+    g_bufferBTProvider->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(packet._mac);
+    res = EnumBTResult::Resolved;
+    decoder = 0;
+    freeBlocks--;
+  }
 
-    uint freeBlocks = g_bufferBTProvider->getFreeBlocks();
-    if (!g_BTProviderObj._packetsFilterUnknown && res == EnumBTResult::Unknown && freeBlocks >= 1) {
-      g_bufferBTProvider->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(packet._mac);
-      res = EnumBTResult::Resolved;
+  if (res == EnumBTResult::Resolved) { // Finish the buffer
+    uint len;
+    const uint8_t* field = packet.getField(0x0a, len); // TXPower
+    int8_t txpw = len == 1 ? field[0] : 127;
+    BTDevice* dev = updateDevice(packet, g_bufferBTProvider, g_bufferBTProvider->getWrittenSince(writeBegin), txpw, decoder);
+    if (freeBlocks >= 1) { // Generator function for extra elements
+      DataBlock& genBlock = g_bufferBTProvider->nextToWrite(edf__none, edt_Generator, dev != nullptr ? dev->getRSSI8() : packet._rssi).setPtr((const void*)&generateBTBlocks);
+      genBlock._extra = dev != nullptr ? dev->_txPower : txpw; // the last known tx power
+      genBlock._value.t8[4] = packet._advType;
+      genBlock._value.t8[5] = packet._macType;
+      genBlock._value.t16[3] = dev != nullptr ? dev->_rssi16 : packet._rssi * 16;
       freeBlocks--;
     }
+    addPayloadBlocks(packet, freeBlocks, decoder != 0);
+    g_bufferBTProvider->closeMessage();
+    _packetsForwarded.increment();
+    _scanControlForwarded++;
+    STFLOG_INFO("Total blocks used for the BT messages: %u\n", g_bufferBTProvider->getWrittenSince(writeBegin));
+  }
+}
 
-    if (res == EnumBTResult::Resolved) { // Finish the buffer
-      if (freeBlocks >= 1) { // Generator function for extra elements
-        uint len;
-        const uint8_t* field = packet.getField(0x0a, len); // TXPower
-        int8_t txpw = len == 1 ? field[0] : 127;
-        DataBlock& genBlock = g_bufferBTProvider->nextToWrite(edf__none, edt_Generator, packet._rssi).setPtr((const void*)&BTProvider::generateBTBlocks);
-        genBlock._extra = txpw;
-        genBlock._value.t8[4] = packet._advType;
-        genBlock._value.t8[5] = packet._macType;
-        freeBlocks--;
-      }
-      if (freeBlocks >= 1 && freeBlocks >= (packet._payloadLength + 8) / 9) {
-        EnumDataField fld = edf_bt_payload;
-        uint len = packet._payloadLength;
-        const uint8_t* buff = packet._payloadBuffer;
-        for (uint cpy; len > 0 || fld == edf_bt_payload; buff += cpy, len -= cpy, fld = edf__cont) {
-          cpy = len > sizeof(DataBlock::_value) + sizeof(DataBlock::_extra) ? sizeof(DataBlock::_value) + sizeof(DataBlock::_extra) : len;
-          g_bufferBTProvider->nextToWrite(fld, edt_Raw, cpy + etirFormatHexLower).setRaw(buff, cpy);
-        }
-      }
-      int statFreeBlocksEnd = g_bufferBTProvider->getFreeBlocks();
-      g_bufferBTProvider->closeMessage();
-      g_BTProviderObj._packetsForwarded++;
-      STFLOG_INFO("Total blocks used for the BT messages: %u\n", statFreeBlocksBegin - statFreeBlocksEnd); // not correct, will need fix
-    }
+// Gives back the number of blocks written, nothing is written if it doesn't fit
+uint BTProvider::addPayloadBlocks(const BTPacket& packet, uint freeBlocks, bool decoded) {
+  EnumBTPayloadMode mode = _payloadMode;
+  if (mode == EnumBTPayloadMode::UnknownOnly) mode = decoded ? EnumBTPayloadMode::Omit : EnumBTPayloadMode::Hex;
+  if (mode == EnumBTPayloadMode::Omit || freeBlocks < 1) return 0;
+  if (mode == EnumBTPayloadMode::Hash) {
+    g_bufferBTProvider->nextToWrite(edf_bt_payload_hash, edt_Hex32, 8).set32(packet.getHash());
+    return 1;
   }
-} g_bleCallback;
+
+  const uint chunk = sizeof(DataBlock::_value) + sizeof(DataBlock::_extra); // multiple of 3 for base64
+  if (freeBlocks < (packet._payloadLength + chunk - 1) / chunk) return 0;
+  bool base64 = mode == EnumBTPayloadMode::Base64;
+  EnumDataField fld = base64 ? edf_bt_payload_b64 : edf_bt_payload;
+  uint len = packet._payloadLength, blocks = 0;
+  const uint8_t* buff = packet._payloadBuffer;
+  for (uint cpy; len > 0 || blocks == 0; buff += cpy, len -= cpy, fld = edf__cont, blocks++) {
+    cpy = len > chunk ? chunk : len;
+    g_bufferBTProvider->nextToWrite(fld, base64 ? edt_Base64 : edt_Raw, cpy + (base64 ? 0 : etirFormatHexLower)).setRaw(buff, cpy);
+  }
+  return blocks;
+}
+
+// The new window is applied by restarting the scan (in the next loop)
+void BTProvider::controlScan(bool isScanning) {
+  uint32_t elapsed = _scanControlTime.elapsedTime();
+  if (elapsed < STFBT_SCAN_CONTROL_PERIOD) return;
+  BTScanLoad load;
+  load.scanned = _scanControlScanned;
+  load.forwarded = _scanControlForwarded;
+  uint32_t dropped = _packetsDropped.get();
+  load.dropped = dropped - _scanControlDropped;
+  load.freeBlocks = g_bufferBTProvider->getFreeBlocks();
+  load.bufferSize = load.freeBlocks + g_bufferBTProvider->getUsedBlocks();
+  _scanControlTime.reset();
+  _scanControlScanned = _scanControlForwarded = 0;
+  _scanControlDropped = dropped;
+
+  if (!_scanController.update(elapsed, load)) return;
+  STFLOG_INFO("BT scan window changed to %u ms (scanned %u, forwarded %u, dropped %u, free blocks %u)\n", _scanController.getWindow(), load.scanned, load.forwarded, load.dropped, load.freeBlocks);
+  NimBLEScan* scan = NimBLEDevice::getScan();
+  if (isScanning) scan->stop();
+  scan->setWindow(_scanController.getWindow());
+}
 
 void BTProvider::setup() {
   if (NimBLEDevice::getInitialized()) return;
@@ -136,12 +218,25 @@ void BTProvider::setup() {
   NimBLEScan* scan = NimBLEDevice::getScan(); // singleton, we don't need to store it anywhere
   scan->setActiveScan(false); // We don't support the extra packets: drains battery on the other side, kills wifi on this side, let's forget it...
   //scan->setInterval(52); // How often the scan occurs / switches channels; in milliseconds,
-  scan->setInterval(97); // How often the scan occurs / switches channels; in milliseconds,
-  scan->setWindow(30); // How long to scan during the interval; in milliseconds.
+  scan->setInterval(_scanController.getInterval()); // How often the scan occurs / switches channels; in milliseconds,
+  scan->setWindow(_scanController.getWindow()); // How long to scan during the interval; in milliseconds (adjusted by controlScan).
   scan->setMaxResults(0); // do not store the scan results, use callback only.
   scan->setAdvertisedDeviceCallbacks(&g_bleCallback, false);
   _packetLastReset = 0;
-  _packetsScanned = _packetsForwarded = 0;
+  BTDistance::setup();
+  loadLists();
+
+  addRoute(_filterUnknown, &_packetsFilterUnknown);
+  addRoute(Discovery::_Discovery_Reset, &_forceDiscoveryReset);
+  addRoute(_allowOnly, &_allowListOnly, ebrAllowOnly);
+  addRoute(edf_bt_allow, ebrList);
+  addRoute(edf_bt_deny, ebrList);
+  addRoute(_scanAdaptive, &_scanController._adaptive);
+#if STFBT_GATEWAY == 1
+  addRoute(_gatewayBlock, &_gatewayMode);
+#endif
+  addRoute(edf_bt_payload_mode, ebrPayloadMode);
+  addRoute(edf_bt_query, ebrQuery);
 }
 
 uint BTProvider::loop() {
@@ -153,18 +248,62 @@ uint BTProvider::loop() {
       _forceDiscoveryReset = false;
     }
     if (!isScanning) scan->start(0, nullptr, false);
+  } else if (isConsumerAccepting()) { // offline, the readings are queued by the consumer
+    if (!isScanning) scan->start(0, nullptr, false);
   } else {
     if (isScanning) scan->stop();
   }
 
-  return 50;
+  uint processed = 0;
+  _discoveryList.updateDevices();
+  if (_listsChanged) {
+    _listsChanged = false;
+    saveLists();
+  }
+  for (BTRawPacket* raw; (raw = _queue.front()) != nullptr; _queue.pop(), processed++) {
+    if (!isAccepted(raw->mac)) continue;
+#if STFBT_GATEWAY == 1
+    if (_gatewayMode) {
+      if (_gateway.add(*raw))
+        _packetsForwarded.increment();
+      else
+        _packetsDropped.increment();
+      continue;
+    }
+#endif
+    BTPacket packet(raw->advType, raw->macType, raw->mac, raw->payload, raw->payloadLength, raw->rssi);
+    processPacket(packet);
+  }
+
+#if STFBT_GATEWAY == 1
+  if (_gatewayMode) _gateway.update(Host::uptimeMS32());
+#endif
+  _scanControlScanned += processed;
+  controlScan(isScanning);
+
+  return processed != 0 || isScanning ? 10 : 50;
 }
 
 const DiscoveryBlock BTProvider::_received = {edf_bt_scanned, edcSensor, eecDiagnostic, "BT Packets Scanned", "Hz", nullptr};
 const DiscoveryBlock BTProvider::_transmitted = {edf_bt_forwarded, edcSensor, eecDiagnostic, "BT Packets Forwarded", "Hz", nullptr};
+const DiscoveryBlock BTProvider::_dropped = {edf_bt_dropped, edcSensor, eecDiagnostic, "BT Packets Dropped", "Hz", nullptr};
+const DiscoveryBlock BTProvider::_unknownSkipped = {edf_bt_unknown_skipped, edcSensor, eecDiagnostic, "BT Unknown Packets Skipped", "Hz", nullptr};
+const DiscoveryBlock BTProvider::_duplicateRate = {edf_bt_duplicates, edcSensor, eecDiagnostic, "BT Duplicate Packets", "%", nullptr};
 const DiscoveryBlock BTProvider::_filterUnknown = {edf_bt_filter_unknown, edcSwitch, eecConfig, "BT Filter Unknown Messages", nullptr, nullptr};
-const DiscoveryBlock* BTProvider::_listSystemNormal[] = {&_received, &_transmitted, nullptr};
-const DiscoveryBlock* BTProvider::_listSystemRetained[] = {&_filterUnknown, nullptr};
+const DiscoveryBlock* BTProvider::_listSystemNormal[] = {&_received, &_transmitted, &_dropped, &_unknownSkipped, &_duplicateRate, &_scanWindow, &_scanDuty, nullptr};
+const DiscoveryBlock BTProvider::_scanWindow = {edf_bt_scan_window, edcSensor, eecDiagnostic, "BT Scan Window", "ms", nullptr};
+const DiscoveryBlock BTProvider::_scanDuty = {edf_bt_scan_duty, edcSensor, eecDiagnostic, "BT Scan Duty Cycle", "%", nullptr};
+const DiscoveryBlock BTProvider::_scanAdaptive = {edf_bt_scan_adaptive, edcSwitch, eecConfig, "BT Adaptive Scan", nullptr, nullptr};
+const DiscoveryBlock BTProvider::_allowOnly = {edf_bt_allow_only, edcSwitch, eecConfig, "BT Allow Listed Only", nullptr, nullptr};
+const DiscoveryBlock BTProvider::_payloadModeBlock = {edf_bt_payload_mode, edcSensor, eecDiagnostic, "BT Payload Mode", nullptr, nullptr};
+#if STFBT_GATEWAY == 1
+const DiscoveryBlock BTProvider::_gatewayBlock = {edf_bt_gateway, edcSwitch, eecConfig, "BT Raw Gateway Mode", nullptr, nullptr};
+const DiscoveryBlock* BTProvider::_listSystemRetained[] = {&_filterUnknown, &_allowOnly, &_payloadModeBlock, &_scanAdaptive, &_gatewayBlock, nullptr};
+#else
+const DiscoveryBlock* BTProvider::_listSystemRetained[] = {&_filterUnknown, &_allowOnly, &_payloadModeBlock, &_scanAdaptive, nullptr};
+#endif
+const char* BTProvider::_storeName = "bt";
+const char* BTProvider::_payloadModeNames[] = {"hex", "omit", "unknown", "base64", "hash"};
 
 uint BTProvider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type) {
   uint res = 0;
@@ -174,20 +313,42 @@ uint BTProvider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESyste
       res += Discovery::addBlocks(systemBuffer, etitSYSR, _listSystemRetained);
       break;
     case ESystemMessageType::Retained:
-      res = 1;
+      res = 4 + STFBT_GATEWAY;
       if (systemBuffer != nullptr && systemBuffer->getFreeBlocks() >= res) {
         systemBuffer->nextToWrite(edf_bt_filter_unknown, edt_String, etisSource0Ptr).setPtr(_packetsFilterUnknown ? "ON" : "OFF");
+        systemBuffer->nextToWrite(edf_bt_allow_only, edt_String, etisSource0Ptr).setPtr(_allowListOnly ? "ON" : "OFF");
+        systemBuffer->nextToWrite(edf_bt_payload_mode, edt_String, etisSource0Ptr).setPtr(_payloadModeNames[(uint)_payloadMode]);
+        systemBuffer->nextToWrite(edf_bt_scan_adaptive, edt_String, etisSource0Ptr).setPtr(_scanController._adaptive ? "ON" : "OFF");
+#if STFBT_GATEWAY == 1
+        systemBuffer->nextToWrite(edf_bt_gateway, edt_String, etisSource0Ptr).setPtr(_gatewayMode ? "ON" : "OFF");
+#endif
         res = 0;
       }
       break;
 
     case ESystemMessageType::Normal:
-      res = 2;
+      res = 7;
       if (systemBuffer != nullptr && systemBuffer->getFreeBlocks() >= res) {
         float ellapsed = uptimeS == _packetLastReset ? 0.1f : (uptimeS - _packetLastReset);
-        systemBuffer->nextToWrite(edf_bt_scanned, edt_Float, 3).setFloat(_packetsScanned / ellapsed);
-        systemBuffer->nextToWrite(edf_bt_forwarded, edt_Float, 3).setFloat(_packetsForwarded / ellapsed);
-        _packetsScanned = _packetsForwarded = 0; // we have a very low chance to lose 1 packet from the statistics due to concurrency, that's ok
+        uint32_t scanned = _packetsScanned.get(), forwarded = _packetsForwarded.get(), dropped = _packetsDropped.get();
+        systemBuffer->nextToWrite(edf_bt_scanned, edt_Float, 3).setFloat((scanned - _statScanned) / ellapsed);
+        systemBuffer->nextToWrite(edf_bt_forwarded, edt_Float, 3).setFloat((forwarded - _statForwarded) / ellapsed);
+        systemBuffer->nextToWrite(edf_bt_dropped, edt_Float, 3).setFloat((dropped - _statDropped) / ellapsed);
+        uint32_t unknownHits = _unknownCache._hits.get(), unknownMisses = _unknownCache._misses.get();
+        uint32_t dedupHits = _dedupCache._hits.get(), dedupMisses = _dedupCache._misses.get();
+        systemBuffer->nextToWrite(edf_bt_unknown_skipped, edt_Float, 3).setFloat((unknownHits - _statUnknownHits) / ellapsed);
+        uint32_t dedupTotal = (dedupHits - _statDedupHits) + (dedupMisses - _statDedupMisses);
+        systemBuffer->nextToWrite(edf_bt_duplicates, edt_Float, 1).setFloat(dedupTotal == 0 ? 0.f : (dedupHits - _statDedupHits) * 100.f / dedupTotal);
+        systemBuffer->nextToWrite(edf_bt_scan_window, edt_32, 0).set32(_scanController.getWindow());
+        systemBuffer->nextToWrite(edf_bt_scan_duty, edt_Float, 1).setFloat(_scanController.getDutyCycle());
+        STFLOG_INFO("BT unknown cache hits: %u, misses: %u\n", (uint)(unknownHits - _statUnknownHits), (uint)(unknownMisses - _statUnknownMisses));
+        _statScanned = scanned;
+        _statForwarded = forwarded;
+        _statDropped = dropped;
+        _statUnknownHits = unknownHits;
+        _statUnknownMisses = unknownMisses;
+        _statDedupHits = dedupHits;
+        _statDedupMisses = dedupMisses;
         _packetLastReset = uptimeS;
         res = 0;
       }
@@ -198,9 +359,148 @@ uint BTProvider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESyste
   return res;
 }
 
-void BTProvider::feedback(const FeedbackInfo& info) {
-  handleSimpleFeedback(info, _filterUnknown, Host::_info.mac, Host::_info.macLen, &_packetsFilterUnknown);
-  handleSimpleFeedback(info, Discovery::_Discovery_Reset, Host::_info.mac, Host::_info.macLen, &_forceDiscoveryReset);
+void BTProvider::feedback(const FeedbackInfo& info, uint8_t route) {
+  if (route == ebrAllowOnly) _listsChanged = true;
+  if (route == ebrList) handleListFeedback(info);
+
+  // Payload mode: one of the _payloadModeNames, restored from the retained state as well
+  if (route == ebrPayloadMode) {
+    int idx = Util::getArrayIndex((const char*)info.payload, info.payloadLength, _payloadModeNames, (uint)EnumBTPayloadMode::Count);
+    STFLOG_INFO("BT payload mode command detected - %*.*s\n", info.payloadLength, info.payloadLength, info.payload);
+    if (idx >= 0 && idx != (int)_payloadMode) {
+      _payloadMode = (EnumBTPayloadMode)idx;
+      if (!info.retained) SystemProvider::requestRetainedReport();
+    }
+  }
+
+  // Live state of a device: bt_query with payload "AA:BB:CC:DD:EE:FF", answered on the device's BT topic
+  if (route == ebrQuery && !info.retained) {
+    uint8_t mac[6];
+    const char* str = (const char*)info.payload;
+    if (parseMAC(str, str + info.payloadLength, mac))
+      publishDeviceState(mac);
+    else
+      STFLOG_WARNING("Invalid BT query command - %*.*s\n", info.payloadLength, info.payloadLength, info.payload);
+  }
+}
+
+// Runs on the BT provider's task (commands are applied there), so it can write the buffer
+void BTProvider::publishDeviceState(const uint8_t* mac) {
+  const BTDevice* dev = _discoveryList.findDevice(mac);
+  if (dev == nullptr) {
+    STFLOG_WARNING("BT query - unknown device %02X:%02X:%02X:%02X:%02X:%02X\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return;
+  }
+  DataBuffer* buffer = g_bufferBTProvider;
+  if (buffer->getFreeBlocks() < 6 + BTDevice::MaxValues) {
+    STFLOG_WARNING("BT query - no room in the buffer\n");
+    return;
+  }
+  buffer->nextToWrite(edf__topic, edt_Topic, etitBT, eeiCacheDeviceMAC48).setMAC48(dev->_mac);
+  buffer->nextToWrite(edf_bt_last_seen, edt_32, 0).set32((Host::uptimeMS32() - dev->_lastSeen) / 1000);
+  buffer->nextToWrite(edf_bt_packets, edt_32, 0).set32(dev->_packetCount);
+  buffer->nextToWrite(edf_bt_decoder, edt_32, 0).set32(dev->_decoder);
+  if (dev->hasRSSI()) {
+    buffer->nextToWrite(edf_rssi, edt_Float, 1).setFloat(dev->getRSSI());
+    buffer->nextToWrite(edf_distance, edt_Float, 2).setFloat(BTDistance::distance(dev->getRSSI(), dev->_txPower));
+  }
+  EnumDataField field;
+  EnumDataType type;
+  uint8_t typeInfo;
+  uint32_t value;
+  for (uint idx = 0; dev->getValue(idx, field, type, typeInfo, value); idx++) buffer->nextToWrite(field, type, typeInfo).set32(value); // the bits of a float too
+  buffer->closeMessage();
+}
+
+// "AA:BB:CC:DD:EE:FF", "AA-BB-..." or "AABBCCDDEEFF"
+bool BTProvider::parseMAC(const char* str, const char* end, uint8_t* mac) {
+  uint len = 0;
+  for (uint nibble; str < end && len < 12; str++) {
+    if (*str == ':' || *str == '-') continue;
+    if ((nibble = isdigit(*str) ? *str - '0' : (isxdigit(*str) ? (tolower(*str) - 'a' + 10) : 16)) == 16) break;
+    mac[len / 2] = (len % 2 == 0 ? 0 : mac[len / 2] << 4) + nibble;
+    len++;
+  }
+  return len == 12 && str == end;
+}
+
+#if STFBT_GATEWAY == 1
+const uint8_t* BTProvider::getRawMessage(uint& len, uint8_t& topic) {
+  topic = etitBTRAW;
+  return _gateway.getBatch(len);
+}
+
+void BTProvider::releaseRawMessage() {
+  _gateway.releaseBatch();
+}
+#endif
+
+// Commands: bt_allow / bt_deny with payload "AA:BB:CC:DD:EE:FF" (add), "-AA:BB:CC:DD:EE:FF" (remove) or "CLEAR"
+void BTProvider::handleListFeedback(const FeedbackInfo& info) {
+  BTListCommand cmd;
+  cmd.list = info.fieldEnum == edf_bt_allow ? EnumBTList::Allow : EnumBTList::Deny;
+  if (info.checkPayload("CLEAR")) {
+    cmd.operation = BTListCommand::Clear;
+  } else {
+    const char* str = (const char*)info.payload;
+    const char* end = str + info.payloadLength;
+    cmd.operation = str < end && *str == '-' ? BTListCommand::Remove : BTListCommand::Add;
+    if (cmd.operation == BTListCommand::Remove) str++;
+    if (!parseMAC(str, end, cmd.mac)) {
+      STFLOG_WARNING("Invalid BT list command - %*.*s\n", info.payloadLength, info.payloadLength, info.payload);
+      return;
+    }
+  }
+  applyListCommand(cmd);
+}
+
+// The device table is owned by the BT task, the commands arrive there through the task's mailbox
+void BTProvider::applyListCommand(const BTListCommand& cmd) {
+  bool res = true;
+  if (cmd.operation == BTListCommand::Clear) {
+    _discoveryList.clearList(cmd.list);
+  } else if (cmd.operation == BTListCommand::Add) {
+    res = _discoveryList.setList(cmd.mac, cmd.list);
+  } else {
+    BTDevice* dev = _discoveryList.findDevice(cmd.mac);
+    if (dev != nullptr && dev->getList() == cmd.list) _discoveryList.setList(cmd.mac, EnumBTList::None);
+  }
+  STFLOG_INFO("BT %s list command %u %s - allowed: %u, denied: %u\n", cmd.list == EnumBTList::Allow ? "allow" : "deny", cmd.operation, res ? "done" : "failed",
+              _discoveryList.getListCount(EnumBTList::Allow), _discoveryList.getListCount(EnumBTList::Deny));
+  _listsChanged = true;
+}
+
+// Checked on the raw packet, so nothing else is done for the filtered devices
+bool BTProvider::isAccepted(const uint8_t* nativeMAC) {
+  if (!_allowListOnly && _discoveryList.getListCount(EnumBTList::Deny) == 0) return true;
+  uint8_t mac[6];
+  for (int idx = 0; idx < 6; idx++) mac[idx] = nativeMAC[5 - idx];
+  BTDevice* dev = _discoveryList.findDevice(mac);
+  EnumBTList list = dev != nullptr ? dev->getList() : EnumBTList::None;
+  return _allowListOnly ? list == EnumBTList::Allow : list != EnumBTList::Deny;
+}
+
+void BTProvider::loadLists() {
+  Preferences store;
+  if (!store.begin(_storeName, true)) return;
+  uint8_t buffer[2 * STFBT_LIST_MAX * 7];
+  size_t len = store.getBytesLength("lists");
+  if (len > 0 && len <= sizeof(buffer)) len = store.getBytes("lists", buffer, len);
+  else len = 0;
+  for (const uint8_t* entry = buffer; entry + 7 <= buffer + len; entry += 7) _discoveryList.setList(entry + 1, (EnumBTList)entry[0]);
+  _allowListOnly = store.getUChar("allowOnly", 0) != 0;
+  store.end();
+  STFLOG_INFO("BT lists loaded - allowed: %u, denied: %u, allow listed only: %u\n", _discoveryList.getListCount(EnumBTList::Allow), _discoveryList.getListCount(EnumBTList::Deny), _allowListOnly);
+}
+
+void BTProvider::saveLists() {
+  uint8_t buffer[2 * STFBT_LIST_MAX * 7];
+  uint count = _discoveryList.exportLists(buffer, 2 * STFBT_LIST_MAX);
+  Preferences store;
+  if (!store.begin(_storeName)) return;
+  store.putBytes("lists", buffer, count * 7);
+  store.putUChar("allowOnly", _allowListOnly ? 1 : 0);
+  store.end();
 }
 
 // BTPacket
@@ -211,6 +511,7 @@ BTPacket::BTPacket(uint8_t advType, uint8_t macType, const uint8_t* mac, const u
   _macType = macType;
   _advType = advType;
   _rssi = rssi < -128 ? -128 : (rssi > 127 ? 127 : (int8_t)rssi);
+
 }
 
 void BTPacket::log(const char* extraMsg, int level, bool endl) const {
@@ -236,17 +537,18 @@ void BTPacket::logPayload(int level, bool endl) const {
 }
 
 const uint8_t* BTPacket::getServiceDataByUUID(uint32_t uuid, uint& len) const {
-  uint16_t u16 = uuid < 65536 ? (uint16_t)uuid : 0; // 0 is invalid uuid16
+  uint32_t u16 = uuid < 65536 ? uuid : 0; // 0 is invalid uuid16
   uint buffLen = _payloadLength;
   const uint8_t* buffPtr = _payloadBuffer;
   while (buffLen >= 4) {
     uint slen = buffPtr[0] + 1;
     if (slen > buffLen) slen = buffLen;
-    if (slen >= len + 4 && buffPtr[1] == 0x16 && u16 == *(uint16_t*)(buffPtr + 2)) {
+    // the uuid is read byte by byte, the structures are not aligned
+    if (slen >= len + 4 && buffPtr[1] == 0x16 && u16 == (buffPtr[2] | buffPtr[3] << 8)) {
       len = slen - 4;
       return buffPtr + 4;
     }
-    if (slen >= len + 6 && buffPtr[1] == 0x20 && uuid == *(uint32_t*)(buffPtr + 2)) {
+    if (slen >= len + 6 && buffPtr[1] == 0x20 && uuid == (buffPtr[2] | buffPtr[3] << 8 | buffPtr[4] << 16 | (uint32_t)buffPtr[5] << 24)) {
       len = slen - 6;
       return buffPtr + 6;
     }
@@ -274,19 +576,48 @@ const uint8_t* BTPacket::getField(uint8_t type, uint& len, int idx) const {
   return nullptr;
 }
 
+bool BTPacket::hasServiceUUID(uint32_t uuid) const {
+  uint len = 0;
+  return getServiceDataByUUID(uuid, len) != nullptr;
+}
+
 uint BTPacket::countField(uint8_t type) const {
   uint buffLen = _payloadLength, count = 0;
   const uint8_t* buffPtr = _payloadBuffer;
   while (buffLen >= 2) {
     uint slen = buffPtr[0] + 1;
     if (slen > buffLen) slen = buffLen;
-    if (slen >= 1 && buffPtr[1] == type) count++;
+    if (slen >= 2 && buffPtr[1] == type) count++;
     buffPtr += slen;
     buffLen -= slen;
   }
   return count;
 }
 
+uint32_t BTPacket::getSignature() const {
+  uint32_t hash = Util::hash(_mac, 6);
+  uint buffLen = _payloadLength;
+  const uint8_t* buffPtr = _payloadBuffer;
+  while (buffLen >= 2) {
+    uint slen = buffPtr[0] + 1;
+    if (slen > buffLen) slen = buffLen;
+    if (slen >= 2) {
+      uint8_t type = buffPtr[1];
+      hash = Util::hash(&type, 1, hash);
+      if ((type == 0x16 || type == 0xff) && slen >= 4) hash = Util::hash(buffPtr + 2, 2, hash); // service uuid, company id
+      if (type == 0x20 && slen >= 6) hash = Util::hash(buffPtr + 2, 4, hash);
+    }
+    buffPtr += slen;
+    buffLen -= slen;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+uint32_t BTPacket::getHash() const {
+  uint32_t hash = Util::hash(_payloadBuffer, _payloadLength, Util::hash(_mac, 6));
+  return hash != 0 ? hash : 1;
+}
+
 bool BTPacket::checkMAC(uint8_t type, uint8_t m0, uint8_t m1, uint8_t m2) const {
   return _macType == type && _mac[0] == m0 && _mac[1] == m1 && _mac[2] == m2;
 }
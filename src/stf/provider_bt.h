@@ -19,11 +19,23 @@
 #pragma once
 
 #include <stf/provider.h>
+#include <stf/bt_device.h>
+#include <stf/bt_gateway.h>
+#include <stf/bt_scan.h>
+#include <stf/util.h>
+
+// Raw advertisement queue between the NimBLE callback and BTProvider::loop (size must be power of 2)
+#ifndef STFBT_QUEUE_SIZE
+#  define STFBT_QUEUE_SIZE 32
+#endif
+
+// Maximum stored payload size, longer advertisements are dropped (31 for advertisement + 31 for scan response)
+#ifndef STFBT_QUEUE_PAYLOAD_SIZE
+#  define STFBT_QUEUE_PAYLOAD_SIZE 62
+#endif
 
 namespace stf {
 
-class DiscoveryBlock;
-class BTDeviceGroup;
 class DataFeeder;
 
 class BTPacket {
@@ -37,7 +49,10 @@ public:
   const uint8_t* getServiceDataByUUID(uint32_t uuid, uint& len) const;
   const uint8_t* getField(uint8_t type, uint& len, int idx = 0) const;
   uint countField(uint8_t type) const;
+  bool hasServiceUUID(uint32_t uuid) const;
   bool checkMAC(uint8_t type, uint8_t m0, uint8_t m1, uint8_t m2) const;
+  uint32_t getSignature() const; // MAC + structure of the payload (AD types, uuids, company id), never 0
+  uint32_t getHash() const; // MAC + payload, never 0
 
   const uint8_t* _payloadBuffer;
   uint _payloadLength;
@@ -48,6 +63,47 @@ public:
   int8_t _rssi;
 };
 
+// Advertisement as it's received in the NimBLE callback
+struct BTRawPacket {
+  uint32_t time; // uptime in ms
+  uint8_t mac[6]; // NimBLE (reversed) order
+  uint8_t macType;
+  uint8_t advType;
+  int8_t rssi;
+  uint8_t payloadLength;
+  uint8_t payload[STFBT_QUEUE_PAYLOAD_SIZE];
+};
+
+// How the raw advertisement is added to the forwarded messages
+enum class EnumBTPayloadMode : uint8_t {
+  Hex = 0, // bt_payload
+  Omit = 1,
+  UnknownOnly = 2, // bt_payload, only if no decoder resolved the packet
+  Base64 = 3, // bt_payload_b64
+  Hash = 4, // bt_payload_hash: 32 bit hash of the MAC and the payload, for change detection
+  Count = 5,
+};
+
+// Allow/deny list change requested over MQTT
+struct BTListCommand {
+  enum Operation : uint8_t {
+    Add = 0,
+    Remove = 1,
+    Clear = 2,
+  };
+  uint8_t mac[6];
+  EnumBTList list;
+  Operation operation;
+};
+
+enum EnumBTRoute : uint8_t {
+  ebrNone = 0,
+  ebrAllowOnly = 1,
+  ebrList = 2,
+  ebrPayloadMode = 3,
+  ebrQuery = 4
+};
+
 class BTProvider : public Provider {
 public:
   BTProvider();
@@ -56,20 +112,65 @@ public:
   void setup() override;
 
   uint systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type) override;
-  void feedback(const FeedbackInfo& info) override;
+  void feedback(const FeedbackInfo& info, uint8_t route) override;
+#if STFBT_GATEWAY == 1
+  const uint8_t* getRawMessage(uint& len, uint8_t& topic) override;
+  void releaseRawMessage() override;
+#endif
 
-  static double beaconDistance(int rssi, int txPower);
   static void generateBTBlocks(DataFeeder& feeder, const DataBlock& generatorBlock, DataCache& cache);
+  static BTDevice* updateDevice(const BTPacket& packet, DataBuffer* buffer, uint blocks, int8_t txPower, uint8_t decoder);
+  void processPacket(BTPacket& packet);
+  void controlScan(bool isScanning);
+  uint addPayloadBlocks(const BTPacket& packet, uint freeBlocks, bool decoded);
+
+  bool isAccepted(const uint8_t* nativeMAC);
+  void handleListFeedback(const FeedbackInfo& info);
+  void publishDeviceState(const uint8_t* mac);
+  static bool parseMAC(const char* str, const char* end, uint8_t* mac);
+  void applyListCommand(const BTListCommand& cmd);
+  void loadLists();
+  void saveLists();
+
+  LockFreeQueue<BTRawPacket, STFBT_QUEUE_SIZE> _queue;
+  BTKeyCache<STFBT_UNKNOWN_CACHE_SIZE> _unknownCache; // signatures of the packets no decoder matched
+  BTKeyCache<STFBT_DEDUP_SIZE> _dedupCache; // hashes of the recently processed packets
+  BTScanController _scanController;
+  ElapsedTime _scanControlTime;
+  uint32_t _scanControlScanned = 0; // packets taken from the queue in the current control period
+  uint32_t _scanControlForwarded = 0;
+  uint32_t _scanControlDropped = 0; // _packetsDropped at the start of the period
+#if STFBT_GATEWAY == 1
+  BTGateway _gateway;
+  bool _gatewayMode = false;
+  static const DiscoveryBlock _gatewayBlock;
+#endif
 
   uint32_t _packetLastReset;
-  volatile uint16_t _packetsScanned;
-  volatile uint16_t _packetsForwarded;
+  AtomicCounter _packetsScanned; // NimBLE callback
+  AtomicCounter _packetsForwarded;
+  AtomicCounter _packetsDropped; // queue overflow (NimBLE callback), gateway batch full (BT task)
+  uint32_t _statScanned = 0, _statForwarded = 0, _statDropped = 0; // the counters at _packetLastReset
+  uint32_t _statUnknownHits = 0, _statUnknownMisses = 0, _statDedupHits = 0, _statDedupMisses = 0;
   bool _packetsFilterUnknown = true;
   bool _forceDiscoveryReset = false;
+  bool _allowListOnly = false;
+  EnumBTPayloadMode _payloadMode = EnumBTPayloadMode::Hex;
+  bool _listsChanged = false;
 
   static const DiscoveryBlock _received;
   static const DiscoveryBlock _transmitted;
+  static const DiscoveryBlock _dropped;
+  static const DiscoveryBlock _unknownSkipped;
+  static const DiscoveryBlock _duplicateRate;
   static const DiscoveryBlock _filterUnknown;
+  static const DiscoveryBlock _allowOnly;
+  static const DiscoveryBlock _payloadModeBlock;
+  static const DiscoveryBlock _scanAdaptive;
+  static const DiscoveryBlock _scanWindow;
+  static const DiscoveryBlock _scanDuty;
+  static const char* _payloadModeNames[];
+  static const char* _storeName;
 
   static BTDeviceGroup _discoveryList;
   static const DiscoveryBlock* _listSystemNormal[];
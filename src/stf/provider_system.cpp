@@ -64,10 +64,14 @@ uint SystemProvider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ES
   return res;
 }
 
-void SystemProvider::feedback(const FeedbackInfo& info) {
-  if (handleSimpleFeedback(info, Discovery::_Device_Reset, Host::_info.mac, Host::_info.macLen, nullptr)) ESP.restart();
-  handleSimpleFeedback(info, Discovery::_Discovery_Reset, Host::_info.mac, Host::_info.macLen, &_forceDiscoveryReset);
-  handleSimpleFeedback(info, _discoveryLed, Host::_info.mac, Host::_info.macLen, &_enableLed);
+void SystemProvider::setup() {
+  addRoute(Discovery::_Device_Reset, nullptr, 1);
+  addRoute(Discovery::_Discovery_Reset, &_forceDiscoveryReset);
+  addRoute(_discoveryLed, &_enableLed);
+}
+
+void SystemProvider::feedback(const FeedbackInfo& info, uint8_t route) {
+  if (route == 1) ESP.restart(); // device reset pressed
 }
 
 void SystemProvider::requestRetainedReport() {
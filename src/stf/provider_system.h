@@ -30,9 +30,10 @@ class SystemProvider : public Provider {
 public:
   SystemProvider();
 
+  void setup() override;
   uint loop() override;
   uint systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type) override;
-  void feedback(const FeedbackInfo& info) override;
+  void feedback(const FeedbackInfo& info, uint8_t route) override;
 
   static void requestRetainedReport();
   static inline bool isLedEnabled() { return _obj._enableLed; }
@@ -134,6 +134,16 @@
 #  define STFTASK_WIFI 1
 #endif
 
+// BT
+
+#ifndef STFBT_TASK_CORE
+#  define STFBT_TASK_CORE 1
+#endif
+
+#ifndef STFBT_TASK_STACK_SIZE
+#  define STFBT_TASK_STACK_SIZE 4096
+#endif
+
 // Buffers ( + Providers)
 
 #ifndef STFBUFFER_0
@@ -18,6 +18,7 @@
 
 #include <stf/os.h>
 #include <stf/data_buffer.h>
+#include <stf/provider.h>
 
 namespace stf {
 
@@ -26,6 +27,10 @@ template <>
 const TaskDescriptor SimpleTask<EnumSimpleTask::Main>::_descriptor = {&_obj, "MainTask", 0, 0, 0};
 template class SimpleTask<EnumSimpleTask::Main>;
 
+// Only created when a buffer is assigned to it, e.g. STF_BUFFER1(btBuffer, 64, BT, BTProvider) (so _obj is not referenced here)
+template <>
+const TaskDescriptor SimpleTask<EnumSimpleTask::BT>::_descriptor = {nullptr, "BTTask", STFBT_TASK_STACK_SIZE, STFBT_TASK_CORE, 1};
+
 TaskRoot::TaskRoot() {
 }
 
@@ -52,6 +57,8 @@ void TaskRoot::setup() {
 }
 
 uint TaskRoot::loop() {
+  if (_mailbox != nullptr) Provider::applyFeedback(*_mailbox);
+
   uint wait = 100;
   for (DataBuffer* db = _bufferHead; db != nullptr; db = (DataBuffer*)db->_objectNext) {
     uint res = db->loopProviders();
@@ -21,6 +21,7 @@
 namespace stf {
 
 class DataBuffer;
+class CommandMailbox;
 struct TaskDescriptor;
 
 class TaskRoot : public Object {
@@ -38,6 +39,7 @@ public:
   const TaskDescriptor* _descriptorPtr = nullptr;
   TaskRoot* _next = nullptr;
   DataBuffer* _bufferHead = nullptr;
+  CommandMailbox* _mailbox = nullptr; // incoming commands for the providers of this task, see Provider::addRoute
 
   void initTask(const TaskDescriptor* descriptor);
 
@@ -81,6 +83,7 @@ void Task<T>::init() { initTask(&_descriptor); }
 
 enum class EnumSimpleTask {
   Main = 0,
+  BT = 1, // optional task for the BT decoding (STFBT_TASK_CORE)
 };
 
 template <EnumSimpleTask ID>
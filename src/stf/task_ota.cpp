@@ -71,8 +71,8 @@ uint OTAProvider::systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESyst
   return res;
 }
 
-void OTAProvider::feedback(const FeedbackInfo& info) {
-  handleSimpleFeedback(info, _switch, Host::_info.mac, Host::_info.macLen, &_enabled);
+void OTAProvider::setup() {
+  addRoute(_switch, &_enabled);
 }
 
 void OTAProvider::onStart() { STFLOG_WARNING("OTA update is starting.\n"); }
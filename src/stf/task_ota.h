@@ -37,9 +37,9 @@ class OTAProvider : public Provider {
 public:
   OTAProvider();
 
+  void setup() override;
   uint loop() override;
   uint systemUpdate(DataBuffer* systemBuffer, uint32_t uptimeS, ESystemMessageType type) override;
-  void feedback(const FeedbackInfo& info) override;
 
 protected:
   static void onStart();
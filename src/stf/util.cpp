@@ -84,4 +84,9 @@ void Util::writeHexToBuffer(uint8_t* buffer, const uint8_t* src, uint len, char
   }
 }
 
+uint32_t Util::hash(const void* src, uint len, uint32_t hash) {
+  for (const uint8_t *buff = (const uint8_t*)src, *end = buff + len; buff < end; buff++) hash = (hash ^ *buff) * 16777619u;
+  return hash;
+}
+
 } // namespace stf
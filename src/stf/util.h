@@ -39,6 +39,9 @@ public:
 
   static void writeHexToLog(const uint8_t* src, uint len, char hex10 = 'a');
   static void writeHexToBuffer(uint8_t* buffer, const uint8_t* src, uint len, char hex10 = 'a');
+
+  // FNV-1a, the hash parameter can be used to continue a previous hash
+  static uint32_t hash(const void* src, uint len, uint32_t hash = 2166136261u);
 };
 
 template <typename E>
@@ -79,4 +82,42 @@ protected:
   E _flags = (E)0;
 };
 
+// Statistics counter incremented from more tasks; never reset, the readers keep their own snapshot
+class AtomicCounter {
+public:
+  inline void increment() { __atomic_fetch_add(&_value, 1, __ATOMIC_RELAXED); }
+  inline uint32_t get() const { return __atomic_load_n(&_value, __ATOMIC_RELAXED); }
+
+protected:
+  uint32_t _value = 0;
+};
+
+// Single producer, single consumer lock-free ring buffer; the elements are written/read in place
+template <typename T, uint SIZE>
+class LockFreeQueue {
+public:
+  static_assert((SIZE & (SIZE - 1)) == 0, "LockFreeQueue size should be power of 2");
+
+  // Producer side: returns nullptr when the queue is full, otherwise the element should be filled and committed by push()
+  inline T* reserve() {
+    uint32_t head = _head;
+    return head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) < SIZE ? &_items[head % SIZE] : nullptr;
+  }
+  inline void push() { __atomic_store_n(&_head, _head + 1, __ATOMIC_RELEASE); }
+
+  // Consumer side: returns nullptr when the queue is empty, the element should be released by pop() after use
+  inline T* front() {
+    uint32_t tail = _tail;
+    return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) != tail ? &_items[tail % SIZE] : nullptr;
+  }
+  inline void pop() { __atomic_store_n(&_tail, _tail + 1, __ATOMIC_RELEASE); }
+
+  inline uint size() const { return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE); }
+
+protected:
+  uint32_t _head = 0;
+  uint32_t _tail = 0;
+  T _items[SIZE];
+};
+
 } // namespace stf
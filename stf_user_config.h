@@ -31,6 +31,18 @@
 //#define STFBLE_TEST_MAC 0x0c
 // BLE Test mode -> xor the last octet of the MAC so won't mess with the whole system
 //#define STFBLE_TEST_XOR 0xff
+// BLE raw gateway mode -> the "BT Raw Gateway Mode" switch forwards binary batches to the BTRAW topic without decoding
+//#define STFBT_GATEWAY 1
+
+// MQTT store and forward -> the readings are queued while the broker is not reachable and replayed after reconnect
+//#define STFMQTT_OFFLINE 1
+// ... with a SPIFFS log when the RAM ring is full (survives a reboot)
+//#define STFMQTT_OFFLINE_FLASH 1
+// MQTT 5 -> topic aliases, the repeated state topics are sent as 2 byte aliases
+//#define STFMQTT_VERSION 5
+// Messages sent in one loop of the network task (the rest waits for the next one), lower - faster keepalive / command handling
+//#define STF_CONSUME_MAX_MESSAGES 8
+//#define STF_CONSUME_MAX_US 20000
 
 // OTA
 
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+#
+#  SimpleThingFramework
+#
+#  Copyright 2021 Andras Csikvari
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+
+"""Decoder and verifier of the BT raw gateway batches (BTGateway, MQTT topic BTRAW).
+
+Prints the advertisements of the batches as JSON lines:
+  {"time": 123456, "mac": "A4:C1:38:12:34:56", "addrType": 0, "advType": 0, "rssi": -70, "payload": "020106..."}
+"time" is the uptime of the gateway in ms, "timeSaturated" is added when the delta didn't fit into the record
+(the real time is later), "rssi" is null when unknown.
+
+  bt_gateway_decode.py batch.bin ...          binary batches, one per file (e.g. mosquitto_sub -N ... > batch.bin)
+  bt_gateway_decode.py --hex batches.txt      one hex encoded batch per line
+  bt_gateway_decode.py --expect records.jsonl batch.bin ...
+                                              verifies the decoded records against the expected ones (host round trip)
+
+Exit code: 0 - ok, 1 - invalid batch or mismatch.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"SB"
+VERSION = 1
+HEADER_SIZE = 12
+RECORD_HEADER_SIZE = 11
+FLAG_LZ4 = 1
+RSSI_UNKNOWN = 127
+
+
+class BatchError(Exception):
+    pass
+
+
+def lz4_block_decompress(src, size):
+    """Decompresses an LZ4 block (no frame) into exactly size bytes."""
+    dst = bytearray()
+    pos = 0
+    while True:
+        if pos >= len(src):
+            raise BatchError("lz4: truncated sequence")
+        token = src[pos]
+        pos += 1
+
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                if pos >= len(src):
+                    raise BatchError("lz4: truncated literal length")
+                lit_len += src[pos]
+                pos += 1
+                if src[pos - 1] != 255:
+                    break
+        if pos + lit_len > len(src):
+            raise BatchError("lz4: literals over the end of the block")
+        dst += src[pos:pos + lit_len]
+        pos += lit_len
+        if pos == len(src):
+            break  # the last sequence has no match
+
+        if pos + 2 > len(src):
+            raise BatchError("lz4: truncated offset")
+        offset = src[pos] | (src[pos + 1] << 8)
+        pos += 2
+        if offset == 0 or offset > len(dst):
+            raise BatchError("lz4: invalid offset %d at %d" % (offset, len(dst)))
+        match_len = token & 15
+        if match_len == 15:
+            while True:
+                if pos >= len(src):
+                    raise BatchError("lz4: truncated match length")
+                match_len += src[pos]
+                pos += 1
+                if src[pos - 1] != 255:
+                    break
+        match_len += 4
+        for _ in range(match_len):  # byte by byte, the match may overlap the output
+            dst.append(dst[-offset])
+        if len(dst) > size:
+            raise BatchError("lz4: output over the expected %d bytes" % size)
+
+    if len(dst) != size:
+        raise BatchError("lz4: %d bytes decompressed instead of %d" % (len(dst), size))
+    return bytes(dst)
+
+
+def decode_batch(batch):
+    """Gives back the records of a batch as a list of dicts, raises BatchError if it's invalid."""
+    if len(batch) < HEADER_SIZE:
+        raise BatchError("batch shorter than the header (%d bytes)" % len(batch))
+    magic, version, flags, time, count, records_length = struct.unpack_from("<2sBBIHH", batch)
+    if magic != MAGIC:
+        raise BatchError("bad magic %r" % magic)
+    if version != VERSION:
+        raise BatchError("unknown version %d" % version)
+    if flags & ~FLAG_LZ4:
+        raise BatchError("unknown flags 0x%02x" % flags)
+
+    body = batch[HEADER_SIZE:]
+    if flags & FLAG_LZ4:
+        if len(body) >= records_length:
+            raise BatchError("compressed records are not smaller than the uncompressed ones")
+        body = lz4_block_decompress(body, records_length)
+    elif len(body) != records_length:
+        raise BatchError("records length %d, header says %d" % (len(body), records_length))
+
+    records = []
+    pos = 0
+    while pos < len(body):
+        length = body[pos] + 1
+        if length < RECORD_HEADER_SIZE or pos + length > len(body):
+            raise BatchError("invalid record length %d at %d" % (length, pos))
+        delta, mac, types, rssi = struct.unpack_from("<H6sBb", body, pos + 1)
+        record = {
+            "time": (time + delta) & 0xffffffff,
+            "mac": ":".join("%02X" % b for b in mac),
+            "addrType": types >> 4,
+            "advType": types & 15,
+            "rssi": None if rssi == RSSI_UNKNOWN else rssi,
+            "payload": body[pos + RECORD_HEADER_SIZE:pos + length].hex(),
+        }
+        if delta == 0xffff:
+            record["timeSaturated"] = True
+        records.append(record)
+        pos += length
+
+    if len(records) != count:
+        raise BatchError("%d records, header says %d" % (len(records), count))
+    return records
+
+
+def read_batches(args):
+    for name in args.files:
+        with open(name, "r" if args.hex else "rb") as f:
+            if not args.hex:
+                yield name, f.read()
+                continue
+            for line_no, line in enumerate(f, 1):
+                line = line.strip()
+                if line:
+                    yield "%s:%d" % (name, line_no), bytes.fromhex(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="+", help="batch files")
+    parser.add_argument("--hex", action="store_true", help="the files contain hex encoded batches, one per line")
+    parser.add_argument("--expect", metavar="JSONL", help="expected records, nothing is printed but the result")
+    args = parser.parse_args()
+
+    batches = compressed = 0
+    records = []
+    for name, batch in read_batches(args):
+        try:
+            decoded = decode_batch(batch)
+        except BatchError as err:
+            print("%s: %s" % (name, err), file=sys.stderr)
+            return 1
+        batches += 1
+        compressed += batch[3] & FLAG_LZ4
+        if args.expect:
+            records += decoded
+        else:
+            for record in decoded:
+                print(json.dumps(record))
+
+    if args.expect:
+        with open(args.expect) as f:
+            expected = [json.loads(line) for line in f if line.strip()]
+        for idx, (got, want) in enumerate(zip(records, expected)):
+            if got != want:
+                print("record %d differs:\n  decoded  %s\n  expected %s" % (idx, json.dumps(got), json.dumps(want)), file=sys.stderr)
+                return 1
+        if len(records) != len(expected):
+            print("%d records decoded, %d expected" % (len(records), len(expected)), file=sys.stderr)
+            return 1
+        print("round trip: ok (%d batches, %d LZ4 compressed, %d records)" % (batches, compressed, len(records)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
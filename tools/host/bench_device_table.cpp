@@ -0,0 +1,303 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// BTDeviceGroup: consistency check of the hash table (backward shift deletion, eviction) against a std::unordered_map,
+// then findOrCreateDevice / removeDevice timings compared with the previous table (vector of 16 device chunks, linear search)
+// The live values of BTDevice are checked to keep the data type and type info they were decoded with.
+
+#include <stf/bt_device.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace stf;
+
+namespace baseline {
+
+class STFATTR_PACKED BTDevice {
+public:
+  BTDevice() {
+    _whiteList = _blackList = _discovery = false;
+    _mac[0] = 0xff;
+  }
+  union STFATTR_PACKED {
+    uint8_t _mac[6];
+    uint16_t _mac16[3];
+    uint32_t _mac32[1];
+  };
+  uint8_t _reserved;
+  bool _whiteList : 1;
+  bool _blackList : 1;
+  bool _discovery : 1;
+};
+
+constexpr int ChunkSize = 16;
+
+class BTDeviceGroup {
+public:
+  BTDevice* findDevice(const uint8_t* mac) {
+    uint32_t v4 = *(const uint32_t*)mac;
+    uint16_t v2 = *(const uint16_t*)(mac + 4);
+    for (BTDevice* arr : _devices)
+      for (int idx = 0; idx < ChunkSize; idx++)
+        if (v4 == arr[idx]._mac32[0] && v2 == arr[idx]._mac16[2]) return arr + idx;
+    return nullptr;
+  }
+
+  BTDevice* findOrCreateDevice(const uint8_t* mac) {
+    BTDevice* dev = findDevice(mac);
+    if (dev != nullptr) return dev;
+    for (BTDevice* arr : _devices)
+      for (int idx = 0; idx < ChunkSize; idx++)
+        if (arr[idx]._mac[0] == 0xff) {
+          memcpy(arr[idx]._mac, mac, 6);
+          return arr + idx;
+        }
+    BTDevice* arr = new BTDevice[ChunkSize];
+    _devices.push_back(arr);
+    memcpy(arr[0]._mac, mac, 6);
+    return arr;
+  }
+
+  ~BTDeviceGroup() {
+    for (BTDevice* arr : _devices) delete[] arr;
+  }
+
+  std::vector<BTDevice*> _devices;
+};
+
+} // namespace baseline
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+static uint64_t macKey(const uint8_t* mac) {
+  uint64_t key = 0;
+  memcpy(&key, mac, 6);
+  return key;
+}
+
+static void randomMAC(std::mt19937& rnd, uint8_t* mac) {
+  for (uint idx = 0; idx < 6; idx++) mac[idx] = rnd();
+  mac[0] &= 0xfe; // 0xff is the empty marker of the baseline
+}
+
+static double nsPerOp(std::chrono::steady_clock::time_point start, uint ops) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+// Random create / find / remove against a model, kept under MaxDevices (no eviction)
+static void checkConsistency() {
+  std::mt19937 rnd(1);
+  BTDeviceGroup* group = new BTDeviceGroup();
+  std::unordered_map<uint64_t, int16_t> model; // MAC -> RSSI stored into the device
+  std::vector<uint64_t> keys;
+  hostSetTime(1000000);
+
+  for (uint op = 0; op < 200000; op++) {
+    hostAdvanceTime(1000);
+    uint choice = rnd() % 3;
+    if (choice == 0 && model.size() < BTDeviceGroup::MaxDevices - 1) {
+      uint8_t mac[6];
+      randomMAC(rnd, mac);
+      // the hash keeps only the low bits of the slot, force collisions by reusing the high part of an existing key
+      if (!keys.empty() && (rnd() & 1)) memcpy(mac, &keys[rnd() % keys.size()], 4);
+      BTDevice* dev = group->findOrCreateDevice(mac);
+      CHECK(dev != nullptr, "create failed at op %u", op);
+      if (dev == nullptr) break;
+      if (model.count(macKey(mac)) == 0) keys.push_back(macKey(mac));
+      dev->_rssi16 = model[macKey(mac)] = (int16_t)(rnd() & 0x7fff);
+    } else if (choice == 1 && !keys.empty()) {
+      uint pos = rnd() % keys.size();
+      BTDevice* dev = group->findDevice((const uint8_t*)&keys[pos]);
+      CHECK(dev != nullptr, "remove: missing device at op %u", op);
+      group->removeDevice(dev);
+      model.erase(keys[pos]);
+      keys[pos] = keys.back();
+      keys.pop_back();
+    } else if (!keys.empty()) {
+      uint64_t key = keys[rnd() % keys.size()];
+      BTDevice* dev = group->findDevice((const uint8_t*)&key);
+      CHECK(dev != nullptr && dev->_rssi16 == model[key], "find: lost or moved device at op %u", op);
+    }
+    if (op % 1000 == 0) {
+      CHECK(group->getDeviceCount() == model.size(), "count %u != %zu at op %u", group->getDeviceCount(), model.size(), op);
+      for (uint64_t key : keys) CHECK(group->findDevice((const uint8_t*)&key) != nullptr, "device lost at op %u", op);
+      uint8_t mac[6];
+      randomMAC(rnd, mac);
+      CHECK(model.count(macKey(mac)) != 0 || group->findDevice(mac) == nullptr, "unknown device found at op %u", op);
+    }
+  }
+  delete group;
+
+  // Eviction: the least recently seen one goes, the listed ones stay
+  group = new BTDeviceGroup();
+  uint8_t listed[6] = {0x10, 1, 2, 3, 4, 5};
+  group->setList(listed, EnumBTList::Allow);
+  for (uint idx = 0; idx < BTDeviceGroup::MaxDevices + 10; idx++) {
+    hostAdvanceTime(1000);
+    uint8_t mac[6] = {0x20, 0, 0, 0, (uint8_t)(idx >> 8), (uint8_t)idx};
+    group->findOrCreateDevice(mac);
+  }
+  uint8_t first[6] = {0x20, 0, 0, 0, 0, 0};
+  uint8_t last[6] = {0x20, 0, 0, 0, (uint8_t)((BTDeviceGroup::MaxDevices + 9) >> 8), (uint8_t)(BTDeviceGroup::MaxDevices + 9)};
+  CHECK(group->getDeviceCount() == BTDeviceGroup::MaxDevices, "count after eviction %u", group->getDeviceCount());
+  CHECK(group->getEvictedCount() == 11, "evicted %u", group->getEvictedCount());
+  CHECK(group->findDevice(first) == nullptr && group->findDevice(last) != nullptr, "not the oldest one was evicted");
+  CHECK(group->findDevice(listed) != nullptr, "listed device evicted");
+  delete group;
+
+  printf("consistency: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+// The live values keep the data type and type info the decoder wrote them with (bt_query publishes them so)
+static void checkValues() {
+  BTDevice dev;
+  float temp = 21.5f;
+  uint32_t tempBits;
+  memcpy(&tempBits, &temp, 4);
+  dev.setValue(edf_tempc, edt_Float, 1, tempBits);
+  dev.setValue(edf_batt, edt_32, 0, 87);
+  dev.setValue(edf_hum, edt_Float, 2, 0);
+  dev.setValue(edf_rssi, edt_32, 1, (uint32_t)-12);
+  dev.setValue(edf_batt, edt_32, 0, 86); // same field, same slot
+  dev.setValue(edf_hum, edt_32, 1, 5); // the type of the slot changes, the others keep theirs
+
+  struct Expected {
+    EnumDataField field;
+    EnumDataType type;
+    uint8_t typeInfo;
+    uint32_t value;
+  } expected[] = {{edf_tempc, edt_Float, 1, tempBits}, {edf_batt, edt_32, 0, 86}, {edf_hum, edt_32, 1, 5}, {edf_rssi, edt_32, 1, (uint32_t)-12}};
+  EnumDataField field;
+  EnumDataType type;
+  uint8_t typeInfo;
+  uint32_t value;
+  uint idx = 0;
+  for (; dev.getValue(idx, field, type, typeInfo, value); idx++) {
+    const Expected& exp = expected[idx];
+    CHECK(field == exp.field && type == exp.type && typeInfo == exp.typeInfo && value == exp.value, "value %u: field %u type %u info %u value %x", idx, field, type, typeInfo, value);
+  }
+  CHECK(idx == BTDevice::MaxValues, "%u values", idx);
+
+  dev.setValue(edf_volt, edt_Float, 2, tempBits); // all slots are used, the last one is overwritten
+  CHECK(dev.getValue(3, field, type, typeInfo, value) && field == edf_volt && type == edt_Float && typeInfo == 2, "last slot not overwritten");
+  CHECK(dev.getValue(0, field, type, typeInfo, value) && type == edt_Float && typeInfo == 1, "first slot changed");
+  dev.reset();
+  CHECK(!dev.getValue(0, field, type, typeInfo, value), "values after reset");
+
+  printf("values: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+// packets: MACs of the received packets in order
+static void benchmark(const char* name, const std::vector<uint64_t>& packets) {
+  const uint rounds = 5;
+  uint ops = packets.size() * rounds;
+
+  BTDeviceGroup* group = new BTDeviceGroup();
+  hostSetTime(1000000);
+  auto start = std::chrono::steady_clock::now();
+  for (uint round = 0; round < rounds; round++)
+    for (uint64_t key : packets) {
+      hostAdvanceTime(10000);
+      group->findOrCreateDevice((const uint8_t*)&key)->_packetCount++;
+    }
+  double hashNs = nsPerOp(start, ops);
+  uint evicted = group->getEvictedCount();
+  delete group;
+
+  baseline::BTDeviceGroup* old = new baseline::BTDeviceGroup();
+  start = std::chrono::steady_clock::now();
+  for (uint round = 0; round < rounds; round++)
+    for (uint64_t key : packets) old->findOrCreateDevice((const uint8_t*)&key)->_reserved++;
+  double oldNs = nsPerOp(start, ops);
+  uint oldDevices = old->_devices.size() * baseline::ChunkSize;
+  delete old;
+
+  printf("%-36s findOrCreateDevice %8.1f ns (hash, %u B, %u evicted) vs %9.1f ns (baseline, %u slots, %u B)\n",
+         name, hashNs, (uint)sizeof(BTDeviceGroup), evicted, oldNs, oldDevices, oldDevices * (uint)sizeof(baseline::BTDevice) + (uint)(oldDevices / baseline::ChunkSize * sizeof(void*)));
+}
+
+static void benchmarkRemove() {
+  std::mt19937 rnd(3);
+  BTDeviceGroup* group = new BTDeviceGroup();
+  std::vector<uint64_t> keys(BTDeviceGroup::MaxDevices);
+  hostSetTime(1000000);
+  const uint ops = 1000000;
+  double removeNs = 0;
+  for (uint done = 0; done < ops; done += keys.size()) {
+    for (uint64_t& key : keys) {
+      randomMAC(rnd, (uint8_t*)&key);
+      group->findOrCreateDevice((const uint8_t*)&key);
+    }
+    std::shuffle(keys.begin(), keys.end(), rnd);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t key : keys) group->removeDevice(group->findDevice((const uint8_t*)&key));
+    removeNs += nsPerOp(start, ops);
+  }
+  CHECK(group->getDeviceCount() == 0, "not empty after removing all");
+  printf("%-36s findDevice + removeDevice %.1f ns\n", "full table, random order", removeNs);
+  delete group;
+}
+
+int main() {
+  checkConsistency();
+  checkValues();
+
+  std::mt19937 rnd(2);
+  std::vector<uint64_t> fixed(40);
+  for (uint64_t& key : fixed) randomMAC(rnd, (uint8_t*)&key);
+
+  // 40 sensors in range, every packet from one of them
+  std::vector<uint64_t> packets;
+  for (uint idx = 0; idx < 200000; idx++) packets.push_back(fixed[rnd() % fixed.size()]);
+  benchmark("40 static devices", packets);
+
+  // Same sensors plus phones rotating their random addresses: 10k addresses, each seen for ~6 packets
+  packets.clear();
+  uint64_t rotating = 0;
+  uint addresses = 0;
+  for (uint idx = 0; idx < 200000; idx++) {
+    if (rnd() % 10 < 7) {
+      packets.push_back(fixed[rnd() % fixed.size()]);
+      continue;
+    }
+    if (rotating == 0 || rnd() % 6 == 0) {
+      randomMAC(rnd, (uint8_t*)&rotating);
+      addresses++;
+    }
+    packets.push_back(rotating);
+  }
+  char name[64];
+  sprintf(name, "40 static + %u rotating addresses", addresses);
+  benchmark(name, packets);
+
+  benchmarkRemove();
+  return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// FeedbackInfo::next over the retained SYSR state: the JsonTokenizer + DataField::find version compared with the previous scanner
+// (quote search, getArrayIndex per key), kept here; both walk the same FeedbackInfo set from the MQTT topic
+
+#include <stf/provider.h>
+
+#include <chrono>
+
+using namespace stf;
+
+namespace baseline {
+
+// Out of line like the original in provider.cpp
+struct FeedbackInfo : public stf::FeedbackInfo {
+  __attribute__((noinline)) bool next() {
+    if (!retained) return false;
+
+    const char *fndB, *fndE;
+    const char* str = (const char*)payload + payloadLength;
+    if (*str == '"') str++;
+
+    fieldStr = "";
+    payload = fullPayload + fullPayloadLength;
+    fieldStrLen = payloadLength = 0;
+
+    const char* pe = (const char*)payload;
+
+    fndB = Util::strchr(str, pe, '"');
+    if (fndB == nullptr) return false;
+    fndE = Util::strchr(fndB + 1, pe, '"');
+    if (fndE == nullptr) return false;
+
+    fieldStr = fndB + 1;
+    fieldStrLen = fndE - fieldStr;
+    int idx = Util::getArrayIndex(fieldStr, fieldStrLen, DataField::_list, DataField::_listNum);
+    fieldEnum = (EnumDataField)(idx >= 0 ? idx : 0);
+
+    fndB = Util::strchr(fndE, pe, ':');
+    if (fndB == nullptr) return false;
+    while (++fndB < pe && isspace(*fndB))
+      ;
+    if (fndB == pe || *fndB == '{' || *fndB == '[') return false; // not supported
+    if (*fndB != '"') { // Easy case
+      if ((fndE = Util::stranychr(fndB, pe, ",}")) == nullptr) return false;
+      while (fndB < fndE && isspace(fndE[-1])) fndE--;
+      payload = (const uint8_t*)fndB;
+      payloadLength = fndE - fndB;
+      return true;
+    }
+    for (fndE = ++fndB;;) {
+      if ((fndE = Util::strchr(fndE, pe, '"')) == nullptr) return false;
+      if (fndE[-1] != '\'') break;
+    }
+    payload = (const uint8_t*)fndB;
+    payloadLength = fndE - fndB;
+    return true;
+  }
+};
+
+} // namespace baseline
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+static const char* g_topic = "home/SimpleThing_Test/SYSRtoMQTT/EspDJ_AABBCC";
+
+// Retained state of a BT gateway, as SystemProvider and BTProvider publish it
+static const char* g_state =
+    "{\"ota\":\"OFF\",\"led\":\"ON\",\"bt_allow_only\":\"OFF\",\"bt_filter_unknown\":\"ON\",\"bt_scan_adaptive\":\"ON\",\"bt_gateway\":\"OFF\","
+    "\"bt_payload_mode\":\"hash\",\"bt_allow\":\"AABBCCDDEEFF,112233445566\",\"bt_deny\":\"\",\"uptime_s\":12345,\"free_memory\":123456}";
+
+// Same, with an escaped quote and a nested object before the last members
+static const char* g_nested =
+    "{\"ota\":\"OFF\",\"led\":\"ON\",\"name\":\"say \\\"hi\\\"\",\"stats\":{\"sent\":12,\"lost\":[1,2]},\"bt_allow_only\":\"OFF\",\"uptime_s\":12345}";
+
+template <typename INFO>
+static uint members(const char* state, uint& fieldSum) {
+  INFO info;
+  info.set(g_topic, (const uint8_t*)state, strlen(state));
+  uint count = 0;
+  for (; info.next(); count++) fieldSum += (uint)info.fieldEnum + info.payloadLength;
+  return count;
+}
+
+template <typename INFO>
+static double benchmark(const char* state, uint& sink) {
+  const uint rounds = 500000;
+  double best = 1e9;
+  for (uint run = 0; run < 5; run++) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint round = 0; round < rounds; round++) members<INFO>(state, sink);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+    if (ns < best) best = ns;
+  }
+  return best;
+}
+
+int main() {
+  static uint8_t mac[6] = {0xac, 0x67, 0xb2, 0xaa, 0xbb, 0xcc};
+  Host::_info.mac = mac; // Host::setup reads it from the efuse
+  Host::_info.macLen = sizeof(mac);
+  Host::_info.strMAC = "AC67B2AABBCC";
+
+  // The same members and field enums on the flat state
+  stf::FeedbackInfo info;
+  baseline::FeedbackInfo old;
+  info.set(g_topic, (const uint8_t*)g_state, strlen(g_state));
+  old.set(g_topic, (const uint8_t*)g_state, strlen(g_state));
+  uint count = 0;
+  for (bool more = true; more; count++) {
+    bool hasNew = info.next(), hasOld = old.next();
+    more = hasNew && hasOld;
+    CHECK(hasNew == hasOld, "member %u: end differs", count);
+    if (!more) break;
+    CHECK(info.fieldEnum == old.fieldEnum && info.fieldStrLen == old.fieldStrLen && info.payloadLength == old.payloadLength &&
+              memcmp(info.payload, old.payload, info.payloadLength) == 0,
+          "member %u (%.*s) differs", count, (int)info.fieldStrLen, info.fieldStr);
+  }
+  CHECK(count == 11 && info.fieldEnum == edf__none, "%u members of the flat state", count);
+
+  uint sink = 0;
+  uint nestedNew = members<stf::FeedbackInfo>(g_nested, sink), nestedOld = members<baseline::FeedbackInfo>(g_nested, sink);
+  CHECK(nestedNew == 6, "%u members of the nested state", nestedNew);
+
+  printf("retained state (%zu bytes, 11 members): %.0f ns (tokenizer) vs %.0f ns (previous scanner) per message\n", strlen(g_state),
+         benchmark<stf::FeedbackInfo>(g_state, sink), benchmark<baseline::FeedbackInfo>(g_state, sink));
+  printf("with escaped quotes and a nested object (%zu bytes): %.0f ns, %u of 6 members (tokenizer) vs %.0f ns, %u of 6 (previous scanner) [%u]\n",
+         strlen(g_nested), benchmark<stf::FeedbackInfo>(g_nested, sink), nestedNew, benchmark<baseline::FeedbackInfo>(g_nested, sink),
+         nestedOld, sink % 10);
+  return g_failed == 0 ? 0 : 1;
+}
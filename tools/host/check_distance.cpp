@@ -0,0 +1,123 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// BTDistance: accuracy of the interpolated table against the closed form of the model over the RSSI / txPower range
+// the reports (1/16 dB steps of the smoothed RSSI, every txPower), and the time of a call
+// Built for both models: check_distance (STFBT_DISTANCE_MODEL 0) and check_distance_model1
+
+#include <stf/bt_device.h>
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+// Closed form in double precision; model 0 with the default coefficients is the previous BTProvider::beaconDistance
+static double closedForm(double rssi, int txPower) {
+  if (txPower >= 0) txPower = STFBT_DISTANCE_TXPOWER;
+#if STFBT_DISTANCE_MODEL == 0
+  double ratio = rssi / txPower;
+  return ratio < 1.0 ? pow(ratio, 10) : STFBT_DISTANCE_COEFF_A * pow(ratio, STFBT_DISTANCE_COEFF_B) + STFBT_DISTANCE_COEFF_C;
+#else
+  return pow(10.0, (txPower - rssi) / (10.0 * STFBT_DISTANCE_PATH_LOSS));
+#endif
+}
+
+struct Error {
+  double maxRelative = 0, maxAbsolute = 0;
+  float rssi = 0;
+  int txPower = 0;
+  uint count = 0;
+
+  void add(float rssi, int txPower, double value, double expected) {
+    double absolute = fabs(value - expected);
+    if (absolute / expected > maxRelative) {
+      maxRelative = absolute / expected;
+      this->rssi = rssi;
+      this->txPower = txPower;
+    }
+    if (absolute > maxAbsolute) maxAbsolute = absolute;
+    count++;
+  }
+
+  void print(const char* name, bool relative) const {
+    if (relative)
+      printf("  %-12s max error %.4f%% (rssi %.2f, txPower %d), %.5f m absolute, %u points\n", name, maxRelative * 100, rssi, txPower,
+             maxAbsolute, count);
+    else
+      printf("  %-12s max error %.5f m, %u points\n", name, maxAbsolute, count);
+  }
+};
+
+int main() {
+  BTDistance::setup();
+
+  // Every smoothed RSSI of a beacon (1/16 dB) against every txPower it can advertise (0 and above: default)
+  Error ranges[3];
+  uint points = 0, changed = 0;
+  for (int txPower = -128; txPower <= 0; txPower++)
+    for (int rssi16 = -128 * 16; rssi16 <= 20 * 16; rssi16++) {
+      float rssi = rssi16 / 16.f;
+      double expected = closedForm(rssi, txPower);
+      float value = BTDistance::distance(rssi, txPower);
+      ranges[expected < 0.1 ? 0 : (expected <= 100 ? 1 : 2)].add(rssi, txPower, value, expected);
+      // what is sent: rounded to 2 decimals, a rounding flip at the half is fine
+      if (expected > 100) continue;
+      points++;
+      if (fabs(round(value * 100) - round(expected * 100)) > 1) changed++;
+    }
+
+  printf("model %d, table vs closed form:\n", STFBT_DISTANCE_MODEL);
+  ranges[0].print("below 0.1 m", false);
+  ranges[1].print("0.1 - 100 m", true);
+  ranges[2].print("over 100 m", true);
+  printf("  reported value (2 decimals) within 100 m off by more than 0.01 at %u of %u points\n", changed, points);
+  CHECK(ranges[0].maxAbsolute < 0.001, "table error over 1 mm below 0.1 m");
+  CHECK(ranges[1].maxRelative < 0.005, "table error over 0.5%% within 100 m");
+  CHECK(ranges[2].maxRelative < 0.005, "table error over 0.5%% above 100 m");
+  CHECK(changed == 0, "reported value changed");
+
+  // Time of a call on a typical input set
+  std::vector<float> rssis;
+  for (int rssi16 = -100 * 16; rssi16 <= -30 * 16; rssi16 += 3) rssis.push_back(rssi16 / 16.f);
+  double sink = 0;
+  const uint rounds = 200;
+  auto start = std::chrono::steady_clock::now();
+  for (uint round = 0; round < rounds; round++)
+    for (float rssi : rssis) sink += BTDistance::distance(rssi, -59 - (int)(round & 7));
+  double tableNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * rssis.size());
+  start = std::chrono::steady_clock::now();
+  for (uint round = 0; round < rounds; round++)
+    for (float rssi : rssis) sink += closedForm(rssi, -59 - (int)(round & 7));
+  double closedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * rssis.size());
+  printf("  call: %.1f ns (table) vs %.1f ns (double pow) [%d]\n", tableNs, closedNs, (int)sink % 10);
+
+  return g_failed == 0 ? 0 : 1;
+}
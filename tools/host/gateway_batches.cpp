@@ -0,0 +1,209 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// BTGateway: encodes advertisement streams into batches for the round trip check of tools/bt_gateway_decode.py
+// - writes the batches (hex, one per line) and the expected records (JSON lines) into the files given as arguments
+// - checks the flush by size and by time, the drop when the consumer is late and that both LZ4 and plain batches occur
+
+#include <stf/bt_gateway.h>
+#include <stf/provider_bt.h>
+
+#include <random>
+#include <vector>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+class GatewayProbe : public BTGateway {
+public:
+  using BTGateway::_batchTime;
+  using BTGateway::_recordCount;
+};
+
+static GatewayProbe g_gateway;
+static FILE* g_batchFile;
+static FILE* g_recordFile;
+static uint g_batches = 0, g_compressed = 0, g_records = 0, g_dropped = 0;
+static uint64_t g_plainBytes = 0, g_sentBytes = 0;
+
+// Consumer side: sends the ready batch, if any
+static bool consume() {
+  uint len = 0;
+  const uint8_t* batch = g_gateway.getBatch(len);
+  if (batch == nullptr) return false;
+  CHECK(len >= BTGateway::HeaderSize && len <= BTGateway::HeaderSize + STFBT_GATEWAY_BATCH_SIZE, "batch length %u", len);
+  for (uint idx = 0; idx < len; idx++) fprintf(g_batchFile, "%02x", batch[idx]);
+  fprintf(g_batchFile, "\n");
+  g_batches++;
+  g_compressed += batch[3] & 1;
+  g_plainBytes += BTGateway::HeaderSize + (batch[10] | batch[11] << 8);
+  g_sentBytes += len;
+  g_gateway.releaseBatch();
+  return true;
+}
+
+// Expected record in the format of tools/bt_gateway_decode.py
+static void writeRecord(const BTRawPacket& raw, uint32_t batchTime) {
+  uint32_t delta = raw.time - batchTime;
+  fprintf(g_recordFile, "{\"time\": %u, \"mac\": \"%02X:%02X:%02X:%02X:%02X:%02X\", \"addrType\": %u, \"advType\": %u, ",
+          batchTime + (delta > 0xffff ? 0xffff : delta), raw.mac[5], raw.mac[4], raw.mac[3], raw.mac[2], raw.mac[1], raw.mac[0],
+          raw.macType, raw.advType);
+  if (raw.rssi == 127)
+    fprintf(g_recordFile, "\"rssi\": null, \"payload\": \"");
+  else
+    fprintf(g_recordFile, "\"rssi\": %d, \"payload\": \"", raw.rssi);
+  for (uint idx = 0; idx < raw.payloadLength; idx++) fprintf(g_recordFile, "%02x", raw.payload[idx]);
+  fprintf(g_recordFile, delta > 0xffff ? "\", \"timeSaturated\": true}\n" : "\"}\n");
+}
+
+static bool add(const BTRawPacket& raw) {
+  if (!g_gateway.add(raw)) {
+    g_dropped++;
+    return false;
+  }
+  writeRecord(raw, g_gateway._batchTime);
+  g_records++;
+  return true;
+}
+
+// Sensors in range sending the same structure with a few changing bytes (compressible), or random noise
+struct Generator {
+  std::mt19937 rnd{1};
+  uint32_t time = 1000;
+  std::vector<BTRawPacket> devices;
+
+  Generator() {
+    devices.resize(40);
+    for (BTRawPacket& dev : devices) {
+      for (uint8_t& byte : dev.mac) byte = rnd();
+      dev.macType = rnd() % 4;
+      dev.advType = rnd() % 5;
+      static const uint8_t header[] = {0x02, 0x01, 0x06, 0x12, 0x16, 0x1a, 0x18};
+      memcpy(dev.payload, header, sizeof(header));
+      dev.payloadLength = sizeof(header) + 16;
+      for (uint idx = sizeof(header); idx < dev.payloadLength; idx++) dev.payload[idx] = rnd();
+      if (rnd() % 4 == 0) { // with scan response
+        static const uint8_t name[] = {0x09, 0x09, 'A', 'T', 'C', '_', '1', '2', '3', '4'};
+        memcpy(dev.payload + dev.payloadLength, name, sizeof(name));
+        dev.payloadLength += sizeof(name);
+      }
+    }
+  }
+
+  BTRawPacket sensor(uint32_t step) {
+    time += step;
+    BTRawPacket raw = devices[rnd() % devices.size()];
+    raw.time = time;
+    raw.payload[17] = rnd(); // measurement and counter
+    raw.payload[19]++;
+    raw.rssi = rnd() % 20 == 0 ? 127 : -(int8_t)(30 + rnd() % 70);
+    return raw;
+  }
+
+  BTRawPacket noise(uint32_t step) {
+    time += step;
+    BTRawPacket raw;
+    raw.time = time;
+    for (uint8_t& byte : raw.mac) byte = rnd();
+    raw.macType = rnd() % 16;
+    raw.advType = rnd() % 16;
+    raw.rssi = rnd();
+    raw.payloadLength = rnd() % (STFBT_QUEUE_PAYLOAD_SIZE + 1);
+    for (uint idx = 0; idx < raw.payloadLength; idx++) raw.payload[idx] = rnd();
+    return raw;
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    printf("usage: %s <batches.hex> <records.jsonl>\n", argv[0]);
+    return 2;
+  }
+  g_batchFile = fopen(argv[1], "w");
+  g_recordFile = fopen(argv[2], "w");
+  if (g_batchFile == nullptr || g_recordFile == nullptr) {
+    printf("FAILED: can't create the output files\n");
+    return 1;
+  }
+  Generator gen;
+
+  // Busy gateway: the batches are flushed by size
+  for (uint idx = 0; idx < 20000; idx++) {
+    add(gen.rnd() % 5 != 0 ? gen.sensor(gen.rnd() % 4) : gen.noise(gen.rnd() % 4));
+    g_gateway.update(gen.time);
+    consume();
+  }
+  CHECK(g_dropped == 0, "%u dropped while the consumer kept up", g_dropped);
+
+  // Quiet gateway: the batches are flushed by time, each one at its third record
+  uint batches = g_batches;
+  for (uint idx = 0; idx < 100; idx++) {
+    add(gen.sensor(STFBT_GATEWAY_FLUSH_TIME / 2 + 1));
+    g_gateway.update(gen.time);
+    consume();
+  }
+  CHECK(g_batches - batches >= 30, "%u batches flushed by time instead of ~33", g_batches - batches);
+
+  // Noise only: the batches don't compress and are sent as they are
+  uint compressed = g_compressed;
+  batches = g_batches;
+  for (uint idx = 0; idx < 2000; idx++) {
+    add(gen.noise(1));
+    g_gateway.update(gen.time);
+    consume();
+  }
+  CHECK(g_compressed == compressed && g_batches > batches, "noise batches are compressed");
+
+  // Late consumer: one batch waits, the next one fills, the rest is dropped
+  for (uint idx = 0; idx < 3000; idx++) {
+    add(gen.sensor(0));
+    g_gateway.update(gen.time);
+  }
+  CHECK(g_dropped != 0 && g_dropped < 3000, "%u dropped while the consumer was late", g_dropped);
+  uint dropped = g_dropped;
+  CHECK(consume() && add(gen.sensor(0)) && g_dropped == dropped, "not recovered after the consumer caught up");
+
+  // Gateway without update calls: the time delta saturates within a batch
+  for (uint idx = 0; idx < 200; idx++) {
+    add(gen.sensor(30000));
+    consume();
+  }
+
+  g_gateway.update(gen.time + STFBT_GATEWAY_FLUSH_TIME);
+  consume();
+  uint len = 0;
+  CHECK(g_gateway._recordCount == 0 && g_gateway.getBatch(len) == nullptr, "records left in the gateway");
+  CHECK(g_batches == g_gateway._batchesSent, "batch count %u != %u", g_batches, g_gateway._batchesSent);
+  fclose(g_batchFile);
+  fclose(g_recordFile);
+
+  printf("encoded: %u records in %u batches (%u LZ4, %u plain), %u dropped, %llu bytes sent instead of %llu (%.1f%%)\n",
+         g_records, g_batches, g_compressed, g_batches - g_compressed, g_dropped, (unsigned long long)g_sentBytes,
+         (unsigned long long)g_plainBytes, 100.0 * g_sentBytes / g_plainBytes);
+  return g_failed == 0 ? 0 : 1;
+}
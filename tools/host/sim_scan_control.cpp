@@ -0,0 +1,179 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// BTScanController driven by a simulated packet source: advertisers heard in proportion to the scan duty cycle, the raw
+// queue of the BT task, the forwarded messages in the BT buffer and the MQTT consumer draining it (stopped at a WiFi outage)
+// Every scenario checks where the window settles; "-v" prints every control period
+
+#include <stf/bt_scan.h>
+#include <stf/provider_bt.h>
+
+#include <random>
+#include <string.h>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+static bool g_verbose = false;
+
+struct Scenario {
+  const char* name;
+  double advertisements; // per second in range, all of them heard at 100% duty cycle
+  double forwardRatio; // part of the processed packets forwarded (the rest is filtered, deduplicated)
+  double drain; // messages/s the MQTT consumer sends
+  uint32_t outageFrom, outageTo; // WiFi outage (ms), no drain
+  bool adaptive;
+  uint process; // packets the BT task processes in a tick (of 10 ms)
+};
+
+struct Result {
+  uint16_t finalWindow;
+  uint16_t minWindow, maxWindow; // in the second half
+  double avgDuty;
+  double scannedRate, forwardedRate;
+  uint32_t dropped; // raw queue overflow
+  uint32_t lost; // no room in the buffer
+  uint32_t maxFill;
+  uint32_t windowAt[64]; // at the end of each control period
+};
+
+constexpr uint32_t Tick = 10; // ms, the period of the BT task when it's busy
+constexpr uint32_t Duration = 300000;
+constexpr uint BufferSize = 64; // btBuffer of the esp32 environments
+constexpr uint MessageBlocks = 4; // blocks of a forwarded packet
+
+static Result simulate(const Scenario& sc) {
+  std::mt19937 rnd(7);
+  BTScanController ctrl;
+  ctrl._adaptive = sc.adaptive;
+  Result res;
+  memset(&res, 0, sizeof(res));
+  res.minWindow = 0xffff;
+
+  uint queue = 0, usedBlocks = 0;
+  double drainCredit = 0, dutySum = 0;
+  uint32_t periodTime = 0, scanned = 0, forwarded = 0, dropped = 0, totalScanned = 0, totalForwarded = 0;
+  std::bernoulli_distribution forward(sc.forwardRatio);
+  for (uint32_t now = 0; now < Duration; now += Tick) {
+    // Radio: heard in proportion of the duty cycle, into the raw queue
+    std::poisson_distribution<uint> heard(sc.advertisements * ctrl.getDutyCycle() / 100 * Tick / 1000);
+    for (uint cnt = heard(rnd); cnt != 0; cnt--)
+      if (queue < STFBT_QUEUE_SIZE)
+        queue++;
+      else
+        dropped++;
+
+    // BT task: processes the queue, forwards some of the packets into the buffer
+    for (uint cnt = 0; cnt < sc.process && queue != 0; cnt++, queue--) {
+      scanned++;
+      if (!forward(rnd)) continue;
+      forwarded++;
+      if (usedBlocks + MessageBlocks <= BufferSize)
+        usedBlocks += MessageBlocks;
+      else
+        res.lost++;
+    }
+
+    // MQTT consumer
+    if (now < sc.outageFrom || now >= sc.outageTo) drainCredit += sc.drain * Tick / 1000;
+    for (; drainCredit >= 1 && usedBlocks != 0; drainCredit--) usedBlocks -= MessageBlocks;
+    if (usedBlocks == 0 && drainCredit > 1) drainCredit = 1;
+    uint32_t fill = usedBlocks * 100 / BufferSize;
+    if (fill > res.maxFill) res.maxFill = fill;
+
+    // Control, as BTProvider::controlScan
+    dutySum += ctrl.getDutyCycle();
+    periodTime += Tick;
+    if (periodTime >= STFBT_SCAN_CONTROL_PERIOD) {
+      BTScanLoad load = {scanned, forwarded, dropped, (uint16_t)(BufferSize - usedBlocks), (uint16_t)BufferSize};
+      ctrl.update(periodTime, load);
+      if (g_verbose)
+        printf("    %6.1f s  scanned %4u  forwarded %4u  dropped %4u  fill %3u%%  -> window %u ms\n", (now + Tick) / 1000.0, scanned, forwarded,
+               dropped, fill, ctrl.getWindow());
+      uint period = now / STFBT_SCAN_CONTROL_PERIOD;
+      if (period < 64) res.windowAt[period] = ctrl.getWindow();
+      res.dropped += dropped;
+      totalScanned += scanned;
+      totalForwarded += forwarded;
+      periodTime = scanned = forwarded = dropped = 0;
+    }
+    if (now >= Duration / 2) {
+      if (ctrl.getWindow() < res.minWindow) res.minWindow = ctrl.getWindow();
+      if (ctrl.getWindow() > res.maxWindow) res.maxWindow = ctrl.getWindow();
+    }
+  }
+  res.finalWindow = ctrl.getWindow();
+  res.avgDuty = dutySum / (Duration / Tick);
+  res.scannedRate = totalScanned * 1000.0 / Duration;
+  res.forwardedRate = totalForwarded * 1000.0 / Duration;
+  printf("  %-38s window %2u ms (%2u-%2u in the 2nd half), duty %4.1f%%, scanned %6.1f/s, forwarded %5.1f/s, dropped %u, lost %u, max fill %u%%\n",
+         sc.name, res.finalWindow, res.minWindow, res.maxWindow, res.avgDuty, res.scannedRate, res.forwardedRate, res.dropped, res.lost, res.maxFill);
+  return res;
+}
+
+int main(int argc, char** argv) {
+  g_verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+  printf("scan control, %u s simulated, interval %u ms, window %u-%u ms:\n", Duration / 1000, STFBT_SCAN_INTERVAL, STFBT_SCAN_WINDOW_MIN,
+         STFBT_SCAN_WINDOW_MAX);
+
+  // Few sensors: widens to the maximum and stays
+  Result res = simulate({"quiet home (30 adv/s)", 30, 0.5, 50, 0, 0, true, 20});
+  CHECK(res.minWindow == STFBT_SCAN_WINDOW_MAX && res.dropped == 0, "quiet: not at the maximum window");
+
+  // Crowded place: backs off to the minimum, the queue doesn't overflow there
+  res = simulate({"crowded hall (3000 adv/s)", 3000, 0.05, 50, 0, 0, true, 20});
+  CHECK(res.maxWindow == STFBT_SCAN_WINDOW_MIN, "crowded: not at the minimum window");
+  CHECK(res.windowAt[1] == STFBT_SCAN_WINDOW_MIN, "crowded: slow back off (%u ms after 10 s)", res.windowAt[1]);
+
+  // Moderate load: settles between the limits (scanned below STFBT_SCAN_SCANNED_HIGH)
+  res = simulate({"busy street (800 adv/s)", 800, 0.05, 50, 0, 0, true, 20});
+  CHECK(res.minWindow > STFBT_SCAN_WINDOW_MIN && res.maxWindow < STFBT_SCAN_WINDOW_MAX && res.scannedRate < STFBT_SCAN_SCANNED_HIGH,
+        "moderate: not settled between the limits");
+
+  // Many forwarded packets: the forward rate limits it (~MQTT messages)
+  res = simulate({"many known sensors (400 adv/s)", 400, 0.5, 100, 0, 0, true, 20});
+  CHECK(res.forwardedRate < STFBT_SCAN_FORWARD_HIGH && res.maxWindow < STFBT_SCAN_WINDOW_MAX, "forwarding: not limited");
+
+  // WiFi outage between 60 and 120 s: the buffer fills, backs off, widens again after
+  res = simulate({"wifi outage 60-120 s (60 adv/s)", 60, 0.3, 50, 60000, 120000, true, 20});
+  CHECK(res.windowAt[11] == STFBT_SCAN_WINDOW_MAX, "outage: not at the maximum before (%u ms)", res.windowAt[11]);
+  CHECK(res.windowAt[23] == STFBT_SCAN_WINDOW_MIN, "outage: no back off (%u ms)", res.windowAt[23]);
+  CHECK(res.finalWindow == STFBT_SCAN_WINDOW_MAX, "outage: not recovered (%u ms)", res.finalWindow);
+
+  // Adaptive scan switched off: fixed window whatever happens
+  res = simulate({"crowded hall, not adaptive", 3000, 0.05, 50, 0, 0, false, 20});
+  CHECK(res.minWindow == STFBT_SCAN_WINDOW && res.maxWindow == STFBT_SCAN_WINDOW, "not adaptive: window changed");
+  CHECK(res.scannedRate > STFBT_SCAN_SCANNED_HIGH, "not adaptive: below the scan limit");
+
+  // BT task slower than the radio (200 packets/s): the raw queue overflows, less with the adaptive window
+  Result fixed = simulate({"crowded hall, slow task, not adaptive", 3000, 0.05, 50, 0, 0, false, 2});
+  res = simulate({"crowded hall, slow task", 3000, 0.05, 50, 0, 0, true, 2});
+  CHECK(res.finalWindow == STFBT_SCAN_WINDOW_MIN && res.dropped * 3 < fixed.dropped, "slow task: drops %u vs %u", res.dropped, fixed.dropped);
+
+  return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Host stand-in of the Arduino core for the harnesses in tools/host, only what the portable modules use
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/types.h>
+
+typedef uint8_t byte;
+#define LED_BUILTIN 2
+
+struct HostSerial {
+  int printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+  size_t write(char chr);
+  size_t write(const char* str);
+  size_t write(const uint8_t* data, size_t len);
+  void begin(int baud) {}
+};
+extern HostSerial Serial;
+
+struct HostESP {
+  uint32_t getFreeHeap() { return 200000; }
+  uint32_t getHeapSize() { return 300000; }
+  void restart() { exit(0); }
+};
+extern HostESP ESP;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+int64_t esp_timer_get_time();
+void esp_efuse_mac_get_default(uint8_t* mac);
+
+// Simulated clock: after hostSetTime() the time functions give back the set value (delay() advances it), hostRealTime() switches back
+void hostSetTime(int64_t us);
+void hostAdvanceTime(int64_t us);
+void hostRealTime();
+
+void setup();
+void loop();
+
+class String {
+public:
+  String(const char* str = "") : _str(str) {}
+  const char* c_str() const { return _str; }
+
+protected:
+  const char* _str;
+};
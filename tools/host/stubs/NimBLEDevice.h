@@ -0,0 +1,74 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// No-op scanner, the host harnesses feed the packets directly
+
+#pragma once
+
+#include <Arduino.h>
+
+class NimBLEAddress {
+public:
+  uint8_t getType() const { return 0; }
+  const uint8_t* getNative() const { return _mac; }
+
+protected:
+  uint8_t _mac[6] = {};
+};
+
+class NimBLEAdvertisedDevice {
+public:
+  NimBLEAddress getAddress() { return NimBLEAddress(); }
+  uint8_t getAdvType() { return 0; }
+  uint8_t* getPayload() { return nullptr; }
+  size_t getPayloadLength() { return 0; }
+  bool haveRSSI() { return false; }
+  int getRSSI() { return 0; }
+};
+
+class NimBLEAdvertisedDeviceCallbacks {
+public:
+  virtual ~NimBLEAdvertisedDeviceCallbacks() {}
+  virtual void onResult(NimBLEAdvertisedDevice* device) = 0;
+};
+
+class NimBLEScan {
+public:
+  bool isScanning() { return false; }
+  bool start(uint32_t duration, void (*onEnd)(void*), bool isContinue) { return true; }
+  bool stop() { return true; }
+  void setActiveScan(bool active) {}
+  void setInterval(uint16_t interval) {}
+  void setWindow(uint16_t window) {}
+  void setMaxResults(uint8_t maxResults) {}
+  void setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks* callbacks, bool wantDuplicates) {}
+  void setDuplicateFilter(bool enabled) {}
+  void clearDuplicateCache() {}
+};
+
+class NimBLEDevice {
+public:
+  static bool getInitialized() { return true; }
+  static void setScanFilterMode(uint8_t mode) {}
+  static void setScanDuplicateCacheSize(uint16_t size) {}
+  static void init(const char* name) {}
+  static NimBLEScan* getScan() {
+    static NimBLEScan scan;
+    return &scan;
+  }
+};
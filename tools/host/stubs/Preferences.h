@@ -0,0 +1,35 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+class Preferences {
+public:
+  bool begin(const char* name, bool readOnly = false) { return true; }
+  void end() {}
+  int32_t getInt(const char* key, int32_t def = 0) { return def; }
+  size_t putInt(const char* key, int32_t value) { return 4; }
+  size_t getBytes(const char* key, void* buffer, size_t len) { return 0; }
+  size_t putBytes(const char* key, const void* buffer, size_t len) { return len; }
+  size_t getBytesLength(const char* key) { return 0; }
+  bool remove(const char* key) { return true; }
+  uint8_t getUChar(const char* key, uint8_t def = 0) { return def; }
+  size_t putUChar(const char* key, uint8_t value) { return 1; }
+};
@@ -0,0 +1,49 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// SPIFFS backed by the files of a host directory (hostSetSPIFFSRoot, default: current directory)
+
+#pragma once
+
+#include <Arduino.h>
+
+class File {
+public:
+  File(FILE* file = nullptr) : _file(file) {}
+
+  explicit operator bool() const { return _file != nullptr; }
+  size_t size();
+  size_t read(uint8_t* data, size_t len);
+  bool seek(uint32_t pos);
+  size_t write(const uint8_t* data, size_t len);
+  void close();
+
+protected:
+  FILE* _file;
+};
+
+struct HostSPIFFS {
+  bool begin(bool formatOnFail) { return true; }
+  File open(const char* name, const char* mode);
+  bool exists(const char* name);
+  bool remove(const char* name);
+  bool rename(const char* from, const char* to);
+};
+extern HostSPIFFS SPIFFS;
+
+void hostSetSPIFFSRoot(const char* dir);
@@ -0,0 +1,43 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+class IPAddress {
+public:
+  uint8_t operator[](int idx) const { return _ip[idx]; }
+  uint8_t& operator[](int idx) { return _ip[idx]; }
+
+protected:
+  uint8_t _ip[4] = {127, 0, 0, 1};
+};
+
+#define WIFI_STA 1
+
+struct HostWiFi {
+  bool isConnected() { return true; }
+  const char* getHostname() { return "host"; }
+  void setHostname(const char*) {}
+  void mode(int) {}
+  void begin(const char*, const char*) {}
+  IPAddress localIP() { return IPAddress(); }
+  int RSSI() { return -50; }
+};
+extern HostWiFi WiFi;
@@ -0,0 +1,54 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+
+#include <pthread.h>
+
+typedef void* xSemaphoreHandle;
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY      0xffffffff
+#define pdPASS             1
+#define tskNO_AFFINITY     0x7fffffff
+#define portNUM_PROCESSORS 2
+
+inline void* xSemaphoreCreateMutex() {
+  pthread_mutex_t* mutex = new pthread_mutex_t;
+  pthread_mutex_init(mutex, nullptr);
+  return mutex;
+}
+inline void vSemaphoreDelete(void* handle) { delete (pthread_mutex_t*)handle; }
+inline int xSemaphoreTake(void* handle, unsigned) { return pthread_mutex_lock((pthread_mutex_t*)handle) == 0 ? pdPASS : 0; }
+inline int xSemaphoreGive(void* handle) { return pthread_mutex_unlock((pthread_mutex_t*)handle) == 0 ? pdPASS : 0; }
+inline int xPortGetCoreID() { return 0; }
+int xTaskCreatePinnedToCore(void (*fn)(void*), const char* name, unsigned stack, void* param, int priority, TaskHandle_t* handle, int core);
+
+// The C11 atomics of the ESP32 toolchain (DataBuffer indexes), by the GCC builtins
+#ifndef __ATOMIC_VAR_INIT
+enum memory_order {
+  memory_order_relaxed = __ATOMIC_RELAXED,
+  memory_order_acquire = __ATOMIC_ACQUIRE,
+  memory_order_release = __ATOMIC_RELEASE,
+  memory_order_seq_cst = __ATOMIC_SEQ_CST
+};
+#  define atomic_load_explicit(object, order)         __atomic_load_n(&(object)->__val, order)
+#  define atomic_store_explicit(object, value, order) __atomic_store_n(&(object)->__val, value, order)
+#endif
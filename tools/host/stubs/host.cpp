@@ -0,0 +1,123 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <stf/os.h>
+
+#include <stdarg.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+
+HostSerial Serial;
+HostESP ESP;
+HostWiFi WiFi;
+HostSPIFFS SPIFFS;
+
+static int64_t g_fakeTimeUS = -1;
+static std::string g_spiffsRoot = ".";
+
+int HostSerial::printf(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int res = vprintf(fmt, args);
+  va_end(args);
+  return res;
+}
+
+size_t HostSerial::write(char chr) { return fwrite(&chr, 1, 1, stdout); }
+size_t HostSerial::write(const char* str) { return fwrite(str, 1, strlen(str), stdout); }
+size_t HostSerial::write(const uint8_t* data, size_t len) { return fwrite(data, 1, len, stdout); }
+
+int64_t esp_timer_get_time() {
+  if (g_fakeTimeUS >= 0) return g_fakeTimeUS;
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+uint32_t millis() { return (uint32_t)(esp_timer_get_time() / 1000); }
+uint32_t micros() { return (uint32_t)esp_timer_get_time(); }
+
+void delay(uint32_t ms) {
+  if (g_fakeTimeUS >= 0)
+    g_fakeTimeUS += ms * 1000LL;
+  else
+    usleep(ms * 1000);
+}
+
+void hostSetTime(int64_t us) { g_fakeTimeUS = us; }
+void hostAdvanceTime(int64_t us) { g_fakeTimeUS += us; }
+void hostRealTime() { g_fakeTimeUS = -1; }
+
+void esp_efuse_mac_get_default(uint8_t* mac) {
+  static const uint8_t hostMAC[6] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01};
+  memcpy(mac, hostMAC, 6);
+}
+
+int xTaskCreatePinnedToCore(void (*fn)(void*), const char* name, unsigned stack, void* param, int priority, TaskHandle_t* handle, int core) {
+  return 0; // the harnesses call the loops themselves
+}
+
+// SPIFFS
+
+void hostSetSPIFFSRoot(const char* dir) { g_spiffsRoot = dir; }
+
+static std::string hostPath(const char* name) { return g_spiffsRoot + name; }
+
+File HostSPIFFS::open(const char* name, const char* mode) {
+  std::string flags = mode;
+  const char* hostMode = flags == "w" ? "wb" : flags == "a" ? "ab" : flags == "r+" ? "r+b" : "rb";
+  return File(fopen(hostPath(name).c_str(), hostMode));
+}
+
+bool HostSPIFFS::exists(const char* name) { return access(hostPath(name).c_str(), F_OK) == 0; }
+bool HostSPIFFS::remove(const char* name) { return unlink(hostPath(name).c_str()) == 0; }
+bool HostSPIFFS::rename(const char* from, const char* to) { return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0; }
+
+size_t File::size() {
+  long pos = ftell(_file);
+  fseek(_file, 0, SEEK_END);
+  long size = ftell(_file);
+  fseek(_file, pos, SEEK_SET);
+  return size;
+}
+
+size_t File::read(uint8_t* data, size_t len) { return fread(data, 1, len, _file); }
+bool File::seek(uint32_t pos) { return fseek(_file, pos, SEEK_SET) == 0; }
+size_t File::write(const uint8_t* data, size_t len) { return fwrite(data, 1, len, _file); }
+
+void File::close() {
+  if (_file != nullptr) fclose(_file);
+  _file = nullptr;
+}
+
+// LED events, task_led.cpp is not built for the host
+
+void stf::Host::ledPlayEvent(int event) {}
+void stf::Host::ledRegisterEvents() {}
+
+// MQTT settings of the network task, task_wifi.cpp is not built for the host (the harnesses point them to their broker)
+
+const char* stf::NetTask::_mqttServer = "127.0.0.1";
+const char* stf::NetTask::_mqttPort = "1883";
+const char* stf::NetTask::_mqttUser = "mqtt";
+const char* stf::NetTask::_mqttPassword = "";
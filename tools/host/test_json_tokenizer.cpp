@@ -0,0 +1,199 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// JsonTokenizer fuzz test: random objects (escapes, nested values, whitespace) against the members they were generated from,
+// then mutations of them (truncation, replaced bytes) in exact size heap buffers, so a sanitizer build catches any overread
+// (make BUILD=build-asan OPT="-O1 -g -fsanitize=address,undefined" run)
+
+#include <stf/json_tokenizer.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+static std::mt19937 g_rnd(1);
+
+static uint rnd(uint n) { return g_rnd() % n; }
+
+struct Member {
+  std::string key;
+  std::string value; // span: string content without the quotes, otherwise the whole value
+  EJsonType type;
+
+  bool operator==(const Member& other) const { return key == other.key && value == other.value && type == other.type; }
+};
+
+// Content of a string with escapes, \' is not special (the previous scanner stopped at \")
+static std::string randomString() {
+  std::string str;
+  for (uint idx = rnd(10); idx != 0; idx--) {
+    uint kind = rnd(12);
+    if (kind == 0)
+      str += "\\\"";
+    else if (kind == 1)
+      str += "\\\\";
+    else if (kind == 2)
+      str += "'";
+    else if (kind == 3)
+      str += "\\u00e9";
+    else if (kind == 4)
+      str += "{[,:]}";
+    else
+      str += (char)('a' + rnd(26));
+  }
+  return str;
+}
+
+static std::string space() {
+  static const char* spaces[] = {"", "", " ", "\n\t", "\r\n  "};
+  return spaces[rnd(5)];
+}
+
+static std::string randomValue(uint depth, EJsonType& type) {
+  static const char* numbers[] = {"0", "-1", "12.5", "1e10", "-0.25E-3", "42", "3.0e+2"};
+  static const char* literals[] = {"true", "false", "null"};
+  switch (rnd(depth > 3 ? 4 : 6)) {
+    case 0:
+      type = EJsonType::String;
+      return "\"" + randomString() + "\"";
+    case 1:
+      type = EJsonType::Number;
+      return numbers[rnd(7)];
+    case 2:
+      type = EJsonType::Literal;
+      return literals[rnd(3)];
+    case 3:
+      type = EJsonType::Number;
+      return std::to_string(rnd(100000));
+    case 4: {
+      type = EJsonType::Object;
+      std::string str = "{" + space();
+      for (uint idx = 0, count = rnd(4); idx < count; idx++) {
+        EJsonType inner;
+        str += (idx ? "," : "") + space() + "\"" + randomString() + "\"" + space() + ":" + space() + randomValue(depth + 1, inner) + space();
+      }
+      return str + "}";
+    }
+    default: {
+      type = EJsonType::Array;
+      std::string str = "[" + space();
+      for (uint idx = 0, count = rnd(4); idx < count; idx++) {
+        EJsonType inner;
+        str += (idx ? "," : "") + space() + randomValue(depth + 1, inner) + space();
+      }
+      return str + "]";
+    }
+  }
+}
+
+// Tokenizes a copy of the input in an exact size buffer, checks that the spans are in the input and have the form of their type
+static std::vector<Member> tokenize(const std::string& input, bool& failed) {
+  std::vector<Member> members;
+  char* buffer = (char*)malloc(input.size() + 1);
+  memcpy(buffer, input.data(), input.size());
+  JsonTokenizer json;
+  json.start(buffer, input.size());
+  const char* end = buffer + input.size();
+  for (uint guard = 0; json.next(); guard++) {
+    bool inside = json._key > buffer && json._key + json._keyLen < end && json._value >= buffer && json._value + json._valueLen <= end;
+    CHECK(inside && guard <= input.size(), "span out of the input: %s", input.c_str());
+    if (!inside) break;
+    Member member = {std::string(json._key, json._keyLen), std::string(json._value, json._valueLen), json._type};
+    char first = json._valueLen ? json._value[0] : 0, last = json._valueLen ? json._value[json._valueLen - 1] : 0;
+    bool shaped = json._key[-1] == '"' && json._key[json._keyLen] == '"';
+    if (json._type == EJsonType::String)
+      shaped = shaped && json._value[-1] == '"' && json._value[json._valueLen] == '"';
+    else if (json._type == EJsonType::Object)
+      shaped = shaped && first == '{' && last == '}';
+    else if (json._type == EJsonType::Array)
+      shaped = shaped && first == '[' && last == ']';
+    else if (json._type == EJsonType::Literal)
+      shaped = shaped && (member.value == "true" || member.value == "false" || member.value == "null");
+    else if (json._type == EJsonType::Number) {
+      char* numEnd;
+      strtod(member.value.c_str(), &numEnd);
+      shaped = shaped && json._valueLen != 0 && *numEnd == 0;
+    } else
+      shaped = false;
+    CHECK(shaped, "malformed member %s: %s", member.key.c_str(), input.c_str());
+    members.push_back(member);
+  }
+  failed = json.isFailed();
+  CHECK(!json.next(), "next after the end");
+  free(buffer);
+  return members;
+}
+
+int main() {
+  const uint objects = 200000;
+  uint mutations = 0, rejected = 0, checks = 0;
+  for (uint round = 0; round < objects && g_failed < 10; round++) {
+    std::vector<Member> expected;
+    std::string input = space() + "{";
+    for (uint idx = 0, count = rnd(7); idx < count; idx++) {
+      Member member;
+      member.key = randomString();
+      std::string value = randomValue(0, member.type);
+      member.value = member.type == EJsonType::String ? value.substr(1, value.size() - 2) : value;
+      expected.push_back(member);
+      input += (idx ? "," : "") + space() + "\"" + member.key + "\"" + space() + ":" + space() + value + space();
+    }
+    input += "}" + space();
+
+    bool failed;
+    std::vector<Member> members = tokenize(input, failed);
+    CHECK(!failed && members == expected, "valid object: %zu of %zu members, failed %d: %s", members.size(), expected.size(), failed, input.c_str());
+    checks++;
+
+    // Truncated: the members before the cut are the same, the one at the cut may be shorter (a number), then it fails
+    uint closing = input.rfind('}');
+    for (uint idx = 0; idx < 4; idx++, mutations++) {
+      uint len = rnd(closing + 1);
+      std::vector<Member> part = tokenize(input.substr(0, len), failed);
+      bool prefix = part.size() <= expected.size();
+      for (uint pos = 0; prefix && pos < part.size(); pos++)
+        prefix = part[pos] == expected[pos] || (pos + 1 == part.size() && part[pos].type == EJsonType::Number && part[pos].key == expected[pos].key);
+      CHECK(failed && prefix, "truncated at %u: %s", len, input.c_str());
+      rejected += failed;
+    }
+
+    // Replaced bytes: anything may happen but reading out of the input
+    for (uint idx = 0; idx < 4; idx++, mutations++) {
+      std::string mutated = input;
+      for (uint cnt = 1 + rnd(3); cnt != 0; cnt--) mutated[rnd(mutated.size())] = "{}[]\",:\\ a0-\x01"[rnd(14)];
+      tokenize(mutated, failed);
+      rejected += failed;
+    }
+  }
+  printf("json tokenizer: %u generated objects %s, %u mutations (%u rejected) without a span out of the input\n", objects,
+         g_failed ? "FAILED" : "ok", mutations, rejected);
+  return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,817 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// MQTTClient against a broker stand-in on a loopback TCP socket (built for MQTT 3.1.1 and for MQTT 5 with 2 topic aliases)
+// - CONNECT / CONNACK, pipelined QoS1 publishes with PUBACK, partial writes, keep alive and PUBACK timeouts,
+//   requeue of the unsent publishes at a connection loss
+// - throughput and latency compared with the previous synchronous publish (PubSubClient: blocking socket, one
+//   message written at a time) on a slow link, and the QoS1 window compared with one publish at a time on a link with RTT
+
+#include <stf/link_mqtt_client.h>
+#include <stf/util.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+class ClientProbe : public MQTTClient {
+public:
+  using MQTTClient::_inflightCount;
+  using MQTTClient::_keepAlive;
+  using MQTTClient::_output;
+  using MQTTClient::_pingPending;
+  using MQTTClient::_outputLength;
+  using MQTTClient::_outputSent;
+  using MQTTClient::_socket;
+  using MQTTClient::_window;
+};
+
+struct BrokerMessage {
+  std::string topic;
+  std::string payload;
+  uint8_t qos;
+  bool retain;
+  uint16_t alias; // 0 - no Topic Alias property
+  bool topicSent; // false: alias only
+};
+
+// Single connection MQTT 3.1.1 / 5 broker, enough for the client: it answers CONNECT, PUBLISH (QoS1), PINGREQ, SUBSCRIBE
+// and UNSUBSCRIBE, resolves the topic aliases and counts the protocol errors of the client
+class FakeBroker {
+public:
+  FakeBroker() {
+    _listen = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1, rcvBuf = 2048; // small socket buffers, so a stopped reader blocks the client soon (inherited by accept)
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(_listen, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(_listen, (sockaddr*)&addr, len) != 0 || ::listen(_listen, 4) != 0 || getsockname(_listen, (sockaddr*)&addr, &len) != 0) {
+      printf("FAILED: broker socket: %s\n", strerror(errno));
+      exit(1);
+    }
+    fcntl(_listen, F_SETFL, O_NONBLOCK);
+    sprintf(_port, "%u", ntohs(addr.sin_port));
+  }
+  ~FakeBroker() {
+    drop(false);
+    close(_listen);
+  }
+
+  // Accepts the client, answers the due acks, reads (if _reading) and handles the complete packets; never blocks
+  void poll() {
+    if (_conn < 0 && (_conn = accept(_listen, nullptr, nullptr)) >= 0) {
+      fcntl(_conn, F_SETFL, O_NONBLOCK);
+      int one = 1; // the acks are not held back by Nagle (like mosquitto)
+      setsockopt(_conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      _in.clear();
+      _connected = false;
+    }
+    if (_conn < 0) return;
+    sendDueAcks();
+    uint8_t buffer[1024];
+    while (_reading) {
+      uint budget = sizeof(buffer);
+      if (_readRate != 0) { // slow link: the bytes allowed since the start of the transfer
+        uint64_t allowed = (std::chrono::steady_clock::now() - _rateStart).count() * _readRate / 1000000000ULL;
+        if (allowed <= _rateRead) break;
+        budget = std::min<uint64_t>(budget, allowed - _rateRead);
+      }
+      int len = recv(_conn, buffer, budget, 0);
+      if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop(false); // closed by the client
+        break;
+      }
+      _rateRead += len;
+      _bytes += len;
+      _in.insert(_in.end(), buffer, buffer + len);
+      parse();
+    }
+  }
+
+  // Waits for data (at most 1 ms) then polls, for the broker thread of the benchmarks
+  void wait() {
+    pollfd fd = {_conn >= 0 ? _conn : _listen, POLLIN, 0};
+    ::poll(&fd, 1, 1);
+    this->poll();
+  }
+
+  // Closes the connection, reset: RST instead of FIN (nothing more is accepted from the client)
+  void drop(bool reset) {
+    if (_conn < 0) return;
+    if (reset) {
+      linger lng = {1, 0};
+      setsockopt(_conn, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+    }
+    close(_conn);
+    _conn = -1;
+    _connected = false;
+    _acks.clear();
+  }
+
+  void startRate(uint bytesPerSec) {
+    _readRate = bytesPerSec;
+    _rateStart = std::chrono::steady_clock::now();
+    _rateRead = 0;
+  }
+
+  void releaseAcks() {
+    for (Ack& ack : _acks) ack.due = std::chrono::steady_clock::time_point();
+    sendDueAcks();
+  }
+
+  const char* port() const { return _port; }
+
+  // Settings
+  bool _reading = true;
+  bool _ackPublish = true; // false: the PUBACKs are held till releaseAcks()
+  bool _answerPing = true;
+  uint _ackDelayUS = 0; // emulated round trip of the QoS1 publishes
+  uint16_t _topicAliasMax = 0; // MQTT 5 CONNACK property, 0 - not sent
+
+  // Observed
+  std::vector<BrokerMessage> _messages; // written by the broker thread in the benchmarks, read after it stopped
+  AtomicCounter _messageCount; // read while the broker thread runs
+  uint64_t _bytes = 0;
+  uint _connects = 0;
+  uint _pings = 0;
+  uint _subscribes = 0;
+  uint _unsubscribes = 0;
+  uint _errors = 0; // protocol errors of the client
+  uint8_t _protocol = 0;
+  uint16_t _keepAlive = 0;
+  std::string _clientId;
+  bool _connected = false;
+
+protected:
+  struct Ack {
+    uint16_t packetId;
+    std::chrono::steady_clock::time_point due;
+  };
+
+  void parse() {
+    for (;;) {
+      uint remaining = 0, pos = 1;
+      for (uint shift = 0;; shift += 7) {
+        if (pos >= _in.size()) return;
+        uint8_t chr = _in[pos++];
+        remaining |= (chr & 0x7f) << shift;
+        if ((chr & 0x80) == 0) break;
+      }
+      if (_in.size() < pos + remaining) return;
+      handle(_in[0], _in.data() + pos, remaining);
+      _in.erase(_in.begin(), _in.begin() + pos + remaining);
+    }
+  }
+
+  void handle(uint8_t header, const uint8_t* body, uint len) {
+    switch (header >> 4) {
+      case 1: { // CONNECT
+        _connects++;
+        _connected = true;
+        _protocol = body[6];
+        _keepAlive = (body[8] << 8) | body[9];
+        uint pos = 10 + (_protocol == 5 ? 1 : 0); // empty property list
+        _clientId.assign((const char*)body + pos + 2, (body[pos] << 8) | body[pos + 1]);
+        _aliases.clear();
+        std::vector<uint8_t> connAck = {0x20, 2, 0, 0};
+        if (_protocol == 5) {
+          connAck.push_back(_topicAliasMax != 0 ? 3 : 0);
+          if (_topicAliasMax != 0) connAck.insert(connAck.end(), {0x22, (uint8_t)(_topicAliasMax >> 8), (uint8_t)_topicAliasMax});
+          connAck[1] = connAck.size() - 2;
+        }
+        write(connAck);
+        break;
+      }
+      case 3: { // PUBLISH
+        BrokerMessage msg;
+        msg.qos = (header >> 1) & 3;
+        msg.retain = (header & 1) != 0;
+        uint topicLen = (body[0] << 8) | body[1], pos = 2 + topicLen;
+        msg.topic.assign((const char*)body + 2, topicLen);
+        msg.topicSent = topicLen != 0;
+        msg.alias = 0;
+        uint16_t packetId = 0;
+        if (msg.qos != 0) {
+          packetId = (body[pos] << 8) | body[pos + 1];
+          pos += 2;
+        }
+        if (_protocol == 5) {
+          uint properties = body[pos++]; // below 128
+          for (uint end = pos + properties; pos < end; pos += 3) {
+            if (body[pos] != 0x23) {
+              _errors++;
+              break;
+            }
+            msg.alias = (body[pos + 1] << 8) | body[pos + 2];
+          }
+        }
+        if (msg.alias != 0) {
+          if (msg.alias > _topicAliasMax)
+            _errors++;
+          else if (msg.topicSent)
+            _aliases[msg.alias] = msg.topic;
+          else if (_aliases.count(msg.alias) != 0)
+            msg.topic = _aliases[msg.alias];
+          else
+            _errors++;
+        } else if (!msg.topicSent) {
+          _errors++;
+        }
+        msg.payload.assign((const char*)body + pos, len - pos);
+        _messages.push_back(msg);
+        _messageCount.increment();
+        if (msg.qos == 1) {
+          _acks.push_back({packetId, std::chrono::steady_clock::now() + std::chrono::microseconds(_ackDelayUS)});
+          if (!_ackPublish) _acks.back().due = std::chrono::steady_clock::time_point::max();
+          sendDueAcks();
+        }
+        break;
+      }
+      case 8: // SUBSCRIBE: packet id, granted QoS0
+        _subscribes++;
+        write(_protocol == 5 ? std::vector<uint8_t>{0x90, 4, body[0], body[1], 0, 0} : std::vector<uint8_t>{0x90, 3, body[0], body[1], 0});
+        break;
+      case 10: // UNSUBSCRIBE
+        _unsubscribes++;
+        write(_protocol == 5 ? std::vector<uint8_t>{0xb0, 4, body[0], body[1], 0, 0} : std::vector<uint8_t>{0xb0, 2, body[0], body[1]});
+        break;
+      case 12: // PINGREQ
+        _pings++;
+        if (_answerPing) write({0xd0, 0});
+        break;
+      case 14: // DISCONNECT
+        _connected = false;
+        break;
+      default:
+        _errors++;
+        break;
+    }
+  }
+
+  void sendDueAcks() {
+    auto now = std::chrono::steady_clock::now();
+    while (!_acks.empty() && _acks.front().due <= now) {
+      write({0x40, 2, (uint8_t)(_acks.front().packetId >> 8), (uint8_t)_acks.front().packetId});
+      _acks.erase(_acks.begin());
+    }
+  }
+
+  // The answers are small, the client reads them in every loop
+  void write(const std::vector<uint8_t>& packet) {
+    for (uint pos = 0; pos < packet.size() && _conn >= 0;) {
+      int len = send(_conn, packet.data() + pos, packet.size() - pos, MSG_NOSIGNAL);
+      if (len > 0)
+        pos += len;
+      else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        drop(false);
+    }
+  }
+
+  int _listen = -1;
+  int _conn = -1;
+  char _port[8];
+  std::vector<uint8_t> _in;
+  std::vector<Ack> _acks;
+  std::map<uint16_t, std::string> _aliases;
+  uint _readRate = 0; // bytes / s, 0 - unlimited
+  std::chrono::steady_clock::time_point _rateStart;
+  uint64_t _rateRead = 0;
+};
+
+namespace baseline {
+
+// The previous publish path (PubSubClient over WiFiClient): blocking socket, connect() waits for the CONNACK,
+// publish() returns when the whole packet is written; QoS0 only
+class SyncClient {
+public:
+  ~SyncClient() {
+    if (_socket >= 0) close(_socket);
+  }
+
+  __attribute__((noinline)) bool connect(uint16_t port, const char* id, uint sndBuf) {
+    _socket = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(_socket, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (::connect(_socket, (sockaddr*)&addr, sizeof(addr)) != 0) return false;
+    uint idLen = strlen(id);
+    uint8_t packet[64] = {0x10, (uint8_t)(12 + idLen), 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, STFMQTT_KEEPALIVE, (uint8_t)(idLen >> 8), (uint8_t)idLen};
+    memcpy(packet + 14, id, idLen);
+    uint8_t connAck[4];
+    return write(packet, 14 + idLen) && recv(_socket, connAck, 4, MSG_WAITALL) == 4 && connAck[0] == 0x20 && connAck[3] == 0;
+  }
+
+  __attribute__((noinline)) bool publish(const char* topic, const uint8_t* payload, uint len) {
+    uint topicLen = strlen(topic), remaining = 2 + topicLen + len;
+    uint8_t* pos = _buffer;
+    *pos++ = 0x30;
+    for (uint value = remaining;; value >>= 7) {
+      *pos++ = (value & 0x7f) | (value >= 128 ? 0x80 : 0);
+      if (value < 128) break;
+    }
+    *pos++ = topicLen >> 8;
+    *pos++ = topicLen;
+    memcpy(pos, topic, topicLen);
+    memcpy(pos + topicLen, payload, len);
+    return write(_buffer, pos + topicLen + len - _buffer);
+  }
+
+protected:
+  bool write(const uint8_t* data, uint len) {
+    for (uint pos = 0; pos < len;) {
+      int res = send(_socket, data + pos, len - pos, MSG_NOSIGNAL);
+      if (res <= 0) return false;
+      pos += res;
+    }
+    return true;
+  }
+
+  int _socket = -1;
+  uint8_t _buffer[STFMQTT_OUTPUT_SIZE];
+};
+
+} // namespace baseline
+
+static const char* const g_topic = "home/esp32-bt/BTtoMQTT/A4C138123456";
+static std::vector<std::pair<std::string, std::string>> g_requeued;
+
+static void requeue(const char* topic, uint topicLen, const uint8_t* payload, uint length) {
+  g_requeued.push_back({std::string(topic, topicLen), std::string((const char*)payload, length)});
+}
+
+// Runs the client and the broker till cond() is true, at most ~2 s of real time (a simulated clock stands still meanwhile)
+template <class Cond>
+static bool pump(ClientProbe& client, FakeBroker& broker, Cond cond) {
+  for (uint round = 0; round < 4000; round++) {
+    client.loop();
+    broker.poll();
+    if (cond()) return true;
+    usleep(500);
+  }
+  return false;
+}
+
+static bool connectClient(ClientProbe& client, FakeBroker& broker) {
+  client.setServer("127.0.0.1", atoi(broker.port()));
+  if (!client.connect("host-test", "mqtt", "secret", "home/host-test/CONNtoMQTT/test", 0, true, R"({"connectivity":"OFF"})")) return false;
+  return pump(client, broker, [&] { return client.connected(); });
+}
+
+// Small send buffer (the lwip one is ~4 MSS), so a stopped reader fills it soon
+static void shrinkSendBuffer(ClientProbe& client) {
+  int sndBuf = 2048;
+  setsockopt(client._socket, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+}
+
+// Sequence number first, padded to size
+static uint makePayload(char* payload, uint seq, uint size) {
+  uint len = sprintf(payload, "{\"seq\":%u,\"pad\":\"", seq);
+  for (; len < size - 2; len++) payload[len] = 'a' + (seq + len) % 26;
+  return len + sprintf(payload + len, "\"}");
+}
+
+static void testConnect() {
+  FakeBroker broker;
+  ClientProbe client;
+  CHECK(connectClient(client, broker), "connect: no CONNACK");
+  CHECK(broker._connects == 1 && broker._protocol == STFMQTT_VERSION && broker._clientId == "host-test" && broker._keepAlive == STFMQTT_KEEPALIVE,
+        "connect: CONNECT %u, protocol %u, id %s, keep alive %u", broker._connects, broker._protocol, broker._clientId.c_str(), broker._keepAlive);
+  CHECK(client.subscribe("home/host-test/+/test/command/#") && client.unsubscribe("home/host-test/SYSRtoMQTT/test"), "connect: subscribe failed");
+  CHECK(pump(client, broker, [&] { return broker._subscribes == 1 && broker._unsubscribes == 1; }), "connect: no SUBSCRIBE / UNSUBSCRIBE");
+  client.disconnect();
+  CHECK(client.getState() == MQTTTransport::EState::Disconnected, "connect: still connected after disconnect()");
+  CHECK(pump(client, broker, [&] { return !broker._connected; }), "connect: no DISCONNECT");
+  CHECK(broker._errors == 0, "connect: %u protocol errors", broker._errors);
+  printf("connect: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+// The whole window is written before the first PUBACK
+static void testPipelinedQos1() {
+  FakeBroker broker;
+  ClientProbe client;
+  broker._ackPublish = false;
+  CHECK(connectClient(client, broker), "qos1: not connected");
+  char payload[64];
+  uint sent = 0;
+  for (uint len; sent < 100 && client.canPublish(strlen(g_topic) + (len = makePayload(payload, sent, 40)), 1); sent++)
+    CHECK(client.publish(g_topic, (const uint8_t*)payload, len, false, 1), "qos1: publish %u failed", sent);
+  CHECK(sent == STFMQTT_WINDOW, "qos1: %u publishes accepted, window %u", sent, STFMQTT_WINDOW);
+  CHECK(pump(client, broker, [&] { return broker._messageCount.get() == sent; }), "qos1: %u of %u publishes arrived without PUBACK", broker._messageCount.get(), sent);
+  CHECK(client._inflightCount == sent && client._acked == 0 && !client.isIdle(), "qos1: %u in flight, %u acked", client._inflightCount, client._acked);
+  broker.releaseAcks();
+  CHECK(pump(client, broker, [&] { return client.isIdle(); }), "qos1: not idle after the PUBACKs");
+  CHECK(client._acked == sent && client.canPublish(100, 1), "qos1: %u acked", client._acked);
+  for (uint idx = 0; idx < broker._messages.size(); idx++) {
+    const BrokerMessage& msg = broker._messages[idx];
+    makePayload(payload, idx, 40);
+    CHECK(msg.qos == 1 && msg.topic == g_topic && msg.payload == payload, "qos1: message %u differs", idx);
+  }
+  CHECK(broker._errors == 0, "qos1: %u protocol errors", broker._errors);
+  printf("pipelined QoS1: %s (%u publishes in flight)\n", g_failed == 0 ? "ok" : "FAILED", sent);
+}
+
+// The socket takes a part of a packet, the rest is written by the next loops
+static void testPartialWrites() {
+  FakeBroker broker;
+  ClientProbe client;
+  CHECK(connectClient(client, broker), "partial: not connected");
+  shrinkSendBuffer(client);
+  broker._reading = false;
+  char payload[1024];
+  uint sent = 0, partial = 0, full = 0;
+  for (uint round = 0; round < 2000 && (partial == 0 || full < 10); round++) {
+    uint len = makePayload(payload, sent, 700);
+    if (client.canPublish(strlen(g_topic) + len, 0)) {
+      CHECK(client.publish(g_topic, (const uint8_t*)payload, len, false), "partial: publish %u failed", sent);
+      sent++;
+    } else {
+      full++;
+    }
+    client.loop();
+    broker.poll();
+    if (client._outputSent != 0) partial++; // the written packets are removed, so the first one is written partially
+  }
+  CHECK(partial != 0, "partial: no partial write in %u publishes", sent);
+  broker._reading = true;
+  CHECK(pump(client, broker, [&] { return client.isIdle() && broker._messageCount.get() == sent; }), "partial: %u of %u arrived", broker._messageCount.get(), sent);
+  for (uint idx = 0; idx < broker._messages.size(); idx++) {
+    makePayload(payload, idx, 700);
+    CHECK(broker._messages[idx].payload == payload, "partial: message %u differs", idx);
+  }
+  CHECK(broker._errors == 0, "partial: %u protocol errors", broker._errors);
+  printf("partial writes: %s (%u publishes of 700 bytes, %u loops with a partially written packet)\n", g_failed == 0 ? "ok" : "FAILED", sent, partial);
+}
+
+// Simulated clock: PINGREQ after the keep alive, connection closed without PINGRESP / PUBACK
+static void testTimeouts() {
+  const int64_t keepAlive = STFMQTT_KEEPALIVE * 1000000LL;
+  hostSetTime(1000000000LL);
+  {
+    FakeBroker broker;
+    ClientProbe client;
+    CHECK(connectClient(client, broker), "keep alive: not connected");
+    hostAdvanceTime(keepAlive);
+    CHECK(pump(client, broker, [&] { return broker._pings == 1 && !client._pingPending; }), "keep alive: no PINGREQ / PINGRESP");
+    broker._answerPing = false;
+    hostAdvanceTime(keepAlive);
+    CHECK(pump(client, broker, [&] { return broker._pings == 2; }), "keep alive: no second PINGREQ");
+    hostAdvanceTime(keepAlive - 1000);
+    client.loop();
+    CHECK(client.connected(), "keep alive: closed before the timeout");
+    hostAdvanceTime(2000);
+    client.loop();
+    CHECK(client.getState() == MQTTTransport::EState::Disconnected, "keep alive: still connected without PINGRESP");
+  }
+  {
+    FakeBroker broker;
+    ClientProbe client;
+    broker._ackPublish = false;
+    CHECK(connectClient(client, broker), "puback: not connected");
+    for (uint idx = 0; idx < 3; idx++) client.publish(g_topic, "{\"seq\":0}", false), client.publish(g_topic, (const uint8_t*)"{}", 2, false, 1);
+    CHECK(pump(client, broker, [&] { return broker._messageCount.get() == 6; }), "puback: publishes not arrived");
+    hostAdvanceTime(keepAlive + 1000);
+    client.loop();
+    CHECK(client.getState() == MQTTTransport::EState::Disconnected && client._dropped == 3, "puback: state %u, %u dropped", (uint)client.getState(), client._dropped);
+  }
+  hostRealTime();
+  printf("timeouts: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+// Connection reset with a full output buffer: the publishes the broker got and the requeued ones give back all of them
+static void testRequeue() {
+  FakeBroker broker;
+  ClientProbe client;
+  g_requeued.clear();
+  client.setRequeue(requeue);
+  CHECK(connectClient(client, broker), "requeue: not connected");
+  shrinkSendBuffer(client);
+  broker._reading = false;
+  char payload[512];
+  uint sent = 0, full = 0;
+  for (uint round = 0; round < 2000 && full < 10; round++) {
+    bool retain = sent % 10 == 9; // regenerated after reconnect, not requeued
+    uint len = makePayload(payload, sent, 300);
+    if (client.canPublish(strlen(g_topic) + len, 0)) {
+      CHECK(client.publish(retain ? "home/esp32-bt/BTtoMQTT/retained" : g_topic, (const uint8_t*)payload, len, retain), "requeue: publish %u failed", sent);
+      sent++;
+    } else {
+      full++;
+    }
+    client.loop();
+  }
+  // everything written to the socket is read, then the connection is reset
+  broker._reading = true;
+  for (uint64_t bytes = ~0ULL; bytes != broker._bytes; usleep(20000)) {
+    bytes = broker._bytes;
+    broker.poll();
+  }
+  broker.drop(true);
+  CHECK(pump(client, broker, [&] { return client.getState() == MQTTTransport::EState::Disconnected; }), "requeue: reset not detected");
+
+  std::vector<std::string> delivered;
+  for (const BrokerMessage& msg : broker._messages) delivered.push_back(msg.payload);
+  for (const std::pair<std::string, std::string>& msg : g_requeued) {
+    CHECK(msg.first == g_topic, "requeue: topic %s", msg.first.c_str());
+    delivered.push_back(msg.second);
+  }
+  uint idx = 0, retained = 0;
+  for (uint seq = 0; seq < sent; seq++) {
+    makePayload(payload, seq, 300);
+    if (idx < delivered.size() && delivered[idx] == payload)
+      idx++;
+    else if (seq % 10 == 9 && idx >= broker._messages.size())
+      retained++; // unsent retained one
+    else
+      CHECK(false, "requeue: message %u lost", seq);
+  }
+  CHECK(idx == delivered.size(), "requeue: %zu messages delivered, %u expected", delivered.size(), idx);
+  CHECK(!g_requeued.empty() && client._requeued == g_requeued.size(), "requeue: %zu requeued, counter %u", g_requeued.size(), client._requeued);
+  printf("requeue: %s (%u publishes, %zu arrived, %zu requeued, %u retained skipped)\n", g_failed == 0 ? "ok" : "FAILED", sent, broker._messages.size(), g_requeued.size(), retained);
+}
+
+#if STFMQTT_VERSION == 5
+// Alias-only publishes requeued after a reset: their topic is looked up by the alias, which must not be remapped by a later
+// publish while they wait in the output buffer (pads on alias 1, t/A on alias 2, t/B and t/C get no alias meanwhile)
+static void testAliasRequeue() {
+  FakeBroker broker;
+  broker._topicAliasMax = 2;
+  ClientProbe client;
+  g_requeued.clear();
+  client.setRequeue(requeue);
+  CHECK(connectClient(client, broker), "alias requeue: not connected");
+  shrinkSendBuffer(client);
+  broker._reading = false;
+  std::vector<std::pair<std::string, std::string>> published;
+  char payload[512];
+  for (uint round = 0; round < 2000 && client._outputLength < sizeof(client._output) / 2; round++) {
+    uint len = makePayload(payload, published.size(), 100);
+    CHECK(client.publish("t/pad", (const uint8_t*)payload, len, false), "alias requeue: pad %zu failed", published.size());
+    published.push_back({"t/pad", std::string(payload, len)});
+    client.loop();
+  }
+  CHECK(client._outputLength >= sizeof(client._output) / 2, "alias requeue: output not filled (%u bytes)", client._outputLength);
+  for (const char* topic : {"t/A", "t/B", "t/A", "t/C", "t/A"}) {
+    uint len = makePayload(payload, published.size(), 100);
+    CHECK(client.publish(topic, (const uint8_t*)payload, len, false), "alias requeue: %s failed", topic);
+    published.push_back({topic, std::string(payload, len)});
+  }
+  broker._reading = true;
+  for (uint64_t bytes = ~0ULL; bytes != broker._bytes; usleep(20000)) {
+    bytes = broker._bytes;
+    broker.poll();
+  }
+  broker.drop(true);
+  CHECK(pump(client, broker, [&] { return client.getState() == MQTTTransport::EState::Disconnected; }), "alias requeue: reset not detected");
+
+  std::vector<std::pair<std::string, std::string>> delivered;
+  for (const BrokerMessage& msg : broker._messages) delivered.push_back({msg.topic, msg.payload});
+  delivered.insert(delivered.end(), g_requeued.begin(), g_requeued.end());
+  CHECK(delivered.size() == published.size(), "alias requeue: %zu messages delivered, %zu published", delivered.size(), published.size());
+  for (uint idx = 0; idx < delivered.size() && idx < published.size(); idx++)
+    CHECK(delivered[idx] == published[idx], "alias requeue: message %u on %s instead of %s", idx, delivered[idx].first.c_str(), published[idx].first.c_str());
+  CHECK(broker._errors == 0, "alias requeue: %u protocol errors", broker._errors);
+  printf("alias requeue: %s (%zu publishes, %zu arrived, %zu requeued)\n", g_failed == 0 ? "ok" : "FAILED", published.size(), broker._messages.size(), g_requeued.size());
+}
+
+// Publishes the topics one by one (each written before the next), false if the broker didn't get them all
+static bool publishTopics(ClientProbe& client, FakeBroker& broker, std::initializer_list<const char*> topics) {
+  size_t count = broker._messages.size() + topics.size();
+  for (const char* topic : topics) {
+    if (!client.publish(topic, R"({"temp":21.5})", false)) return false;
+    if (!pump(client, broker, [&] { return client.isIdle(); })) return false;
+  }
+  return pump(client, broker, [&] { return broker._messages.size() == count; });
+}
+
+static bool isMessage(const BrokerMessage& msg, const char* topic, uint16_t alias, bool topicSent) {
+  return msg.topic == topic && msg.alias == alias && msg.topicSent == topicSent;
+}
+
+// Alias per topic in an LRU of STFMQTT_TOPIC_ALIASES (2), limited by the Topic Alias Maximum of the broker, valid for one
+// connection only
+static void testAliases() {
+  int failed = g_failed; // the messages are not checked if they didn't arrive
+  {
+    FakeBroker broker;
+    broker._topicAliasMax = 10;
+    ClientProbe client;
+    CHECK(connectClient(client, broker), "aliases: not connected");
+    CHECK(publishTopics(client, broker, {"t/A", "t/B", "t/A", "t/B"}), "aliases: assignment not delivered");
+    if (g_failed != failed) return;
+    const std::vector<BrokerMessage>& msgs = broker._messages;
+    CHECK(isMessage(msgs[0], "t/A", 1, true) && isMessage(msgs[1], "t/B", 2, true) && isMessage(msgs[2], "t/A", 1, false) && isMessage(msgs[3], "t/B", 2, false),
+          "aliases: assignment %s/%u/%u %s/%u/%u %s/%u/%u %s/%u/%u", msgs[0].topic.c_str(), msgs[0].alias, msgs[0].topicSent, msgs[1].topic.c_str(),
+          msgs[1].alias, msgs[1].topicSent, msgs[2].topic.c_str(), msgs[2].alias, msgs[2].topicSent, msgs[3].topic.c_str(), msgs[3].alias,
+          msgs[3].topicSent);
+
+    // t/A is the least recently used one: remapped to t/C, then t/B stays, t/A comes back in place of t/C
+    CHECK(publishTopics(client, broker, {"t/C", "t/B", "t/A", "t/B"}), "aliases: LRU not delivered");
+    if (g_failed != failed) return;
+    CHECK(isMessage(msgs[4], "t/C", 1, true) && isMessage(msgs[5], "t/B", 2, false) && isMessage(msgs[6], "t/A", 1, true) && isMessage(msgs[7], "t/B", 2, false),
+          "aliases: LRU reuse %s/%u/%u %s/%u/%u", msgs[4].topic.c_str(), msgs[4].alias, msgs[4].topicSent, msgs[6].topic.c_str(), msgs[6].alias,
+          msgs[6].topicSent);
+    CHECK(client._aliasHits == 4, "aliases: %u hits", client._aliasHits);
+
+    // a new connection starts with an empty table on both sides: after a reset and with connect() while connected
+    broker.drop(true);
+    CHECK(pump(client, broker, [&] { return client.getState() == MQTTTransport::EState::Disconnected; }), "aliases: reset not detected");
+    CHECK(connectClient(client, broker), "aliases: not reconnected");
+    CHECK(publishTopics(client, broker, {"t/B", "t/B"}), "aliases: not delivered after reconnect");
+    if (g_failed != failed) return;
+    CHECK(isMessage(msgs[8], "t/B", 1, true) && isMessage(msgs[9], "t/B", 1, false), "aliases: after reconnect %s/%u/%u", msgs[8].topic.c_str(),
+          msgs[8].alias, msgs[8].topicSent);
+    CHECK(connectClient(client, broker), "aliases: connect() while connected failed");
+    CHECK(publishTopics(client, broker, {"t/A", "t/B"}), "aliases: not delivered after connect()");
+    if (g_failed != failed) return;
+    CHECK(isMessage(msgs[10], "t/A", 1, true) && isMessage(msgs[11], "t/B", 2, true), "aliases: after connect() %s/%u/%u", msgs[10].topic.c_str(),
+          msgs[10].alias, msgs[10].topicSent);
+    CHECK(broker._connects == 3 && broker._errors == 0, "aliases: %u CONNECTs, %u protocol errors", broker._connects, broker._errors);
+  }
+  for (uint16_t max : {1, 0}) { // below the LRU size: only alias 1 is used; 0 - no aliases at all
+    FakeBroker broker;
+    broker._topicAliasMax = max;
+    ClientProbe client;
+    CHECK(connectClient(client, broker), "aliases: not connected");
+    CHECK(publishTopics(client, broker, {"t/A", "t/A", "t/B", "t/A"}), "aliases: maximum %u not delivered", max);
+    if (g_failed != failed) return;
+    const std::vector<BrokerMessage>& msgs = broker._messages;
+    if (max == 1)
+      CHECK(isMessage(msgs[0], "t/A", 1, true) && isMessage(msgs[1], "t/A", 1, false) && isMessage(msgs[2], "t/B", 1, true) && isMessage(msgs[3], "t/A", 1, true),
+            "aliases: maximum 1 %s/%u/%u", msgs[2].topic.c_str(), msgs[2].alias, msgs[2].topicSent);
+    else
+      for (const BrokerMessage& msg : msgs) CHECK(msg.alias == 0 && msg.topicSent, "aliases: alias %u without Topic Alias Maximum", msg.alias);
+    CHECK(broker._errors == 0, "aliases: maximum %u, %u protocol errors", max, broker._errors);
+  }
+  printf("aliases: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+// Bytes on the wire for the state publishes of one device, with and without aliases
+static void benchmarkAliases() {
+  const uint count = 200;
+  for (uint16_t max : {0, 2}) {
+    FakeBroker broker;
+    broker._topicAliasMax = max;
+    ClientProbe client;
+    CHECK(connectClient(client, broker), "alias bytes: not connected");
+    uint64_t start = broker._bytes;
+    for (uint idx = 0; idx < count; idx++) {
+      CHECK(client.publish(g_topic, R"({"temp":21.5,"hum":45.2,"batt":87,"rssi":-71})", false), "alias bytes: publish %u failed", idx);
+      pump(client, broker, [&] { return client.isIdle(); });
+    }
+    CHECK(pump(client, broker, [&] { return broker._messages.size() == count; }), "alias bytes: %zu messages", broker._messages.size());
+    printf("  %-10s %u publishes on %s: %.1f bytes/message\n", max == 0 ? "no aliases" : "aliases", count, g_topic, (double)(broker._bytes - start) / count);
+  }
+}
+#endif
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// QoS0 publishes on a slow link (the broker reads 200 KB/s): the synchronous publish blocks the caller till the socket takes
+// the whole message, the non-blocking one returns at once and the drain stops while the output buffer is full
+static void benchmarkSlowLink() {
+  const uint count = 200, size = 300, rate = 200000;
+  char payload[512];
+  for (uint variant = 0; variant < 2; variant++) {
+    FakeBroker broker;
+    bool stop = false;
+    double blocked = 0, maxCall = 0;
+    ClientProbe client;
+    baseline::SyncClient sync;
+    if (variant == 0) {
+      CHECK(connectClient(client, broker), "slow link: not connected");
+      shrinkSendBuffer(client);
+    }
+    std::thread thread([&] {
+      while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) broker.wait();
+    });
+    if (variant == 1) CHECK(sync.connect(atoi(broker.port()), "host-sync", 2048), "slow link: sync client not connected");
+    broker.startRate(rate);
+    auto start = std::chrono::steady_clock::now();
+    for (uint sent = 0; broker._messageCount.get() < count;) {
+      auto call = std::chrono::steady_clock::now();
+      if (variant == 0) {
+        client.loop();
+        for (uint len; sent < count && client.canPublish(strlen(g_topic) + (len = makePayload(payload, sent, size)), 0); sent++) client.publish(g_topic, (const uint8_t*)payload, len, false);
+      } else if (sent < count) {
+        uint len = makePayload(payload, sent++, size);
+        sync.publish(g_topic, (const uint8_t*)payload, len);
+      }
+      double ms = msSince(call);
+      blocked += ms;
+      maxCall = std::max(maxCall, ms);
+      if (variant == 0 || sent == count) usleep(1000); // the consumer task sleeps till its next loop
+    }
+    double total = msSince(start);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    thread.join();
+    printf("  %-13s %u x %u bytes at %u KB/s: %.0f ms, %.0f msg/s; caller blocked %.1f ms (%.3f ms/msg, longest call %.2f ms)\n",
+           variant == 0 ? "non-blocking" : "synchronous", count, size, rate / 1000, total, count * 1000 / total, blocked, blocked / count, maxCall);
+  }
+}
+
+// QoS1 publishes with 2 ms round trip: one at a time (window 1, like waiting for each PUBACK) vs the window
+static void benchmarkWindow() {
+  const uint count = 200, rtt = 2000;
+  char payload[128];
+  for (uint window : {1u, (uint)STFMQTT_WINDOW}) {
+    FakeBroker broker;
+    ClientProbe client;
+    broker._ackDelayUS = rtt;
+    CHECK(connectClient(client, broker), "window: not connected");
+    client._window = window;
+    bool stop = false;
+    std::thread thread([&] {
+      while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) broker.wait();
+    });
+    std::vector<std::chrono::steady_clock::time_point> sendTime(count);
+    double latency = 0, maxLatency = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint sent = 0, acked = 0; acked < count;) {
+      client.loop();
+      for (uint len; sent < count && client.canPublish(strlen(g_topic) + (len = makePayload(payload, sent, 100)), 1); sent++) {
+        sendTime[sent] = std::chrono::steady_clock::now();
+        client.publish(g_topic, (const uint8_t*)payload, len, false, 1);
+      }
+      for (; acked < client._acked; acked++) { // in order
+        double ms = msSince(sendTime[acked]);
+        latency += ms;
+        maxLatency = std::max(maxLatency, ms);
+      }
+    }
+    double total = msSince(start);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    thread.join();
+    printf("  window %u: %u QoS1 publishes with %.1f ms RTT in %.0f ms, %.0f msg/s; publish to PUBACK %.2f ms average, %.2f ms max\n",
+           window, count, rtt / 1000.f, total, count * 1000 / total, latency / count, maxLatency);
+  }
+}
+
+int main() {
+  signal(SIGPIPE, SIG_IGN); // a reset connection gives EPIPE, lwip doesn't raise signals
+  printf("MQTT %s, output buffer %u, window %u\n", STFMQTT_VERSION == 5 ? "5" : "3.1.1", STFMQTT_OUTPUT_SIZE, STFMQTT_WINDOW);
+  testConnect();
+  testPipelinedQos1();
+  testPartialWrites();
+  testTimeouts();
+  testRequeue();
+#if STFMQTT_VERSION == 5
+  testAliasRequeue();
+  testAliases();
+#endif
+  if (g_failed != 0) return 1;
+
+  printf("slow link:\n");
+  benchmarkSlowLink();
+  printf("round trip:\n");
+  benchmarkWindow();
+#if STFMQTT_VERSION == 5
+  printf("topic aliases:\n");
+  benchmarkAliases();
+#endif
+  return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// MQTTConsumer over a fake MQTTTransport (MQTTConsumer::setTransport), on the simulated clock
+// - connect with the will, connectivity ON and the subscriptions after CONNACK, ready after the retained settings wait
+// - publishes given back by the transport at a connection loss go into the offline queue and are replayed with their age
+//   after the reconnect, not while the transport has no room
+
+#include <stf/link_mqtt.h>
+
+#include <SPIFFS.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+struct Publish {
+  std::string topic;
+  std::string payload;
+  bool retain;
+};
+
+// Connects at the first loop() after connect(), keeps the publishes not written yet in _unsent
+class FakeTransport : public MQTTTransport {
+public:
+  void setServer(const char* host, uint16_t port) override {
+    _host = host;
+    _port = port;
+  }
+
+  bool connect(const char* id, const char* user, const char* password, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage) override {
+    _connects++;
+    _id = id;
+    _user = user;
+    _willTopic = willTopic;
+    _willMessage = willMessage;
+    _willRetain = willRetain;
+    _unsent.clear();
+    _state = EState::Connecting;
+    return true;
+  }
+  void disconnect() override { _state = EState::Disconnected; }
+  EState loop() override {
+    if (_state == EState::Connecting) _state = EState::Connected;
+    return _state;
+  }
+
+  bool canPublish(uint size, uint8_t qos) const override { return !_full; }
+  bool isIdle() const override { return _unsent.empty(); }
+
+  bool publish(const char* topic, const uint8_t* payload, uint len, bool retain, uint8_t qos) override {
+    if (_state != EState::Connected || _full) return false;
+    _unsent.push_back({topic, std::string((const char*)payload, len), retain});
+    return true;
+  }
+  bool subscribe(const char* topic) override {
+    _subscribed.push_back(topic);
+    return _state == EState::Connected;
+  }
+  bool unsubscribe(const char* topic) override {
+    _unsubscribed.push_back(topic);
+    return _state == EState::Connected;
+  }
+
+  // The broker got everything
+  void written() {
+    _published.insert(_published.end(), _unsent.begin(), _unsent.end());
+    _unsent.clear();
+  }
+  // Connection loss: the unsent non retained publishes are given back, like MQTTClient::requeueOutput
+  void lose() {
+    for (const Publish& msg : _unsent) {
+      if (msg.retain) continue;
+      (*_requeue)(msg.topic.c_str(), msg.topic.size(), (const uint8_t*)msg.payload.data(), msg.payload.size());
+      _requeued++;
+    }
+    _unsent.clear();
+    _state = EState::Disconnected;
+  }
+
+  using MQTTTransport::_callback;
+  using MQTTTransport::_requeue;
+
+  std::string _host, _id, _user, _willTopic, _willMessage;
+  uint16_t _port = 0;
+  bool _willRetain = false;
+  bool _full = false;
+  uint _connects = 0;
+  std::vector<Publish> _unsent, _published;
+  std::vector<std::string> _subscribed, _unsubscribed;
+};
+
+static const char* g_root = "build/consumer_fs";
+static FakeTransport g_transport;
+static MQTTConsumer& g_consumer = MQTTConsumer::_obj;
+
+static std::string hostTopic(const char* format) {
+  char topic[128];
+  snprintf(topic, sizeof(topic), format, Host::_name, Host::_info.strId);
+  return topic;
+}
+
+// Runs the consumer loop for the simulated time given
+static void run(uint32_t ms) {
+  for (uint32_t elapsed = 0; elapsed < ms; elapsed += 10) {
+    g_consumer.loop();
+    hostAdvanceTime(10000);
+  }
+  g_consumer.loop();
+}
+
+static void testConnect() {
+  g_consumer.setTransport(&g_transport);
+  g_consumer.setup();
+  CHECK(g_transport._host == NetTask::_mqttServer && g_transport._port == atoi(NetTask::_mqttPort), "connect: server %s:%u",
+        g_transport._host.c_str(), g_transport._port);
+  CHECK(g_transport._callback != nullptr && g_transport._requeue != nullptr, "connect: callbacks not set");
+
+  g_consumer.loop();
+  std::string connTopic = hostTopic("home/%s/CONNtoMQTT/%s");
+  CHECK(g_transport._connects == 1 && g_transport._id == Host::_name && g_transport._user == NetTask::_mqttUser, "connect: %u connects, id %s",
+        g_transport._connects, g_transport._id.c_str());
+  CHECK(g_transport._willTopic == connTopic && g_transport._willRetain && g_transport._willMessage == R"({"connectivity":"OFF"})",
+        "connect: will %s %s", g_transport._willTopic.c_str(), g_transport._willMessage.c_str());
+  CHECK(!g_consumer.isReady() && !g_consumer.isAccepting(), "connect: ready before CONNACK");
+
+  g_consumer.loop();
+  CHECK(g_transport._unsent.size() == 1 && g_transport._unsent[0].topic == connTopic && g_transport._unsent[0].retain &&
+            g_transport._unsent[0].payload == R"({"connectivity":"ON"})",
+        "connect: connectivity ON not published (%zu publishes)", g_transport._unsent.size());
+  CHECK(g_transport._subscribed.size() == 2 && g_transport._subscribed[0] == hostTopic("home/%s/+/%s/command/#") &&
+            g_transport._subscribed[1] == hostTopic("home/%s/SYSRtoMQTT/%s"),
+        "connect: %zu subscriptions", g_transport._subscribed.size());
+  g_transport.written();
+
+  // no retained settings: ready after 5 s, the settings topic is unsubscribed
+  run(4900);
+  CHECK(!g_consumer.isReady(), "connect: ready before the retained settings wait");
+  run(200);
+  CHECK(g_consumer.isReady() && g_consumer.isAccepting(), "connect: not ready after the retained settings wait");
+  CHECK(g_transport._unsubscribed.size() == 1 && g_transport._unsubscribed[0] == g_transport._subscribed[1], "connect: %zu unsubscribed",
+        g_transport._unsubscribed.size());
+  printf("connect: %s\n", g_failed == 0 ? "ok" : "FAILED");
+}
+
+static void testRequeueReplay() {
+  std::string stateTopic = hostTopic("home/%s/BTtoMQTT/A4C138123456");
+  std::vector<std::string> payloads = {R"({"temp":21.5})", R"({"temp":21.6})", R"({"temp":21.7})"};
+  for (const std::string& payload : payloads) g_transport._unsent.push_back({stateTopic, payload, false});
+  g_transport._unsent.push_back({hostTopic("home/%s/SYSStoMQTT/%s"), R"({"setting":1})", true}); // regenerated, not requeued
+  g_transport.lose();
+  g_consumer.loop();
+  CHECK(!g_consumer.isReady() && g_consumer.isAccepting(), "requeue: not accepting while offline after the first ready");
+
+  // reconnect at once (first try), ready again after the settings wait, then the replay starts
+  g_transport._full = true;
+  run(5100);
+  CHECK(g_transport._connects == 2 && g_consumer.isReady(), "requeue: %u connects, ready %u", g_transport._connects, g_consumer.isReady());
+  size_t before = g_transport._unsent.size();
+  run(200);
+  CHECK(g_transport._unsent.size() == before, "requeue: %zu messages replayed without room", g_transport._unsent.size() - before);
+
+  g_transport._full = false;
+  run(200);
+  std::vector<Publish> replayed;
+  for (const Publish& msg : g_transport._unsent)
+    if (msg.topic == stateTopic) replayed.push_back(msg);
+  CHECK(replayed.size() == payloads.size(), "requeue: %zu replayed instead of %zu", replayed.size(), payloads.size());
+  for (uint idx = 0; idx < replayed.size() && idx < payloads.size(); idx++) {
+    // the original time as age: lost 5.5 s ago
+    std::string expected = payloads[idx].substr(0, payloads[idx].size() - 1) + R"(,"age":5})";
+    CHECK(replayed[idx].payload == expected && !replayed[idx].retain, "requeue: replayed %s instead of %s", replayed[idx].payload.c_str(), expected.c_str());
+  }
+  g_transport.written();
+  run(200);
+  CHECK(g_transport._unsent.empty(), "requeue: %zu more publishes after the replay", g_transport._unsent.size());
+  printf("requeue and replay: %s (%u requeued, %zu replayed)\n", g_failed == 0 ? "ok" : "FAILED", g_transport._requeued, replayed.size());
+}
+
+int main() {
+  static uint8_t mac[6] = {0xac, 0x67, 0xb2, 0xaa, 0xbb, 0xcc};
+  Host::_info.mac = mac; // Host::setup reads it from the efuse
+  Host::_info.macLen = sizeof(mac);
+  Host::_info.strMAC = "AC67B2AABBCC";
+  Host::_info.strId = "AC67B2AABBCC";
+
+  mkdir("build", 0755);
+  mkdir(g_root, 0755);
+  hostSetSPIFFSRoot(g_root);
+  unlink((std::string(g_root) + "/offline.log").c_str());
+  hostSetTime(1000000000LL);
+
+  testConnect();
+  if (g_failed == 0) testRequeueReplay();
+  return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+/*
+  SimpleThingFramework
+
+  Copyright 2021 Andras Csikvari
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// OfflineQueue with the SPIFFS log in a host directory (the Makefile shrinks the ring and the log cap so they fill fast):
+// ring wrap, drop of the oldest, spill to flash, replay of the log after a reboot and recovery of a truncated log
+
+#include <stf/link_offline.h>
+
+#include <SPIFFS.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace stf;
+
+static int g_failed = 0;
+
+#define CHECK(cond, ...)             \
+  do {                               \
+    if (!(cond)) {                   \
+      printf("FAILED: " __VA_ARGS__); \
+      printf("\n");                  \
+      g_failed++;                    \
+    }                                \
+  } while (0)
+
+class QueueProbe : public OfflineQueue {
+public:
+  using OfflineQueue::_head;
+  using OfflineQueue::_logRead;
+  using OfflineQueue::_logSize;
+  using OfflineQueue::_logName;
+  using OfflineQueue::_ringCount;
+};
+
+static const char* g_root = "build/offline_fs";
+static std::string g_logPath;
+
+struct Message {
+  std::string topic;
+  std::string payload;
+  uint32_t time;
+};
+
+// Message n: its topic and JSON payload of a random length (may be 0)
+static Message makeMessage(std::mt19937& rnd, uint32_t n) {
+  Message msg;
+  msg.topic = "home/stf_1234/BTtoMQTT/" + std::to_string(n % 97);
+  uint len = rnd() % 4 == 0 ? 0 : rnd() % 200;
+  msg.payload = "{\"n\":" + std::to_string(n) + ",\"d\":\"";
+  while (msg.payload.size() < len) msg.payload += (char)('a' + rnd() % 26);
+  msg.payload += "\"}";
+  msg.time = n * 100;
+  return msg;
+}
+
+static bool push(OfflineQueue* queue, const Message& msg) {
+  return queue->push(msg.topic.c_str(), (const uint8_t*)msg.payload.data(), msg.payload.size(), msg.time);
+}
+
+// Pops the front and compares it with the expected message
+static bool popCheck(OfflineQueue* queue, const Message& msg, bool previousBoot, const char* test) {
+  char buffer[512];
+  OfflineRecord rec;
+  if (!queue->front(buffer, sizeof(buffer), rec)) {
+    CHECK(false, "%s: queue empty, expected message at %u", test, msg.time);
+    return false;
+  }
+  bool same = msg.topic == rec.topic && msg.payload == std::string((const char*)rec.payload, rec.payloadLength) && msg.time == rec.time;
+  CHECK(same, "%s: message at %u instead of %u", test, rec.time, msg.time);
+  CHECK(rec.previousBoot == previousBoot, "%s: previousBoot %d at %u", test, rec.previousBoot, msg.time);
+  queue->pop();
+  return same;
+}
+
+static bool logExists() { return access(g_logPath.c_str(), F_OK) == 0; }
+
+static long logFileSize() {
+  struct stat st;
+  return stat(g_logPath.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+static QueueProbe* reboot(QueueProbe* queue) {
+  delete queue;
+  queue = new QueueProbe();
+  queue->setup();
+  return queue;
+}
+
+static QueueProbe* fresh() {
+  unlink(g_logPath.c_str());
+  hostSetSPIFFSRoot(g_root);
+  QueueProbe* queue = new QueueProbe();
+  queue->setup();
+  return queue;
+}
+
+// Push / pop below the capacity: the records wrap around the end of the ring, nothing is dropped or spilled
+static void testRingWrap() {
+  std::mt19937 rnd(1);
+  QueueProbe* queue = fresh();
+  std::deque<Message> expected;
+  uint wraps = 0, n = 0, used = 0;
+  while (n < 20000) {
+    if (used < STFMQTT_OFFLINE_SIZE * 3 / 4 && rnd() % 2 == 0) {
+      Message msg = makeMessage(rnd, n++);
+      if (used + OfflineQueue::RecordHeaderSize + msg.topic.size() + 1 + msg.payload.size() > STFMQTT_OFFLINE_SIZE * 3 / 4) continue;
+      CHECK(push(queue, msg), "wrap: push failed");
+      used += OfflineQueue::RecordHeaderSize + msg.topic.size() + 1 + msg.payload.size();
+      expected.push_back(msg);
+    } else if (!expected.empty()) {
+      uint head = queue->_head;
+      if (!popCheck(queue, expected.front(), false, "wrap")) break;
+      used -= OfflineQueue::RecordHeaderSize + expected.front().topic.size() + 1 + expected.front().payload.size();
+      expected.pop_front();
+      if (queue->_head < head) wraps++;
+    }
+    CHECK(queue->_count == expected.size(), "wrap: count %u != %zu", queue->_count, expected.size());
+  }
+  CHECK(wraps > 100 && queue->_dropped == 0 && !logExists(), "wrap: %u wraps, %u dropped, log %d", wraps, queue->_dropped, logExists());
+  printf("  ring wrap: %u messages, %u wraps of the ring, 0 dropped\n", n, wraps);
+  delete queue;
+}
+
+// Without a usable flash the oldest messages are dropped, the newest ones stay in order
+static void testDropOldest() {
+  std::mt19937 rnd(2);
+  hostSetSPIFFSRoot("build/offline_fs/missing"); // every open fails
+  QueueProbe* queue = new QueueProbe();
+  queue->setup();
+  std::vector<Message> pushed;
+  for (uint n = 0; n < 500; n++) {
+    pushed.push_back(makeMessage(rnd, n));
+    CHECK(push(queue, pushed.back()), "drop: push failed");
+  }
+  uint kept = queue->_count;
+  CHECK(kept != 0 && queue->_dropped == pushed.size() - kept, "drop: %u kept, %u dropped of %zu", kept, queue->_dropped, pushed.size());
+  for (uint idx = pushed.size() - kept; idx < pushed.size(); idx++)
+    if (!popCheck(queue, pushed[idx], false, "drop")) break;
+  CHECK(queue->isEmpty(), "drop: not empty");
+
+  // A message over the ring size is refused, the queue is untouched
+  std::string big(STFMQTT_OFFLINE_SIZE, 'x');
+  CHECK(!queue->push("t", (const uint8_t*)big.data(), big.size(), 0) && queue->isEmpty(), "drop: oversized message");
+  printf("  drop oldest (no flash): %u kept of %zu, the newest ones in order\n", kept, pushed.size());
+  delete queue;
+}
+
+// Over the ring the oldest ones go to the log, all of them come back in order; over the log cap the oldest of the ring are dropped
+static void testSpill() {
+  std::mt19937 rnd(3);
+  QueueProbe* queue = fresh();
+  std::vector<Message> pushed;
+  uint bytes = 0;
+  while (bytes < STFMQTT_OFFLINE_FLASH_SIZE * 3 / 4) {
+    pushed.push_back(makeMessage(rnd, pushed.size()));
+    CHECK(push(queue, pushed.back()), "spill: push failed");
+    bytes += OfflineQueue::RecordHeaderSize + pushed.back().topic.size() + 1 + pushed.back().payload.size();
+  }
+  uint inLog = queue->_count - queue->_ringCount;
+  CHECK(queue->_dropped == 0 && logExists() && inLog != 0, "spill: %u dropped, %u in the log", queue->_dropped, inLog);
+  for (const Message& msg : pushed)
+    if (!popCheck(queue, msg, false, "spill")) break;
+  CHECK(queue->isEmpty() && !logExists(), "spill: log left after draining");
+  printf("  spill to flash: %zu messages (%u bytes), %u of them through the log, all back in order, log removed\n", pushed.size(), bytes, inLog);
+
+  // Log full: the log keeps the oldest ones, the ring the newest, the ones between are dropped
+  pushed.clear();
+  for (uint n = 0; n < 2000; n++) {
+    pushed.push_back(makeMessage(rnd, n));
+    push(queue, pushed.back());
+  }
+  inLog = queue->_count - queue->_ringCount;
+  uint ring = queue->_ringCount;
+  long logSize = logFileSize();
+  CHECK(logSize <= STFMQTT_OFFLINE_FLASH_SIZE && queue->_dropped == pushed.size() - queue->_count, "spill: log %ld bytes, %u dropped", logSize, queue->_dropped);
+  for (uint idx = 0; idx < inLog; idx++)
+    if (!popCheck(queue, pushed[idx], false, "log full")) break;
+  for (uint idx = pushed.size() - ring; idx < pushed.size(); idx++)
+    if (!popCheck(queue, pushed[idx], false, "log full")) break;
+  CHECK(queue->isEmpty(), "log full: not empty");
+  printf("  log full: %u in the log (%ld bytes), %u in the ring, %u dropped between them\n", inLog, logSize, ring, queue->_dropped);
+  delete queue;
+}
+
+// Pushes messages until the log holds at least logCount records and the ring is not empty
+static void fillLog(QueueProbe* queue, std::mt19937& rnd, std::vector<Message>& pushed, uint logCount) {
+  while (queue->_count - queue->_ringCount < logCount || queue->_ringCount == 0) {
+    pushed.push_back(makeMessage(rnd, pushed.size()));
+    CHECK(push(queue, pushed.back()), "push failed");
+  }
+}
+
+// Reboot: the log is replayed from the last stored read offset (at most 16 messages again), the RAM part is lost;
+// the messages pushed after the reboot are appended to the same log and follow the old ones
+static void testReplay() {
+  std::mt19937 rnd(4);
+  QueueProbe* queue = fresh();
+  std::vector<Message> pushed;
+  fillLog(queue, rnd, pushed, 60);
+  uint inLog = queue->_count - queue->_ringCount;
+  for (uint idx = 0; idx < 20; idx++) popCheck(queue, pushed[idx], false, "replay");
+
+  queue = reboot(queue);
+  CHECK(queue->_count == inLog - 16, "replay: %u messages after reboot instead of %u", queue->_count, inLog - 16);
+  uint idx = 16;
+  for (; idx < 26; idx++) popCheck(queue, pushed[idx], true, "replay");
+
+  std::vector<Message> after;
+  for (uint n = 0; n < 60; n++) {
+    after.push_back(makeMessage(rnd, 100000 + n));
+    CHECK(push(queue, after.back()), "replay: push failed");
+  }
+  CHECK(queue->_count - queue->_ringCount > inLog - 26, "replay: nothing appended to the log");
+  for (; idx < inLog; idx++)
+    if (!popCheck(queue, pushed[idx], true, "replay")) break;
+  for (const Message& msg : after)
+    if (!popCheck(queue, msg, false, "replay (after reboot)")) break;
+  CHECK(queue->isEmpty() && !logExists(), "replay: log left after draining");
+  printf("  previous boot replay: %u in the log, 20 sent before the reboot, %u replayed (16 again), 60 new ones behind them\n", inLog,
+         inLog - 16);
+  delete queue;
+}
+
+// Power loss while writing the log: the truncated record is cut off, the log goes on after the complete ones
+static void testTruncatedLog() {
+  std::mt19937 rnd(5);
+  QueueProbe* queue = fresh();
+  std::vector<Message> pushed;
+  fillLog(queue, rnd, pushed, 40);
+  uint inLog = queue->_count - queue->_ringCount;
+  long size = logFileSize();
+  delete queue;
+  CHECK(truncate(g_logPath.c_str(), size - 7) == 0, "truncate failed");
+
+  queue = new QueueProbe();
+  queue->setup();
+  CHECK(queue->_count == inLog - 1, "truncated: %u messages after reboot instead of %u", queue->_count, inLog - 1);
+
+  // New records after the complete ones, read back also after one more reboot
+  std::vector<Message> after;
+  fillLog(queue, rnd, after, inLog + 20);
+  uint total = queue->_count - queue->_ringCount;
+  queue = reboot(queue);
+  CHECK(queue->_count == total, "truncated: %u messages after the second reboot instead of %u", queue->_count, total);
+  uint idx = 0;
+  for (; idx < inLog - 1; idx++)
+    if (!popCheck(queue, pushed[idx], true, "truncated")) break;
+  for (idx = 0; idx < total - (inLog - 1); idx++)
+    if (!popCheck(queue, after[idx], true, "truncated (appended)")) break;
+  CHECK(queue->isEmpty() && !logExists(), "truncated: log left after draining");
+  printf("  truncated log: %u complete records kept, %u appended after them, all read back after a reboot\n", inLog - 1,
+         total - (inLog - 1));
+  delete queue;
+}
+
+int main() {
+  mkdir("build", 0755);
+  mkdir(g_root, 0755);
+  g_logPath = std::string(g_root) + QueueProbe::_logName;
+  printf("offline queue, ring %u bytes, log cap %u bytes:\n", STFMQTT_OFFLINE_SIZE, STFMQTT_OFFLINE_FLASH_SIZE);
+  testRingWrap();
+  testDropOldest();
+  testSpill();
+  testReplay();
+  testTruncatedLog();
+  unlink(g_logPath.c_str());
+  return g_failed == 0 ? 0 : 1;
+}